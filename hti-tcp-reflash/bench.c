@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * hti-reflash-bench - How fast the reflash code is, in numbers that can
+ * be compared between releases
+ *
+ * Runs reflash_device(), exactly as hti-tcp-reflash does for a single
+ * device, against hti-mock-device on a loopback address, once per entry
+ * of bench_cases[].  Each case has its own synthetic image, made from a
+ * fixed seed, and its own network: reply latency, jitter and the chance
+ * of the connection dropping at each command, also from a fixed seed.
+ * No journal, profile or checksum is used, so every case erases and
+ * writes the whole image.
+ *
+ * The output is one line per case, in fixed columns, with a '#' header
+ * naming them.  Times are wall-clock seconds, except @cpu_s, which is
+ * the CPU time of the reflash code itself, user and system, the device
+ * not counted.  A case that fails says so in place of its numbers.
+ *
+ * Run it with "make bench".
+ */
+#include "reflash.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_ADDR "127.0.18.1"
+#define BENCH_FORMAT_VERSION 1
+
+/**
+ * struct bench_case_t - One benchmark run
+ * @target:    Kind of device, so also its dialect
+ * @kib:       Image size, KiB of data
+ * @rec:       Data bytes per S-record
+ * @window:    struct reflash_opts_t @window
+ * @rtt_ms:    Latency the device adds to each reply
+ * @jitter_ms: Random extra latency, up to this much
+ * @drop:      Chance of the device dropping the connection at a command
+ * @erase_ms:  How long the device takes to erase
+ */
+static const struct bench_case_t {
+        const char *target;
+        int kib;
+        int rec;
+        int window;
+        double rtt_ms;
+        double jitter_ms;
+        double drop;
+        double erase_ms;
+} bench_cases[] = {
+        { "p620", 64, 32, 1, 0.0, 0.0, 0.0, 100 },
+        { "p620", 64, 32, 1, 1.0, 0.0, 0.0, 100 },
+        { "p620", 64, 32, 16, 1.0, 0.0, 0.0, 100 },
+        { "p620", 256, 16, 64, 0.0, 0.0, 0.0, 100 },
+        { "p620", 256, 120, 16, 1.0, 0.0, 0.0, 100 },
+        { "p620", 64, 32, 16, 1.0, 0.5, 0.0, 100 },
+        { "p620", 64, 32, 16, 1.0, 0.5, 0.0005, 100 },
+        { "t680", 64, 32, 1, 1.0, 0.0, 0.0, 1000 },
+        { "p900", 64, 32, 1, 0.0, 0.0, 0.0, 100 },
+        { "p900", 64, 32, 1, 1.0, 0.0, 0.0, 100 },
+        { "p900", 256, 120, 1, 1.0, 0.0, 0.0, 100 },
+        { NULL },
+};
+
+/* Same numbers every run */
+static uint32_t
+xorshift32(uint32_t *s)
+{
+        *s ^= *s << 13;
+        *s ^= *s >> 17;
+        *s ^= *s << 5;
+        return *s;
+}
+
+static void
+put_srec(FILE *fp, char type, uint32_t addr, int alen,
+         const unsigned char *data, int len)
+{
+        unsigned int sum = alen + len + 1;
+        int i;
+
+        fprintf(fp, "S%c%02X", type, alen + len + 1);
+        for (i = alen; i-- > 0; ) {
+                sum += (addr >> (8 * i)) & 0xff;
+                fprintf(fp, "%02X", (addr >> (8 * i)) & 0xff);
+        }
+        for (i = 0; i < len; ++i) {
+                sum += data[i];
+                fprintf(fp, "%02X", data[i]);
+        }
+        fprintf(fp, "%02X\n", ~sum & 0xff);
+}
+
+/* S2 records of @c->rec bytes from address 0, then S8 */
+static struct srec_image_t *
+bench_image(const struct bench_case_t *c)
+{
+        unsigned char data[128];
+        uint32_t seed = 0x2545f491u, addr;
+        uint32_t size = c->kib * 1024u;
+        struct srec_image_t *img;
+        FILE *fp;
+        int i;
+
+        if ((fp = tmpfile()) == NULL)
+                return NULL;
+        put_srec(fp, '0', 0, 2, (const unsigned char *)"bench", 5);
+        for (addr = 0; addr < size; addr += c->rec) {
+                int len = size - addr < (uint32_t)c->rec ? (int)(size - addr)
+                                                         : c->rec;
+                for (i = 0; i < len; ++i)
+                        data[i] = xorshift32(&seed);
+                put_srec(fp, '2', addr, 3, data, len);
+        }
+        put_srec(fp, '8', 0, 3, NULL, 0);
+        rewind(fp);
+        img = srec_load(fp, "bench image", stderr);
+        fclose(fp);
+        return img;
+}
+
+/* Start the device for @c; return its pid once it takes connections */
+static pid_t
+bench_device(const char *mock, const struct bench_case_t *c)
+{
+        char lat[32], jit[32], drop[32], erase[32];
+        struct sockaddr_in sin;
+        pid_t pid;
+        int i, fd, devnull;
+
+        snprintf(lat, sizeof(lat), "%g", c->rtt_ms);
+        snprintf(jit, sizeof(jit), "%g", c->jitter_ms);
+        snprintf(drop, sizeof(drop), "%g", c->drop);
+        snprintf(erase, sizeof(erase), "%g", c->erase_ms);
+        if ((pid = fork()) < 0)
+                return -1;
+        if (pid == 0) {
+                if ((devnull = open("/dev/null", O_WRONLY)) >= 0) {
+                        dup2(devnull, STDOUT_FILENO);
+                        dup2(devnull, STDERR_FILENO);
+                }
+                execl(mock, mock, "-a", BENCH_ADDR, "-l", lat, "-J", jit,
+                      "-x", drop, "-E", erase, "-S", "1", c->target,
+                      (char *)NULL);
+                _exit(127);
+        }
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(HTI_PORT);
+        inet_pton(AF_INET, BENCH_ADDR, &sin.sin_addr);
+        for (i = 0; i < 300; ++i) {
+                if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+                        break;
+                if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0) {
+                        close(fd);
+                        return pid;
+                }
+                close(fd);
+                if (waitpid(pid, NULL, WNOHANG) == pid)
+                        return -1;
+                usleep(10000);
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+}
+
+static double
+cpu_secs(void)
+{
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6
+               + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+static double
+phase_secs(const struct reflash_stats_t *st, const char *name)
+{
+        int i;
+
+        for (i = 0; i < st->nphase; ++i) {
+                if (!strcmp(st->phase[i].name, name))
+                        return st->phase[i].secs;
+        }
+        return 0.0;
+}
+
+/* Run @c, printing its line; return 0, or -1 if it failed */
+static int
+bench_run(const char *mock, const struct bench_case_t *c)
+{
+        const struct reflash_target_t *t = reflash_target(c->target);
+        struct reflash_stats_t st;
+        struct reflash_opts_t opts;
+        struct srec_image_t *img;
+        double wall, cpu, write;
+        int res, out, err, devnull;
+        pid_t pid;
+
+        printf("%-7s %5d %5d %6d %7.2f %7.2f %7.4f ", c->target, c->kib,
+               c->rec, c->window, c->rtt_ms, c->jitter_ms, c->drop);
+        fflush(stdout);
+        if (t == NULL || (img = bench_image(c)) == NULL) {
+                printf("FAILED: no image\n");
+                return -1;
+        }
+        if ((pid = bench_device(mock, c)) < 0) {
+                printf("FAILED: %s does not start\n", mock);
+                srec_free(img);
+                return -1;
+        }
+
+        reflash_opts_init(&opts);
+        opts.window = c->window;
+        opts.retries = 100;
+
+        /* What the reflash code prints is not part of the results */
+        out = dup(STDOUT_FILENO);
+        err = dup(STDERR_FILENO);
+        devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+
+        cpu = cpu_secs();
+        wall = stats_now();
+        res = reflash_device(BENCH_ADDR, img, t, &opts, &st);
+        wall = stats_now() - wall;
+        cpu = cpu_secs() - cpu;
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+        close(out);
+        close(err);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+
+        write = phase_secs(&st, "write");
+        if (res < 0) {
+                printf("FAILED: %s\n", st.result);
+        } else {
+                printf("%7d %8.3f %8.3f %8.3f %10.1f %7.3f %4u\n",
+                       img->nrec, wall, phase_secs(&st, "erase"), write,
+                       write > 0.0 ? st.records / write : 0.0, cpu,
+                       st.reconnects);
+        }
+        srec_free(img);
+        return res;
+}
+
+int
+main(int argc, char **argv)
+{
+        const struct bench_case_t *c;
+        int nfail = 0;
+
+        if (argc != 2) {
+                fprintf(stderr, "Usage: %s path/to/hti-mock-device\n",
+                        argv[0]);
+                exit(1);
+        }
+        signal(SIGPIPE, SIG_IGN);
+        printf("# hti-reflash-bench %d\n", BENCH_FORMAT_VERSION);
+        printf("%-7s %5s %5s %6s %7s %7s %7s %7s %8s %8s %8s %10s %7s "
+               "%4s\n", "#target", "kib", "rec", "window", "rtt_ms",
+               "jit_ms", "drop", "records", "wall_s", "erase_s", "write_s",
+               "rec_per_s", "cpu_s", "reco");
+        for (c = bench_cases; c->target != NULL; ++c) {
+                if (bench_run(argv[1], c) < 0)
+                        ++nfail;
+        }
+        return nfail == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
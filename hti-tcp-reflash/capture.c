@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Wire transcripts
+ *
+ * With capture on, every line sent to a device and every line it sends
+ * back go into a ring buffer allocated up front, stamped with the time
+ * they went or came, along with connects, lost connections, timeouts
+ * and the error the reflash failed with.  Nothing touches the disk until
+ * capture_save() at the end of the device's run, which writes what the
+ * ring still holds: the latest CAPTURE_RING bytes' worth, which is where
+ * a failure is.  Adding a line costs a clock_gettime() and a memcpy(),
+ * so capture can stay on while writing at full speed.
+ *
+ * The file is <device>-<local time>.cap: a magic line, a line naming
+ * the device and one counting the entries the ring dropped, then the
+ * entries, oldest first, each
+ *
+ *   8 bytes  nanoseconds since the capture started, little-endian
+ *   1 byte   CAPTURE_xxx kind
+ *   2 bytes  length of the text, little-endian
+ *   text     the line without its line ending, or what happened
+ *
+ * hti-replay prints a transcript, or plays the device's side of it back
+ * to hti-tcp-reflash with the original timing.
+ */
+#include "reflash.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CAPTURE_MAGIC "hti-tcp-reflash capture 1"
+
+enum {
+        /* Timestamp, kind and length */
+        CAPTURE_HDR = 11,
+        CAPTURE_NAME_MAX = 256,
+};
+
+/*
+ * @used bytes of entries start at @head and may wrap around the end of
+ * @ring.  An entry that does not fit pushes the oldest ones out.
+ */
+struct reflash_capture_t {
+        char device[CAPTURE_NAME_MAX];
+        struct timespec start;
+        unsigned long dropped;
+        size_t head;
+        size_t used;
+        unsigned char ring[CAPTURE_RING];
+};
+
+/**
+ * capture_new - Start a transcript of the connection to @device
+ *
+ * Return: The transcript, or NULL if out of memory
+ */
+struct reflash_capture_t *
+capture_new(const char *device)
+{
+        struct reflash_capture_t *c = malloc(sizeof(*c));
+
+        if (c == NULL)
+                return NULL;
+        snprintf(c->device, sizeof(c->device), "%s", device);
+        clock_gettime(CLOCK_MONOTONIC, &c->start);
+        c->dropped = 0;
+        c->head = 0;
+        c->used = 0;
+        return c;
+}
+
+/* Copy @len bytes at @src to offset @at of the ring, wrapping */
+static void
+ring_put(struct reflash_capture_t *c, size_t at, const void *src, size_t len)
+{
+        size_t n;
+
+        at %= CAPTURE_RING;
+        n = CAPTURE_RING - at;
+        if (n > len)
+                n = len;
+        memcpy(&c->ring[at], src, n);
+        memcpy(c->ring, (const unsigned char *)src + n, len - n);
+}
+
+static unsigned char
+ring_byte(const struct reflash_capture_t *c, size_t at)
+{
+        return c->ring[at % CAPTURE_RING];
+}
+
+/**
+ * capture_add - Add an entry to @c, if not NULL
+ * @kind: CAPTURE_xxx
+ * @text: The line, or what happened
+ * @len:  Its length; anything past CAPTURE_TEXT_MAX is left out
+ */
+void
+capture_add(struct reflash_capture_t *c, int kind, const char *text,
+            size_t len)
+{
+        unsigned char hdr[CAPTURE_HDR];
+        struct timespec now;
+        uint64_t ns;
+        int i;
+
+        if (c == NULL)
+                return;
+        if (len > CAPTURE_TEXT_MAX)
+                len = CAPTURE_TEXT_MAX;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = (uint64_t)(now.tv_sec - c->start.tv_sec) * 1000000000u
+             + now.tv_nsec - c->start.tv_nsec;
+        for (i = 0; i < 8; ++i)
+                hdr[i] = ns >> (8 * i);
+        hdr[8] = kind;
+        hdr[9] = len & 0xff;
+        hdr[10] = len >> 8;
+
+        while (CAPTURE_RING - c->used < CAPTURE_HDR + len) {
+                size_t old = ring_byte(c, c->head + 9)
+                             | ring_byte(c, c->head + 10) << 8;
+
+                c->head = (c->head + CAPTURE_HDR + old) % CAPTURE_RING;
+                c->used -= CAPTURE_HDR + old;
+                c->dropped++;
+        }
+        ring_put(c, c->head + c->used, hdr, CAPTURE_HDR);
+        ring_put(c, c->head + c->used + CAPTURE_HDR, text, len);
+        c->used += CAPTURE_HDR + len;
+}
+
+/**
+ * capture_note - Add an entry of printf-formatted text to @c, if not
+ *                NULL, without the line endings it starts or ends with
+ *
+ * errno is left as it was, so an error can be noted before it is
+ * returned.
+ */
+void
+capture_note(struct reflash_capture_t *c, int kind, const char *fmt, ...)
+{
+        char msg[256];
+        const char *p = msg;
+        int err = errno;
+        va_list ap;
+        size_t len;
+
+        if (c == NULL)
+                return;
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        while (*p == '\n')
+                ++p;
+        len = strlen(p);
+        while (len > 0 && p[len - 1] == '\n')
+                --len;
+        capture_add(c, kind, p, len);
+        errno = err;
+}
+
+/**
+ * capture_save - Write @c out to a new file in @dir
+ * @c:    Transcript
+ * @dir:  Directory, created if need be
+ * @path: Set to the file's name
+ * @size: Size of @path
+ *
+ * Return: 0, or -1 with errno set
+ */
+int
+capture_save(const struct reflash_capture_t *c, const char *dir, char *path,
+             size_t size)
+{
+        char device[CAPTURE_NAME_MAX], stamp[32];
+        time_t now = time(NULL);
+        size_t at, n;
+        char *p;
+        FILE *fp;
+        int err;
+
+        snprintf(device, sizeof(device), "%s", c->device);
+        for (p = device; *p != '\0'; ++p) {
+                if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-')
+                        *p = '_';
+        }
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+        snprintf(path, size, "%s/%s-%s.cap", dir, device, stamp);
+        if (mkdir_p(dir) < 0 || (fp = fopen(path, "wb")) == NULL)
+                return -1;
+        fprintf(fp, "%s\ndevice %s\ndropped %lu\n", CAPTURE_MAGIC, c->device,
+                c->dropped);
+        at = c->head;
+        n = CAPTURE_RING - at < c->used ? CAPTURE_RING - at : c->used;
+        fwrite(&c->ring[at], 1, n, fp);
+        fwrite(c->ring, 1, c->used - n, fp);
+        if (ferror(fp)) {
+                err = errno;
+                fclose(fp);
+                errno = err;
+                return -1;
+        }
+        return fclose(fp) == 0 ? 0 : -1;
+}
+
+void
+capture_free(struct reflash_capture_t *c)
+{
+        free(c);
+}
+
+/**
+ * capture_open - Open a transcript capture_save() wrote
+ * @path:    File name
+ * @device:  Set to the device it is of
+ * @size:    Size of @device
+ * @dropped: Set to the number of entries lost to the ring before the
+ *           first one in the file
+ *
+ * Return: The file, positioned at the first entry, or NULL with errno
+ * set, EINVAL if it is no transcript
+ */
+FILE *
+capture_open(const char *path, char *device, size_t size,
+             unsigned long *dropped)
+{
+        char line[CAPTURE_NAME_MAX + 16];
+        FILE *fp;
+        size_t len;
+
+        if ((fp = fopen(path, "rb")) == NULL)
+                return NULL;
+        if (fgets(line, sizeof(line), fp) == NULL
+            || strcmp(line, CAPTURE_MAGIC "\n") != 0
+            || fgets(line, sizeof(line), fp) == NULL
+            || strncmp(line, "device ", 7) != 0)
+                goto bad;
+        len = strcspn(line + 7, "\n");
+        snprintf(device, size, "%.*s", (int)len, line + 7);
+        if (fgets(line, sizeof(line), fp) == NULL
+            || sscanf(line, "dropped %lu", dropped) != 1)
+                goto bad;
+        return fp;
+
+bad:
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+}
+
+/**
+ * capture_read - Read the next entry of a transcript
+ * @fp: From capture_open()
+ * @e:  Where the entry goes; its text is nul-terminated
+ *
+ * Return: 1, 0 at the end, or -1 if the file is cut short
+ */
+int
+capture_read(FILE *fp, struct capture_entry_t *e)
+{
+        unsigned char hdr[CAPTURE_HDR];
+        size_t n;
+        int i;
+
+        if ((n = fread(hdr, 1, sizeof(hdr), fp)) == 0)
+                return 0;
+        if (n != sizeof(hdr))
+                return -1;
+        e->ns = 0;
+        for (i = 7; i >= 0; --i)
+                e->ns = e->ns << 8 | hdr[i];
+        e->kind = hdr[8];
+        e->len = hdr[9] | hdr[10] << 8;
+        if (e->len > CAPTURE_TEXT_MAX
+            || fread(e->text, 1, e->len, fp) != e->len)
+                return -1;
+        e->text[e->len] = '\0';
+        return 1;
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Looking devices up and connecting to them, for io.c and fleet.c.
+ *
+ * connect_resolve() asks the resolver about each host once per cache and
+ * hands out the same answer after that, so reconnects and fleets do not
+ * keep going back to DNS.  Each connection or session keeps its own
+ * cache, so there is no state shared between them.
+ *
+ * A struct connect_race_t connects to every address a host resolves
+ * to, IPv6 and IPv4 alike, the happy-eyeballs way (RFC 8305): addresses
+ * alternate between the families, a new attempt starts every
+ * CONNECT_STAGGER seconds, or at once when the last one failed, without
+ * giving up on those still pending, and the first to connect wins.  So
+ * a stale address costs a quarter of a second, not a SYN timeout.
+ * Nothing here blocks: io.c waits in poll(), fleet.c in epoll_wait().
+ */
+#include "reflash.h"
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Seconds to give an attempt before starting the next one alongside */
+#define CONNECT_STAGGER 0.25
+
+/* One host in a cache, see connect_resolve() */
+struct connect_cache_t {
+        struct connect_cache_t *next;
+        struct addrinfo *list;
+        char node[];
+};
+
+/**
+ * connect_resolve - Look up a device's addresses, once per cache
+ * @cache: Head of the cache, NULL to start with
+ * @node:  Host name or address
+ * @list:  Set to the addresses, which stay valid until connect_forget()
+ *
+ * Return: 0, or a getaddrinfo() error code for gai_strerror().  Failures
+ * are not remembered.
+ */
+int
+connect_resolve(struct connect_cache_t **cache, const char *node,
+                const struct addrinfo **list)
+{
+        struct connect_cache_t *e;
+        struct addrinfo hints;
+        struct addrinfo *res;
+        int err;
+
+        for (e = *cache; e != NULL; e = e->next) {
+                if (!strcmp(e->node, node)) {
+                        *list = e->list;
+                        return 0;
+                }
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        err = getaddrinfo(node, HTI_SERVICE, &hints, &res);
+        if (err != 0)
+                return err;
+
+        e = malloc(sizeof(*e) + strlen(node) + 1);
+        if (e == NULL) {
+                freeaddrinfo(res);
+                return EAI_MEMORY;
+        }
+        strcpy(e->node, node);
+        e->list = res;
+        e->next = *cache;
+        *cache = e;
+        *list = res;
+        return 0;
+}
+
+/**
+ * connect_forget - Drop every address connect_resolve() remembered in
+ *                  @cache, and empty it
+ */
+void
+connect_forget(struct connect_cache_t **cache)
+{
+        while (*cache != NULL) {
+                struct connect_cache_t *e = *cache;
+                *cache = e->next;
+                freeaddrinfo(e->list);
+                free(e);
+        }
+}
+
+/* Start attempt @i; return 1 if connected already, 0 if pending, -1 */
+static int
+race_launch(struct connect_race_t *r, int i)
+{
+        const struct addrinfo *ai = r->ai[i];
+        int fd;
+
+        fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0) {
+                r->err = errno;
+                return -1;
+        }
+        r->fd[i] = fd;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                return 1;
+        if (errno == EINPROGRESS)
+                return 0;
+        r->err = errno;
+        close(fd);
+        r->fd[i] = -1;
+        return -1;
+}
+
+static int
+race_npending(const struct connect_race_t *r)
+{
+        int i, n = 0;
+        for (i = 0; i < r->next; ++i)
+                n += r->fd[i] >= 0;
+        return n;
+}
+
+/* Hand over the winner, attempt @i, and close the rest */
+static int
+race_won(struct connect_race_t *r, int i)
+{
+        int fd = r->fd[i];
+
+        r->fd[i] = -1;
+        r->winner = r->ai[i];
+        connect_race_cancel(r);
+        return fd;
+}
+
+/**
+ * connect_race_start - Start connecting to any of a device's addresses
+ * @r:       Race, which need not be initialised
+ * @list:    Addresses from connect_resolve()
+ * @timeout: Seconds before giving up on all of them
+ *
+ * Return: As connect_race_step()
+ */
+int
+connect_race_start(struct connect_race_t *r, const struct addrinfo *list,
+                   double timeout)
+{
+        const struct addrinfo *ai, *fam[2] = { NULL, NULL };
+        int i;
+
+        memset(r, 0, sizeof(*r));
+        for (i = 0; i < CONNECT_MAX; ++i)
+                r->fd[i] = -1;
+
+        /* Alternate families, starting with whichever the resolver put first */
+        fam[0] = list;
+        for (ai = list; ai != NULL; ai = ai->ai_next) {
+                if (ai->ai_family != list->ai_family) {
+                        fam[1] = ai;
+                        break;
+                }
+        }
+        while (r->nai < CONNECT_MAX && (fam[0] != NULL || fam[1] != NULL)) {
+                for (i = 0; i < 2 && r->nai < CONNECT_MAX; ++i) {
+                        int want;
+
+                        if (fam[i] == NULL)
+                                continue;
+                        want = fam[i]->ai_family;
+                        r->ai[r->nai++] = fam[i];
+                        do
+                                fam[i] = fam[i]->ai_next;
+                        while (fam[i] != NULL && fam[i]->ai_family != want);
+                }
+        }
+
+        r->err = EHOSTUNREACH;
+        r->next_at = stats_now();
+        r->deadline = r->next_at + timeout;
+        return connect_race_step(r);
+}
+
+/**
+ * connect_race_step - Move a race along; call when a pending socket is
+ *                     ready or connect_race_timeout() has passed
+ *
+ * Return: The connected socket, non-blocking, with @r->winner set to its
+ * address.  Otherwise -1 with errno EINPROGRESS if the race is still on,
+ * or the reason it was lost: ETIMEDOUT once the deadline passes, else
+ * the last attempt's error.
+ */
+int
+connect_race_step(struct connect_race_t *r)
+{
+        struct pollfd pfd[CONNECT_MAX];
+        int idx[CONNECT_MAX];
+        double now;
+        int i, n, failed;
+
+        do {
+                now = stats_now();
+                /* Next attempt, when due or when nothing else is left */
+                while (r->next < r->nai
+                       && (now >= r->next_at || race_npending(r) == 0)) {
+                        int res = race_launch(r, r->next++);
+                        if (res > 0)
+                                return race_won(r, r->next - 1);
+                        if (res == 0) {
+                                r->next_at = now + CONNECT_STAGGER;
+                                break;
+                        }
+                }
+
+                n = 0;
+                for (i = 0; i < r->next; ++i) {
+                        if (r->fd[i] < 0)
+                                continue;
+                        pfd[n].fd = r->fd[i];
+                        pfd[n].events = POLLOUT;
+                        idx[n++] = i;
+                }
+                if (n > 0 && poll(pfd, n, 0) < 0 && errno != EINTR) {
+                        r->err = errno;
+                        connect_race_cancel(r);
+                        errno = r->err;
+                        return -1;
+                }
+
+                failed = 0;
+                for (i = 0; i < n; ++i) {
+                        int err = 0;
+                        socklen_t len = sizeof(err);
+
+                        if (pfd[i].revents == 0)
+                                continue;
+                        if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR,
+                                       &err, &len) < 0) {
+                                err = errno;
+                        }
+                        if (err == 0)
+                                return race_won(r, idx[i]);
+                        r->err = err;
+                        close(r->fd[idx[i]]);
+                        r->fd[idx[i]] = -1;
+                        failed = 1;
+                }
+                /* A failure lets the next address go right away */
+        } while (failed && r->next < r->nai);
+
+        if (race_npending(r) == 0 && r->next == r->nai) {
+                errno = r->err;
+                return -1;
+        }
+        if (now >= r->deadline) {
+                connect_race_cancel(r);
+                errno = ETIMEDOUT;
+                return -1;
+        }
+        errno = EINPROGRESS;
+        return -1;
+}
+
+/**
+ * connect_race_timeout - Milliseconds until connect_race_step() is due
+ *                        even if no socket becomes ready
+ */
+int
+connect_race_timeout(const struct connect_race_t *r)
+{
+        double due = r->deadline, now = stats_now();
+
+        if (r->next < r->nai && r->next_at < due)
+                due = r->next_at;
+        return due > now ? (int)((due - now) * 1000.0) + 1 : 0;
+}
+
+/**
+ * connect_race_fds - The sockets still connecting
+ * @r:   Race
+ * @fds: Room for CONNECT_MAX sockets
+ *
+ * Return: How many were stored in @fds
+ */
+int
+connect_race_fds(const struct connect_race_t *r, int *fds)
+{
+        int i, n = 0;
+        for (i = 0; i < r->next; ++i) {
+                if (r->fd[i] >= 0)
+                        fds[n++] = r->fd[i];
+        }
+        return n;
+}
+
+/**
+ * connect_race_cancel - Close every attempt still pending
+ */
+void
+connect_race_cancel(struct connect_race_t *r)
+{
+        int i;
+        for (i = 0; i < r->next; ++i) {
+                if (r->fd[i] >= 0) {
+                        close(r->fd[i]);
+                        r->fd[i] = -1;
+                }
+        }
+}
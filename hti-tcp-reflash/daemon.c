@@ -0,0 +1,1254 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Reflash daemon
+ *
+ * reflash_daemon() listens on a Unix socket and takes jobs from local
+ * clients, one per line:
+ *
+ *      TARGET HOST PATH
+ *
+ * PATH being the absolute path of the upgrade file.  Every line sent
+ * back about a job starts with the number the daemon gave it:
+ *
+ *      N queued
+ *      N image cached|loaded SECONDS   how long finding the image took
+ *      N started SECONDS               time spent waiting for a turn
+ *      N log TEXT                      what is happening to the device
+ *      N progress RECORDS TOTAL        a few times a second at most
+ *      N stats JSON                    as --stats=json prints it
+ *      N done RESULT RECORDS SECONDS [ERROR]
+ *
+ * RESULT is ok, current or failed.  "done" ends every job, one refused
+ * outright too.  A client may send any number of jobs, and may go away
+ * without stopping them.
+ *
+ * Images stay in memory, parsed, checked and shaped for their target,
+ * under the FNV-1a hash of the file's bytes, so a file is not parsed
+ * again for as long as its content stays the same; one whose size,
+ * inode and modification time have not changed is not even read.  Jobs
+ * for one image share a struct reflash_session_t, which encodes the
+ * write commands once and looks each host up once.  It is replaced
+ * once idle and DAEMON_SESSION_AGE seconds old, so host addresses do
+ * not go stale.  At most @opts->jobs jobs run at once, and one at a
+ * time for each host; the others wait their turn in order.
+ *
+ * It is all one thread around one epoll set, holding the socket, the
+ * clients and the sessions' own epoll sets, but for reading upgrade
+ * files: hashing and parsing one takes long enough to stall the
+ * sessions, so each is read on a thread of its own, which hands it
+ * back through a pipe in the same set.  Jobs for a file being read
+ * wait for that read.
+ */
+#include "reflash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum {
+        /* Longest job line, and most of one kept while incomplete */
+        DAEMON_LINE_MAX = 4096,
+        /* Unsent output a client may let pile up before it is dropped */
+        DAEMON_OUT_MAX = 1 << 20,
+        /* Images kept when not in use */
+        DAEMON_IMAGES = 8,
+        DAEMON_NEVENTS = 32,
+        /* Seconds an idle session is kept, host addresses and all */
+        DAEMON_SESSION_AGE = 300,
+};
+
+/* Seconds between a job's progress lines */
+#define DAEMON_PROGRESS_EVERY 0.25
+
+
+struct daemon_t;
+
+struct daemon_client_t {
+        struct daemon_client_t *next;
+        struct daemon_t *d;
+        int fd;                 /* -1 once closed, until freed */
+        char in[DAEMON_LINE_MAX];
+        size_t nin;
+        char *out;
+        size_t nout;
+        size_t outsize;
+};
+
+/**
+ * struct daemon_job_t - One device to reflash, for a client
+ * @next:      Next in the queue
+ * @id:        Number the client knows it by
+ * @c:         Client to tell about it, or NULL once gone
+ * @im:        Image to write
+ * @host:      Device
+ * @submitted: stats_now() when it came in
+ * @reported:  stats_now() at the last progress line
+ * @running:   Nonzero from when a session takes it until it is done
+ * @held:      Nonzero once told it waits for another job on @host
+ * @stats:     How its time went, for the session to fill in
+ */
+struct daemon_job_t {
+        struct daemon_job_t *next;
+        unsigned long id;
+        struct daemon_client_t *c;
+        struct daemon_image_t *im;
+        char *host;
+        double submitted;
+        double reported;
+        int running;
+        int held;
+        struct reflash_stats_t stats;
+};
+
+/**
+ * struct daemon_image_t - An upgrade file, ready to write
+ * @next:  Next in the cache
+ * @t:     Target it was shaped for
+ * @hash:  FNV-1a of the file's bytes
+ * @path:  Where it was last read from
+ * @st:    stat() of @path then
+ * @img:   The image
+ * @sess:  Session its jobs run in, or NULL
+ * @born:  stats_now() when @sess was made
+ * @jobs:  Jobs given to @sess, by the index it gave them
+ * @njobs: Entries in @jobs
+ * @busy:  Jobs queued or running for it
+ * @used:  stats_now() when last asked for
+ * @d:     Daemon
+ */
+struct daemon_image_t {
+        struct daemon_image_t *next;
+        const struct reflash_target_t *t;
+        uint64_t hash;
+        char *path;
+        struct stat st;
+        struct srec_image_t *img;
+        struct reflash_session_t *sess;
+        double born;
+        struct daemon_job_t **jobs;
+        int njobs;
+        int busy;
+        double used;
+        struct daemon_t *d;
+};
+
+/**
+ * struct daemon_load_t - An upgrade file being read on a thread of its
+ *                        own, and the jobs waiting for it
+ * @next:      Next load under way
+ * @d:         Daemon
+ * @t:         Target to shape it for
+ * @path:      File
+ * @st:        stat() of @path before it was read
+ * @known:     Hashes of the images cached for @t when it started
+ * @nknown:    Entries in @known
+ * @jobs:      Jobs waiting for it, linked by their @next
+ * @tail:      Where the next job waiting goes
+ * @hash:      FNV-1a of the file's bytes, from the thread
+ * @known_hit: Nonzero, from the thread, if @hash is one of @known, and
+ *             the file was not parsed
+ * @img:       The image, from the thread, or NULL
+ * @text:      What image_open() said, from the thread
+ * @len:       Length of @text
+ * @err:       errno, from the thread, if not even @text could be had
+ */
+struct daemon_load_t {
+        struct daemon_load_t *next;
+        struct daemon_t *d;
+        const struct reflash_target_t *t;
+        char *path;
+        struct stat st;
+        uint64_t *known;
+        int nknown;
+        struct daemon_job_t *jobs;
+        struct daemon_job_t **tail;
+        uint64_t hash;
+        int known_hit;
+        struct srec_image_t *img;
+        char *text;
+        size_t len;
+        int err;
+};
+
+struct daemon_t {
+        const struct reflash_opts_t *opts;
+        const struct image_opts_t *io;
+        volatile sig_atomic_t *stop;
+        FILE *log;
+        int ep;
+        int lfd;
+        struct daemon_client_t *clients;
+        struct daemon_image_t *images;
+        int nimages;
+        struct daemon_job_t *queue;
+        struct daemon_job_t **tail;
+        struct daemon_load_t *loads;
+        int loadfd[2];
+        int running;
+        unsigned long lastid;
+};
+
+/* What an epoll event is for, when not a client */
+static char listen_tag, session_tag, load_tag;
+
+/* A line for the daemon's own log */
+static void
+daemon_note(struct daemon_t *d, const char *fmt, ...)
+{
+        va_list ap;
+
+        if (d->log == NULL)
+                return;
+        va_start(ap, fmt);
+        vfprintf(d->log, fmt, ap);
+        va_end(ap);
+        fputc('\n', d->log);
+        fflush(d->log);
+}
+
+static int
+daemon_stopping(const struct daemon_t *d)
+{
+        return d->stop != NULL && *d->stop;
+}
+
+static void client_close(struct daemon_client_t *c);
+
+static void
+client_watch(struct daemon_client_t *c, int op)
+{
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | (c->nout > 0 ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(c->d->ep, op, c->fd, &ev);
+}
+
+static void
+client_flush(struct daemon_client_t *c)
+{
+        int was = c->nout > 0;
+        ssize_t n;
+
+        while (c->nout > 0) {
+                n = send(c->fd, c->out, c->nout, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                if (n < 0) {
+                        client_close(c);
+                        return;
+                }
+                memmove(c->out, c->out + n, c->nout - n);
+                c->nout -= n;
+        }
+        if (was != (c->nout > 0))
+                client_watch(c, EPOLL_CTL_MOD);
+}
+
+/* Send job @id's line, or the daemon's own if @id is 0 */
+static void
+client_vsend(struct daemon_client_t *c, unsigned long id, const char *fmt,
+             va_list ap)
+{
+        char prefix[24];
+        va_list aq;
+        size_t need;
+        int n, np;
+
+        if (c == NULL || c->fd < 0)
+                return;
+        np = snprintf(prefix, sizeof(prefix), "%lu ", id);
+        va_copy(aq, ap);
+        n = vsnprintf(NULL, 0, fmt, aq);
+        va_end(aq);
+        if (n < 0)
+                return;
+        need = c->nout + np + n + 2;
+        if (need > DAEMON_OUT_MAX) {
+                daemon_note(c->d, "Client not reading, dropped");
+                client_close(c);
+                return;
+        }
+        if (need > c->outsize) {
+                size_t size = c->outsize ? c->outsize : 4096;
+                char *tmp;
+
+                while (size < need)
+                        size *= 2;
+                if ((tmp = realloc(c->out, size)) == NULL) {
+                        client_close(c);
+                        return;
+                }
+                c->out = tmp;
+                c->outsize = size;
+        }
+        memcpy(c->out + c->nout, prefix, np);
+        vsnprintf(c->out + c->nout + np, n + 1, fmt, ap);
+        c->nout += np + n;
+        c->out[c->nout++] = '\n';
+        client_flush(c);
+}
+
+/*
+ * Tell @j's client.  A client closed by it, or before, is let go of at
+ * once: a job not yet in the queue or a session is not seen by
+ * client_close(), and the client is freed by the next client_reap().
+ */
+static void
+job_send(struct daemon_job_t *j, const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        client_vsend(j->c, j->id, fmt, ap);
+        va_end(ap);
+        if (j->c != NULL && j->c->fd < 0)
+                j->c = NULL;
+}
+
+static void
+job_free(struct daemon_job_t *j)
+{
+        free(j->host);
+        free(j);
+}
+
+/* Finish @j before it got to run; @why says what stopped it */
+static void
+job_refuse(struct daemon_t *d, struct daemon_job_t *j, const char *why)
+{
+        daemon_note(d, "Job %lu: %s", j->id, why);
+        job_send(j, "done failed 0 0.000 %s", why);
+        if (j->im != NULL)
+                j->im->busy--;
+        job_free(j);
+}
+
+static void
+client_close(struct daemon_client_t *c)
+{
+        struct daemon_t *d = c->d;
+        struct daemon_image_t *im;
+        struct daemon_load_t *l;
+        struct daemon_job_t *j;
+        int i;
+
+        if (c->fd < 0)
+                return;
+        epoll_ctl(d->ep, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+        /* Its jobs carry on, untold */
+        for (j = d->queue; j != NULL; j = j->next) {
+                if (j->c == c)
+                        j->c = NULL;
+        }
+        for (l = d->loads; l != NULL; l = l->next) {
+                for (j = l->jobs; j != NULL; j = j->next) {
+                        if (j->c == c)
+                                j->c = NULL;
+                }
+        }
+        for (im = d->images; im != NULL; im = im->next) {
+                for (i = 0; i < im->njobs; ++i) {
+                        if (im->jobs[i] != NULL && im->jobs[i]->c == c)
+                                im->jobs[i]->c = NULL;
+                }
+        }
+}
+
+/* Free the clients closed since last time */
+static void
+client_reap(struct daemon_t *d)
+{
+        struct daemon_client_t **pp = &d->clients, *c;
+
+        while ((c = *pp) != NULL) {
+                if (c->fd >= 0) {
+                        pp = &c->next;
+                        continue;
+                }
+                *pp = c->next;
+                free(c->out);
+                free(c);
+        }
+}
+
+/*
+ * Session callbacks
+ */
+static void
+daemon_log(void *arg, int dev, const char *msg)
+{
+        struct daemon_image_t *im = arg;
+
+        job_send(im->jobs[dev], "log %s", msg);
+}
+
+static void
+daemon_progress(void *arg, int dev, int from, int to, int written)
+{
+        struct daemon_image_t *im = arg;
+        struct daemon_job_t *j = im->jobs[dev];
+        double now = stats_now();
+
+        (void)from;
+        (void)written;
+        if (to < im->img->nrec && now - j->reported < DAEMON_PROGRESS_EVERY)
+                return;
+        j->reported = now;
+        job_send(j, "progress %d %d", to, im->img->nrec);
+}
+
+static void
+daemon_done(void *arg, int dev, const struct reflash_result_t *res)
+{
+        static const char *const names[] = { "failed", "ok", "current" };
+        struct daemon_image_t *im = arg;
+        struct daemon_job_t *j = im->jobs[dev];
+        const char *name = names[res->result - REFLASH_FAILED];
+        char *json = NULL;
+        size_t len;
+        FILE *fp;
+
+        if (j->c != NULL && (fp = open_memstream(&json, &len)) != NULL) {
+                stats_print(fp, &j->stats, REFLASH_STATS_JSON);
+                fclose(fp);
+                while (len > 0 && json[len - 1] == '\n')
+                        json[--len] = '\0';
+                job_send(j, "stats %s", json);
+                free(json);
+        }
+        job_send(j, "done %s %d %.3f%s%s", name, res->records, res->secs,
+                 res->error != NULL ? " " : "",
+                 res->error != NULL ? res->error : "");
+        daemon_note(im->d, "Job %lu: %s %s: %s%s%s", j->id, im->t->name,
+                    j->host, name, res->error != NULL ? ": " : "",
+                    res->error != NULL ? res->error : "");
+        j->running = 0;
+        im->busy--;
+        im->d->running--;
+}
+
+/* Done with @im's session, and the jobs it ran */
+static void
+image_retire(struct daemon_image_t *im)
+{
+        int i;
+
+        if (im->sess == NULL)
+                return;
+        epoll_ctl(im->d->ep, EPOLL_CTL_DEL, reflash_session_fd(im->sess),
+                  NULL);
+        reflash_session_free(im->sess);
+        im->sess = NULL;
+        for (i = 0; i < im->njobs; ++i)
+                job_free(im->jobs[i]);
+        free(im->jobs);
+        im->jobs = NULL;
+        im->njobs = 0;
+}
+
+static int
+image_start(struct daemon_image_t *im)
+{
+        struct reflash_callbacks_t cb = {
+                .arg = im,
+                .log = daemon_log,
+                .progress = daemon_progress,
+                .done = daemon_done,
+        };
+        struct epoll_event ev;
+
+        im->sess = reflash_session_new(im->img, im->t, im->d->opts, &cb);
+        if (im->sess == NULL)
+                return -1;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &session_tag;
+        if (epoll_ctl(im->d->ep, EPOLL_CTL_ADD, reflash_session_fd(im->sess),
+                      &ev) < 0) {
+                reflash_session_free(im->sess);
+                im->sess = NULL;
+                return -1;
+        }
+        im->born = stats_now();
+        return 0;
+}
+
+static void
+image_free(struct daemon_image_t *im)
+{
+        image_retire(im);
+        if (im->img != NULL)
+                srec_free(im->img);
+        free(im->path);
+        free(im);
+}
+
+/* Make room for one more image, if one not in use can go */
+static void
+image_evict(struct daemon_t *d)
+{
+        struct daemon_image_t **pp, **lru = NULL;
+
+        if (d->nimages < DAEMON_IMAGES)
+                return;
+        for (pp = &d->images; *pp != NULL; pp = &(*pp)->next) {
+                if ((*pp)->busy == 0
+                    && (lru == NULL || (*pp)->used < (*lru)->used))
+                        lru = pp;
+        }
+        if (lru != NULL) {
+                struct daemon_image_t *im = *lru;
+
+                *lru = im->next;
+                image_free(im);
+                d->nimages--;
+        }
+}
+
+static int
+same_file(const struct stat *a, const struct stat *b)
+{
+        return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+               && a->st_size == b->st_size
+               && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+               && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* FNV-1a of the bytes of @path, or -1 with errno set */
+static int
+hash_file(const char *path, uint64_t *hash)
+{
+        unsigned char buf[65536];
+        FILE *fp;
+        size_t n;
+        int err;
+
+        if ((fp = fopen(path, "r")) == NULL)
+                return -1;
+        *hash = SREC_FNV_BASIS;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+                *hash = srec_fnv1a(*hash, buf, n);
+        err = ferror(fp) ? EIO : 0;
+        fclose(fp);
+        errno = err;
+        return err ? -1 : 0;
+}
+
+static void
+load_free(struct daemon_load_t *l)
+{
+        struct daemon_job_t *j;
+
+        while ((j = l->jobs) != NULL) {
+                l->jobs = j->next;
+                job_free(j);
+        }
+        if (l->img != NULL)
+                srec_free(l->img);
+        free(l->text);
+        free(l->known);
+        free(l->path);
+        free(l);
+}
+
+/* Give @j @im, and put it in the queue */
+static void
+job_queue(struct daemon_t *d, struct daemon_job_t *j,
+          struct daemon_image_t *im)
+{
+        j->im = im;
+        im->busy++;
+        *d->tail = j;
+        d->tail = &j->next;
+}
+
+/*
+ * Loader thread: hash @l's file and, unless the hash is one of
+ * @l->known, parse it, then hand @l back through the daemon's pipe.  It
+ * touches nothing of the daemon's but what is never written.
+ */
+static void *
+load_thread(void *arg)
+{
+        struct daemon_load_t *l = arg;
+        struct stat after;
+        FILE *fp;
+        int i;
+
+        if ((fp = open_memstream(&l->text, &l->len)) == NULL) {
+                l->err = errno;
+                goto out;
+        }
+        if (hash_file(l->path, &l->hash) < 0) {
+                fprintf(fp, "%s: %s\n", l->path, strerror(errno));
+                goto done;
+        }
+        for (i = 0; i < l->nknown; ++i) {
+                if (l->known[i] == l->hash) {
+                        l->known_hit = 1;
+                        goto done;
+                }
+        }
+        l->img = image_open(l->path, l->t, l->d->io, l->d->opts->profiles,
+                            fp, fp);
+        if (l->img != NULL && (stat(l->path, &after) < 0
+                               || !same_file(&l->st, &after))) {
+                fprintf(fp, "%s: changed while being read\n", l->path);
+                srec_free(l->img);
+                l->img = NULL;
+        }
+done:
+        fclose(fp);
+out:
+        /* Less than PIPE_BUF, so written whole; signals go elsewhere */
+        if (write(l->d->loadfd[1], &l, sizeof(l)) != sizeof(l))
+                abort();
+        return NULL;
+}
+
+/*
+ * Start loading @path for @t on a thread of its own, with @j the first
+ * job waiting for it.  The hashes of the images cached for @t go with
+ * it, unless @reparse, so that a copy of one is not parsed again.
+ */
+static int
+load_start(struct daemon_t *d, struct daemon_job_t *j,
+           const struct reflash_target_t *t, const char *path,
+           const struct stat *st, int reparse)
+{
+        struct daemon_image_t *im;
+        struct daemon_load_t *l;
+        sigset_t all, old;
+        pthread_attr_t attr;
+        pthread_t tid;
+        int err;
+
+        if ((l = calloc(1, sizeof(*l))) == NULL
+            || (l->path = strdup(path)) == NULL
+            || (l->known = calloc(d->nimages + 1, sizeof(*l->known))) == NULL)
+                goto nomem;
+        l->d = d;
+        l->t = t;
+        l->st = *st;
+        for (im = d->images; im != NULL && !reparse; im = im->next) {
+                if (im->t == t)
+                        l->known[l->nknown++] = im->hash;
+        }
+        /* Signals are for the event loop, to cut its wait short */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        err = pthread_create(&tid, &attr, load_thread, l);
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err != 0) {
+                load_free(l);
+                errno = err;
+                return -1;
+        }
+        l->jobs = j;
+        l->tail = &j->next;
+        l->next = d->loads;
+        d->loads = l;
+        return 0;
+
+nomem:
+        if (l != NULL)
+                load_free(l);
+        errno = ENOMEM;
+        return -1;
+}
+
+/*
+ * Find @j an image of @path for @t.  One cached, with the same size,
+ * inode and modification time, it gets at once; otherwise it waits for
+ * a load of the file, one already under way or a new one.  Return 0,
+ * or -1 after saying why not.
+ */
+static int
+find_image(struct daemon_t *d, struct daemon_job_t *j,
+           const struct reflash_target_t *t, const char *path)
+{
+        struct daemon_image_t *im;
+        struct daemon_load_t *l;
+        struct stat st;
+
+        if (stat(path, &st) < 0) {
+                job_send(j, "log %s: %s", path, strerror(errno));
+                return -1;
+        }
+        for (im = d->images; im != NULL; im = im->next) {
+                if (im->t == t && !strcmp(im->path, path)
+                    && same_file(&im->st, &st))
+                        break;
+        }
+        if (im != NULL) {
+                im->used = stats_now();
+                job_send(j, "image cached %.6f", im->used - j->submitted);
+                job_queue(d, j, im);
+                return 0;
+        }
+        for (l = d->loads; l != NULL; l = l->next) {
+                if (l->t == t && !strcmp(l->path, path)
+                    && same_file(&l->st, &st))
+                        break;
+        }
+        if (l != NULL) {
+                *l->tail = j;
+                l->tail = &j->next;
+                return 0;
+        }
+        if (load_start(d, j, t, path, &st, 0) < 0) {
+                job_send(j, "log %s", strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+/* The image @l loaded, or the cached one of the same bytes, or NULL */
+static struct daemon_image_t *
+load_image(struct daemon_t *d, struct daemon_load_t *l)
+{
+        struct daemon_image_t *im;
+
+        if (l->known_hit) {
+                for (im = d->images; im != NULL; im = im->next) {
+                        if (im->t == l->t && im->hash == l->hash)
+                                break;
+                }
+                if (im != NULL) {
+                        char *p = strdup(l->path);
+
+                        if (p != NULL) {
+                                free(im->path);
+                                im->path = p;
+                                im->st = l->st;
+                        }
+                }
+                return im;
+        }
+        if (l->img == NULL)
+                return NULL;
+        image_evict(d);
+        if ((im = calloc(1, sizeof(*im))) == NULL)
+                return NULL;
+        im->d = d;
+        im->t = l->t;
+        im->hash = l->hash;
+        im->path = l->path;
+        im->st = l->st;
+        im->img = l->img;
+        l->path = NULL;
+        l->img = NULL;
+        im->next = d->images;
+        d->images = im;
+        d->nimages++;
+        return im;
+}
+
+/* A load has finished: queue its jobs, or refuse them */
+static void
+load_done(struct daemon_t *d, struct daemon_load_t *l)
+{
+        struct daemon_load_t **pp;
+        struct daemon_image_t *im;
+        struct daemon_job_t *j;
+        char *line, *save;
+
+        for (pp = &d->loads; *pp != l; pp = &(*pp)->next)
+                ;
+        *pp = l->next;
+        im = load_image(d, l);
+        /* Evicted since: read it again, for the same jobs */
+        if (im == NULL && l->known_hit
+            && load_start(d, l->jobs, l->t, l->path, &l->st, 1) == 0) {
+                d->loads->tail = l->tail;
+                l->jobs = NULL;
+                load_free(l);
+                return;
+        }
+        for (line = l->text != NULL ? strtok_r(l->text, "\n", &save) : NULL;
+             line != NULL; line = strtok_r(NULL, "\n", &save)) {
+                daemon_note(d, "%s", line);
+                for (j = l->jobs; j != NULL; j = j->next)
+                        job_send(j, "log %s", line);
+        }
+        while ((j = l->jobs) != NULL) {
+                l->jobs = j->next;
+                j->next = NULL;
+                if (im == NULL) {
+                        if (l->err != 0)
+                                job_send(j, "log %s", strerror(l->err));
+                        job_refuse(d, j, "upgrade file rejected, "
+                                   "device untouched");
+                        continue;
+                }
+                im->used = stats_now();
+                job_send(j, "image %s %.6f", l->known_hit ? "cached"
+                                                          : "loaded",
+                         im->used - j->submitted);
+                if (d->lfd < 0)
+                        job_refuse(d, j, "daemon stopping");
+                else
+                        job_queue(d, j, im);
+        }
+        load_free(l);
+}
+
+/* Loads finished since last time */
+static void
+load_reap(struct daemon_t *d)
+{
+        struct daemon_load_t *l;
+
+        while (read(d->loadfd[0], &l, sizeof(l)) == sizeof(l))
+                load_done(d, l);
+}
+
+/* Take job line @line from @c */
+static void
+job_new(struct daemon_t *d, struct daemon_client_t *c, char *line)
+{
+        const struct reflash_target_t *t;
+        struct daemon_job_t *j;
+        char *target, *host, *path, *save;
+
+        if ((j = calloc(1, sizeof(*j))) == NULL) {
+                client_close(c);
+                return;
+        }
+        j->id = ++d->lastid;
+        j->c = c;
+        j->submitted = stats_now();
+        target = strtok_r(line, " \t", &save);
+        host = strtok_r(NULL, " \t", &save);
+        path = strtok_r(NULL, "", &save);
+        while (path != NULL && (*path == ' ' || *path == '\t'))
+                ++path;
+        if (target == NULL || host == NULL || path == NULL || *path == '\0') {
+                job_refuse(d, j, "expected: TARGET HOST PATH");
+                return;
+        }
+        if ((j->host = strdup(host)) == NULL) {
+                job_refuse(d, j, strerror(ENOMEM));
+                return;
+        }
+        daemon_note(d, "Job %lu: %s %s %s", j->id, target, host, path);
+        if ((t = reflash_target(target)) == NULL) {
+                job_refuse(d, j, "unknown target");
+                return;
+        }
+        if (path[0] != '/') {
+                job_refuse(d, j, "the upgrade file's path must be absolute");
+                return;
+        }
+        if (daemon_stopping(d)) {
+                job_refuse(d, j, "daemon stopping");
+                return;
+        }
+        job_send(j, "queued");
+        if (find_image(d, j, t, path) < 0)
+                job_refuse(d, j, "upgrade file rejected, device untouched");
+}
+
+/*
+ * The job running on @host, if any.  Hosts are told apart by name, as
+ * given: one device reached by two names is not caught.
+ */
+static struct daemon_job_t *
+host_job(struct daemon_t *d, const char *host)
+{
+        struct daemon_image_t *im;
+        int i;
+
+        for (im = d->images; im != NULL; im = im->next) {
+                for (i = 0; i < im->njobs; ++i) {
+                        if (im->jobs[i] != NULL && im->jobs[i]->running
+                            && !strcmp(im->jobs[i]->host, host))
+                                return im->jobs[i];
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Start queued jobs while there is room, in order, but for those whose
+ * device is being reflashed already: two at once would both erase it
+ * and share its journal.  They wait for it to be done.
+ */
+static void
+dispatch(struct daemon_t *d)
+{
+        int jobs = d->opts->jobs > 0 ? d->opts->jobs : 1;
+        struct daemon_job_t **pp = &d->queue, *busy;
+
+        while (*pp != NULL && d->running < jobs) {
+                struct daemon_job_t *j = *pp, **tmp;
+                struct daemon_image_t *im = j->im;
+                int dev;
+
+                if ((busy = host_job(d, j->host)) != NULL) {
+                        if (!j->held)
+                                job_send(j, "log waiting for job %lu on "
+                                         "the same device", busy->id);
+                        j->held = 1;
+                        pp = &j->next;
+                        continue;
+                }
+                if ((*pp = j->next) == NULL)
+                        d->tail = pp;
+                j->next = NULL;
+                if (im->sess == NULL && image_start(im) < 0) {
+                        job_refuse(d, j, strerror(errno));
+                        continue;
+                }
+                tmp = realloc(im->jobs, (im->njobs + 1) * sizeof(*tmp));
+                if (tmp == NULL) {
+                        job_refuse(d, j, strerror(ENOMEM));
+                        continue;
+                }
+                im->jobs = tmp;
+                if ((dev = reflash_session_add(im->sess, j->host,
+                                               &j->stats)) < 0) {
+                        job_refuse(d, j, strerror(errno));
+                        continue;
+                }
+                im->jobs[dev] = j;
+                im->njobs = dev + 1;
+                j->running = 1;
+                d->running++;
+                job_send(j, "started %.6f", stats_now() - j->submitted);
+                /* Connecting right away */
+                reflash_session_step(im->sess);
+        }
+}
+
+static void
+client_input(struct daemon_client_t *c)
+{
+        struct daemon_t *d = c->d;
+        char *nl;
+        ssize_t n;
+
+        for (;;) {
+                n = recv(c->fd, c->in + c->nin, sizeof(c->in) - c->nin, 0);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return;
+                if (n <= 0) {
+                        client_close(c);
+                        return;
+                }
+                c->nin += n;
+                while (c->fd >= 0
+                       && (nl = memchr(c->in, '\n', c->nin)) != NULL) {
+                        size_t len = nl - c->in;
+
+                        *nl = '\0';
+                        if (len > 0 && c->in[len - 1] == '\r')
+                                c->in[len - 1] = '\0';
+                        if (c->in[0] != '\0')
+                                job_new(d, c, c->in);
+                        memmove(c->in, nl + 1, c->nin - len - 1);
+                        c->nin -= len + 1;
+                }
+                if (c->fd >= 0 && c->nin == sizeof(c->in)) {
+                        daemon_note(d, "Client line too long, dropped");
+                        client_close(c);
+                }
+                if (c->fd < 0)
+                        return;
+        }
+}
+
+static void
+client_accept(struct daemon_t *d)
+{
+        struct daemon_client_t *c;
+        int fd;
+
+        while ((fd = accept(d->lfd, NULL, NULL)) >= 0) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                if ((c = calloc(1, sizeof(*c))) == NULL) {
+                        close(fd);
+                        continue;
+                }
+                c->d = d;
+                c->fd = fd;
+                c->next = d->clients;
+                d->clients = c;
+                client_watch(c, EPOLL_CTL_ADD);
+        }
+}
+
+static int
+daemon_listen(struct daemon_t *d, const char *path)
+{
+        struct sockaddr_un sun;
+        struct epoll_event ev;
+        struct stat st;
+        int fd;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        strcpy(sun.sun_path, path);
+        /* A socket left behind by a daemon that is gone */
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+                fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd >= 0 && connect(fd, (struct sockaddr *)&sun,
+                                       sizeof(sun)) == 0) {
+                        close(fd);
+                        errno = EADDRINUSE;
+                        return -1;
+                }
+                if (fd >= 0)
+                        close(fd);
+                unlink(path);
+        }
+        d->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+        if (d->lfd < 0
+            || bind(d->lfd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+            || listen(d->lfd, 64) < 0)
+                return -1;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listen_tag;
+        return epoll_ctl(d->ep, EPOLL_CTL_ADD, d->lfd, &ev);
+}
+
+/* Step every session with work, and drop those idle long enough */
+static int
+daemon_step(struct daemon_t *d)
+{
+        struct daemon_image_t *im;
+        int ms = -1;
+
+        for (im = d->images; im != NULL; im = im->next) {
+                int t;
+
+                if (im->sess == NULL)
+                        continue;
+                if (im->busy == 0) {
+                        if (stats_now() - im->born > DAEMON_SESSION_AGE)
+                                image_retire(im);
+                        continue;
+                }
+                if (reflash_session_step(im->sess) < 0) {
+                        daemon_note(d, "epoll_wait: %s", strerror(errno));
+                        continue;
+                }
+                t = reflash_session_timeout(im->sess);
+                if (t >= 0 && (ms < 0 || t < ms))
+                        ms = t;
+        }
+        return ms;
+}
+
+/* The pipe loader threads hand their loads back through */
+static int
+daemon_loads(struct daemon_t *d)
+{
+        struct epoll_event ev;
+
+        if (pipe(d->loadfd) < 0)
+                return -1;
+        fcntl(d->loadfd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(d->loadfd[1], F_SETFD, FD_CLOEXEC);
+        fcntl(d->loadfd[0], F_SETFL, O_NONBLOCK);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &load_tag;
+        return epoll_ctl(d->ep, EPOLL_CTL_ADD, d->loadfd[0], &ev);
+}
+
+/* Wait for the loads still under way; their jobs are refused */
+static void
+daemon_unload(struct daemon_t *d)
+{
+        struct pollfd pfd;
+
+        pfd.fd = d->loadfd[0];
+        pfd.events = POLLIN;
+        while (d->loads != NULL) {
+                poll(&pfd, 1, -1);
+                load_reap(d);
+        }
+}
+
+/* Stop taking jobs, and give up the ones not started */
+static void
+daemon_drain(struct daemon_t *d, const char *path)
+{
+        struct daemon_job_t *j;
+
+        if (d->lfd < 0)
+                return;
+        daemon_note(d, "Stopping once %d jobs are done", d->running);
+        epoll_ctl(d->ep, EPOLL_CTL_DEL, d->lfd, NULL);
+        close(d->lfd);
+        d->lfd = -1;
+        unlink(path);
+        while ((j = d->queue) != NULL) {
+                d->queue = j->next;
+                job_refuse(d, j, "daemon stopping");
+        }
+        d->tail = &d->queue;
+}
+
+/**
+ * reflash_daemon - Reflash devices on request, until told to stop
+ * @path: Unix socket to listen on
+ * @opts: User options for every job; @opts->jobs is how many run at
+ *        once
+ * @io:   How to read the upgrade files
+ * @stop: Set nonzero, by a signal handler say, to have it stop taking
+ *        jobs and return once those running are done, or NULL
+ * @log:  Where to write a line for each job taken and finished, and
+ *        for what goes wrong with clients, or NULL
+ *
+ * Jobs come in and their news goes out on @path, as described at the
+ * top of daemon.c.  A signal that sets @stop must be installed without
+ * SA_RESTART, so that it interrupts the wait for events; if it comes
+ * just before the wait, it is noticed at the next event or timeout.
+ *
+ * Return: 0, or -1 with errno set if it could not start listening
+ * (EADDRINUSE if another daemon is listening on @path)
+ */
+int
+reflash_daemon(const char *path, const struct reflash_opts_t *opts,
+               const struct image_opts_t *io, volatile sig_atomic_t *stop,
+               FILE *log)
+{
+        struct epoll_event ev[DAEMON_NEVENTS];
+        struct daemon_client_t *c;
+        struct daemon_t d;
+        int i, n, ms;
+
+        memset(&d, 0, sizeof(d));
+        d.opts = opts;
+        d.io = io;
+        d.stop = stop;
+        d.log = log;
+        d.lfd = -1;
+        d.loadfd[0] = d.loadfd[1] = -1;
+        d.tail = &d.queue;
+        if ((d.ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+                return -1;
+        if (daemon_loads(&d) < 0 || daemon_listen(&d, path) < 0) {
+                int err = errno;
+
+                if (d.lfd >= 0)
+                        close(d.lfd);
+                for (i = 0; i < 2; ++i) {
+                        if (d.loadfd[i] >= 0)
+                                close(d.loadfd[i]);
+                }
+                close(d.ep);
+                errno = err;
+                return -1;
+        }
+        daemon_note(&d, "Listening on %s, %d jobs at once", path,
+                    opts->jobs > 0 ? opts->jobs : 1);
+
+        while (d.lfd >= 0 || d.running > 0 || d.loads != NULL) {
+                ms = daemon_step(&d);
+                n = epoll_wait(d.ep, ev, DAEMON_NEVENTS, ms);
+                if (n < 0 && errno != EINTR) {
+                        daemon_note(&d, "epoll_wait: %s", strerror(errno));
+                        break;
+                }
+                for (i = 0; i < n; ++i) {
+                        c = ev[i].data.ptr;
+                        if (ev[i].data.ptr == &listen_tag) {
+                                client_accept(&d);
+                        } else if (ev[i].data.ptr == &session_tag) {
+                                /* daemon_step() sees to it */
+                        } else if (ev[i].data.ptr == &load_tag) {
+                                load_reap(&d);
+                        } else if (c->fd >= 0) {
+                                if (ev[i].events & EPOLLOUT)
+                                        client_flush(c);
+                                if (c->fd >= 0 && (ev[i].events
+                                                   & (EPOLLIN | EPOLLHUP
+                                                      | EPOLLERR)))
+                                        client_input(c);
+                        }
+                }
+                if (daemon_stopping(&d))
+                        daemon_drain(&d, path);
+                dispatch(&d);
+                client_reap(&d);
+        }
+
+        daemon_drain(&d, path);
+        daemon_unload(&d);
+        while (d.images != NULL) {
+                struct daemon_image_t *im = d.images;
+
+                d.images = im->next;
+                image_free(im);
+        }
+        for (c = d.clients; c != NULL; c = c->next)
+                client_close(c);
+        client_reap(&d);
+        close(d.loadfd[0]);
+        close(d.loadfd[1]);
+        close(d.ep);
+        return 0;
+}
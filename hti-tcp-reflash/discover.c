@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Finding devices: connect to port 2000 at every address of some IPv4
+ * ranges, thousands of addresses at a time, and ask whatever answers
+ * "*IDN?".  SCPI targets answer with their model and firmware revision;
+ * the FLASH command families answer with an error, which is harmless,
+ * and are told apart by the model in their host name, as the DHCP
+ * names of HTI devices go.
+ *
+ * Each address is a struct disc_probe_t in one epoll set: a
+ * non-blocking connect(), then the query, then the first line of the
+ * reply.  Anything but a connection counts as nobody home.  Probes start
+ * in address order, so the one started first is always the one due
+ * first, and the sweep waits for no more than that.
+ *
+ * Host names are looked up afterwards by a few threads at once, and
+ * for no longer than one probe's timeout all told: a name server that
+ * never answers for private addresses would otherwise hold the sweep up
+ * for seconds per device.  Threads still stuck in getnameinfo() when
+ * time is up are left to finish on their own, on a struct disc_names_t
+ * they share with nobody else.
+ */
+#include "reflash.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+        DISCOVER_NEVENTS = 256,
+        DISCOVER_LINE_MAX = 256,
+        /* Descriptors left for everything besides the probes */
+        DISCOVER_FD_SPARE = 32,
+        /* Host names looked up at once */
+        DISCOVER_RESOLVERS = 16,
+};
+
+static const char discover_query[] = "*IDN?\r";
+
+struct disc_probe_t {
+        int fd;
+        int sent;
+        uint32_t addr;
+        double deadline;
+        size_t rxlen;
+        char rx[DISCOVER_LINE_MAX];
+};
+
+struct disc_sweep_t {
+        int ep;
+        struct disc_probe_t *probe;
+        int jobs;
+        int head;       /* oldest probe in flight, a ring index */
+        int active;
+        double timeout;
+        struct discover_dev_t *dev;
+        int ndev;
+        int devsize;
+};
+
+/* Host names being looked up, "" until found or if there is none */
+struct disc_names_t {
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        int refs;       /* the sweep's, and each running thread's */
+        int next;       /* next address to look up */
+        int left;       /* lookups not finished yet */
+        int stop;       /* nonzero once the sweep gave up */
+        int n;
+        uint32_t *addr;
+        char (*name)[DISCOVER_NAME_MAX];
+};
+
+/**
+ * discover_range - Parse an IPv4 range
+ * @cidr: "a.b.c.d/n", or a single address
+ * @r:    Set to the range.  Below /31, the network and broadcast
+ *        addresses are left out.
+ *
+ * Return: 0, or -1 if @cidr is not a range
+ */
+int
+discover_range(const char *cidr, struct discover_range_t *r)
+{
+        char buf[INET_ADDRSTRLEN];
+        const char *slash = strchr(cidr, '/');
+        struct in_addr in;
+        size_t len = slash != NULL ? (size_t)(slash - cidr) : strlen(cidr);
+        uint32_t mask;
+        long bits = 32;
+        char *end;
+
+        if (len >= sizeof(buf))
+                return -1;
+        memcpy(buf, cidr, len);
+        buf[len] = '\0';
+        if (inet_pton(AF_INET, buf, &in) != 1)
+                return -1;
+        if (slash != NULL) {
+                bits = strtol(slash + 1, &end, 10);
+                if (end == slash + 1 || *end != '\0' || bits < 0 || bits > 32)
+                        return -1;
+        }
+        mask = bits == 0 ? 0 : ~0u << (32 - bits);
+        r->first = ntohl(in.s_addr) & mask;
+        r->count = (uint32_t)(~mask) + 1;
+        if (r->count == 0)
+                r->count = UINT32_MAX;
+        if (bits < 31) {
+                r->first++;
+                r->count -= 2;
+        }
+        return 0;
+}
+
+static void
+probe_close(struct disc_sweep_t *w, struct disc_probe_t *p)
+{
+        if (p->fd < 0)
+                return;
+        epoll_ctl(w->ep, EPOLL_CTL_DEL, p->fd, NULL);
+        close(p->fd);
+        p->fd = -1;
+        w->active--;
+}
+
+/* Whatever is at @p answered, with @reply or nothing at all */
+static void
+probe_found(struct disc_sweep_t *w, struct disc_probe_t *p,
+            const char *reply)
+{
+        struct discover_dev_t *d;
+
+        if (w->ndev == w->devsize) {
+                int size = w->devsize ? 2 * w->devsize : 64;
+                d = realloc(w->dev, size * sizeof(*d));
+                if (d == NULL) {
+                        probe_close(w, p);
+                        return;
+                }
+                w->dev = d;
+                w->devsize = size;
+        }
+        d = &w->dev[w->ndev++];
+        memset(d, 0, sizeof(*d));
+        d->addr = p->addr;
+        snprintf(d->reply, sizeof(d->reply), "%s", reply);
+        probe_close(w, p);
+}
+
+static void
+probe_start(struct disc_sweep_t *w, struct disc_probe_t *p, uint32_t addr)
+{
+        struct sockaddr_in sin;
+        struct epoll_event ev;
+
+        memset(p, 0, sizeof(*p));
+        p->addr = addr;
+        p->deadline = stats_now() + w->timeout;
+        p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       0);
+        if (p->fd < 0)
+                return;
+        w->active++;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(HTI_PORT);
+        sin.sin_addr.s_addr = htonl(addr);
+        if (connect(p->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0
+            && errno != EINPROGRESS) {
+                probe_close(w, p);
+                return;
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.ptr = p;
+        if (epoll_ctl(w->ep, EPOLL_CTL_ADD, p->fd, &ev) < 0)
+                probe_close(w, p);
+}
+
+static void
+probe_event(struct disc_sweep_t *w, struct disc_probe_t *p, uint32_t events)
+{
+        struct epoll_event ev;
+        ssize_t res;
+        char *nl;
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (!p->sent) {
+                if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+                    || err != 0) {
+                        probe_close(w, p);
+                        return;
+                }
+                /* Connected: somebody is listening on the HTI port */
+                res = send(p->fd, discover_query, strlen(discover_query),
+                           MSG_NOSIGNAL);
+                if (res != (ssize_t)strlen(discover_query)) {
+                        probe_found(w, p, "");
+                        return;
+                }
+                p->sent = 1;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.ptr = p;
+                epoll_ctl(w->ep, EPOLL_CTL_MOD, p->fd, &ev);
+                return;
+        }
+        if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) == 0)
+                return;
+        res = recv(p->fd, p->rx + p->rxlen, sizeof(p->rx) - 1 - p->rxlen, 0);
+        if (res < 0 && (errno == EAGAIN || errno == EINTR))
+                return;
+        if (res <= 0) {
+                p->rx[p->rxlen] = '\0';
+                probe_found(w, p, p->rx);
+                return;
+        }
+        p->rxlen += res;
+        p->rx[p->rxlen] = '\0';
+        if ((nl = strpbrk(p->rx, "\r\n")) != NULL) {
+                *nl = '\0';
+                probe_found(w, p, p->rx);
+        } else if (p->rxlen == sizeof(p->rx) - 1) {
+                probe_found(w, p, p->rx);
+        }
+}
+
+/* As many probes as descriptors allow, raising the soft limit to try */
+static int
+sweep_jobs(int want)
+{
+        struct rlimit rl;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+                return 64;
+        if (rl.rlim_cur != RLIM_INFINITY
+            && rl.rlim_cur < (rlim_t)want + DISCOVER_FD_SPARE) {
+                rl.rlim_cur = rl.rlim_max == RLIM_INFINITY
+                              || rl.rlim_max >= (rlim_t)want
+                                                + DISCOVER_FD_SPARE
+                              ? (rlim_t)want + DISCOVER_FD_SPARE
+                              : rl.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rl);
+                getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        if (rl.rlim_cur != RLIM_INFINITY
+            && rl.rlim_cur < (rlim_t)want + DISCOVER_FD_SPARE) {
+                want = rl.rlim_cur > 2 * DISCOVER_FD_SPARE
+                       ? (int)rl.rlim_cur - DISCOVER_FD_SPARE : 1;
+        }
+        return want;
+}
+
+/* Model and firmware from the reply */
+static void
+dev_identify(struct discover_dev_t *d)
+{
+        const char *p = d->reply, *comma;
+        size_t n;
+        int i;
+
+        profile_firmware(d->reply, d->firmware, sizeof(d->firmware));
+        snprintf(d->name, sizeof(d->name), "-");
+        snprintf(d->model, sizeof(d->model), "unknown");
+
+        /* "*IDN?": maker,model,serial,firmware */
+        if ((comma = strchr(p, ',')) != NULL && strncmp(p, "ERR", 3) != 0) {
+                p = comma + 1;
+                p += strspn(p, " ");
+                n = strcspn(p, ",");
+                if (n > 0 && n < sizeof(d->model)) {
+                        for (i = 0; i < (int)n; ++i)
+                                d->model[i] = tolower((unsigned char)p[i]);
+                        d->model[n] = '\0';
+                }
+        }
+}
+
+/* The model from the host name @name, unless the reply told already */
+static void
+dev_named(struct discover_dev_t *d, const char *name)
+{
+        size_t n;
+
+        snprintf(d->name, sizeof(d->name), "%s", name);
+        /* "p620-00123", perhaps with a domain */
+        n = strcspn(d->name, "-.");
+        if (!strcmp(d->model, "unknown") && d->name[n] == '-'
+            && n < sizeof(d->model)) {
+                char model[PROFILE_NAME_MAX];
+
+                memcpy(model, d->name, n);
+                model[n] = '\0';
+                if (reflash_target(model) != NULL)
+                        memcpy(d->model, model, n + 1);
+        }
+}
+
+/* Drop a reference to @nm, freeing it with the last one */
+static void
+names_put(struct disc_names_t *nm)
+{
+        int refs;
+
+        pthread_mutex_lock(&nm->lock);
+        refs = --nm->refs;
+        pthread_mutex_unlock(&nm->lock);
+        if (refs > 0)
+                return;
+        pthread_cond_destroy(&nm->done);
+        pthread_mutex_destroy(&nm->lock);
+        free(nm->addr);
+        free(nm->name);
+        free(nm);
+}
+
+static void *
+names_thread(void *arg)
+{
+        struct disc_names_t *nm = arg;
+        char name[DISCOVER_NAME_MAX];
+        struct sockaddr_in sin;
+        int i;
+
+        pthread_mutex_lock(&nm->lock);
+        while (!nm->stop && nm->next < nm->n) {
+                i = nm->next++;
+                pthread_mutex_unlock(&nm->lock);
+                memset(&sin, 0, sizeof(sin));
+                sin.sin_family = AF_INET;
+                sin.sin_addr.s_addr = htonl(nm->addr[i]);
+                if (getnameinfo((struct sockaddr *)&sin, sizeof(sin), name,
+                                sizeof(name), NULL, 0, NI_NAMEREQD) != 0)
+                        name[0] = '\0';
+                pthread_mutex_lock(&nm->lock);
+                memcpy(nm->name[i], name, sizeof(name));
+                if (--nm->left == 0)
+                        pthread_cond_signal(&nm->done);
+        }
+        pthread_mutex_unlock(&nm->lock);
+        names_put(nm);
+        return NULL;
+}
+
+/*
+ * Look up the host names of the @w->ndev devices found, and the models
+ * in them, giving up on whatever is not found within @w->timeout
+ */
+static void
+sweep_names(struct disc_sweep_t *w)
+{
+        struct disc_names_t *nm;
+        pthread_condattr_t cattr;
+        pthread_attr_t attr;
+        struct timespec until;
+        sigset_t all, old;
+        pthread_t tid;
+        int i, err = 0;
+
+        if (w->ndev == 0 || (nm = calloc(1, sizeof(*nm))) == NULL)
+                return;
+        nm->addr = malloc(w->ndev * sizeof(*nm->addr));
+        nm->name = calloc(w->ndev, sizeof(*nm->name));
+        if (nm->addr == NULL || nm->name == NULL) {
+                free(nm->addr);
+                free(nm->name);
+                free(nm);
+                return;
+        }
+        for (i = 0; i < w->ndev; ++i)
+                nm->addr[i] = w->dev[i].addr;
+        nm->n = nm->left = w->ndev;
+        nm->refs = 1;
+        pthread_mutex_init(&nm->lock, NULL);
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&nm->done, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        /* Signals are for the caller's thread */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_mutex_lock(&nm->lock);
+        for (i = 0; i < DISCOVER_RESOLVERS && i < w->ndev; ++i) {
+                if (pthread_create(&tid, &attr, names_thread, nm) != 0)
+                        break;
+                nm->refs++;
+        }
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += (time_t)w->timeout;
+        until.tv_nsec += (long)((w->timeout - (time_t)w->timeout) * 1e9);
+        if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+        }
+        while (nm->refs > 1 && nm->left > 0 && err != ETIMEDOUT)
+                err = pthread_cond_timedwait(&nm->done, &nm->lock, &until);
+        nm->stop = 1;
+        for (i = 0; i < w->ndev; ++i) {
+                if (nm->name[i][0] != '\0')
+                        dev_named(&w->dev[i], nm->name[i]);
+        }
+        pthread_mutex_unlock(&nm->lock);
+        names_put(nm);
+}
+
+static int
+dev_cmp(const void *a, const void *b)
+{
+        uint32_t x = ((const struct discover_dev_t *)a)->addr;
+        uint32_t y = ((const struct discover_dev_t *)b)->addr;
+
+        return x < y ? -1 : x > y;
+}
+
+/**
+ * discover_sweep - Find the devices listening in some address ranges
+ * @r:       Ranges, from discover_range()
+ * @nr:      Number of entries in @r
+ * @jobs:    Most addresses to have a probe in flight at once, lowered if
+ *           there are not enough file descriptors
+ * @timeout: Seconds each address has to connect and answer, and all the
+ *           host name lookups together
+ * @numeric: Nonzero to skip looking up the devices' host names
+ * @devs:    Set to the devices found, by ascending address, to be freed
+ *
+ * Return: Number of devices found, or -1 with errno set
+ */
+int
+discover_sweep(const struct discover_range_t *r, int nr, int jobs,
+               double timeout, int numeric, struct discover_dev_t **devs)
+{
+        struct epoll_event ev[DISCOVER_NEVENTS];
+        struct disc_sweep_t w;
+        int i, n, slot = 0, err;
+        uint32_t off = 0;
+
+        memset(&w, 0, sizeof(w));
+        w.timeout = timeout;
+        w.jobs = sweep_jobs(jobs);
+        w.probe = calloc(w.jobs, sizeof(*w.probe));
+        if (w.probe == NULL || (w.ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+                err = errno;
+                free(w.probe);
+                errno = err;
+                return -1;
+        }
+        for (i = 0; i < w.jobs; ++i)
+                w.probe[i].fd = -1;
+
+        for (i = 0; i < nr || w.active > 0; ) {
+                struct disc_probe_t *oldest;
+                int ms;
+
+                /* Slots free up in the order they were taken */
+                while (i < nr && w.active < w.jobs
+                       && w.probe[slot].fd < 0) {
+                        probe_start(&w, &w.probe[slot], r[i].first + off);
+                        slot = (slot + 1) % w.jobs;
+                        if (++off == r[i].count) {
+                                off = 0;
+                                ++i;
+                        }
+                }
+                while (w.active > 0 && w.probe[w.head].fd < 0)
+                        w.head = (w.head + 1) % w.jobs;
+                if (w.active == 0)
+                        continue;
+
+                oldest = &w.probe[w.head];
+                ms = (int)((oldest->deadline - stats_now()) * 1000.0) + 1;
+                n = epoll_wait(w.ep, ev, DISCOVER_NEVENTS, ms > 0 ? ms : 0);
+                if (n < 0 && errno != EINTR)
+                        break;
+                for (n = n < 0 ? 0 : n; n-- > 0; )
+                        probe_event(&w, ev[n].data.ptr, ev[n].events);
+
+                /* Whoever connected but kept quiet still counts */
+                while (w.active > 0 && (oldest = &w.probe[w.head],
+                                        oldest->fd < 0
+                                        || oldest->deadline <= stats_now())) {
+                        if (oldest->fd >= 0 && oldest->sent)
+                                probe_found(&w, oldest, "");
+                        else
+                                probe_close(&w, oldest);
+                        w.head = (w.head + 1) % w.jobs;
+                }
+        }
+        for (i = 0; i < w.jobs; ++i)
+                probe_close(&w, &w.probe[i]);
+        close(w.ep);
+        free(w.probe);
+
+        qsort(w.dev, w.ndev, sizeof(*w.dev), dev_cmp);
+        for (i = 0; i < w.ndev; ++i)
+                dev_identify(&w.dev[i]);
+        if (!numeric)
+                sweep_names(&w);
+        *devs = w.dev;
+        return w.ndev;
+}
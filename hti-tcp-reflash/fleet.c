@@ -0,0 +1,1088 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reflash many devices at once from a single epoll set, without ever
+ * blocking: a struct reflash_session_t, see htireflash.h.
+ *
+ * Each device is a struct fleet_sess_t walking the same
+ * struct reflash_dialect_t that reflash.c runs with blocking I/O, but as
+ * a state machine that is advanced one reply at a time, so none of
+ * them ever blocks the others.  The epoll file descriptor is what the
+ * caller waits on: it turns readable whenever any device has something
+ * to say, and reflash_session_step() takes it from there.
+ */
+#include "reflash.h"
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+        FLEET_LINE_MAX = SREC_TEXT_LIMIT + 64,
+        FLEET_NEVENTS = 64,
+};
+
+enum sess_state_t {
+        S_IDLE = 0,
+        S_CONNECT,
+        S_IDENT,
+        S_CHECK,
+        S_PRE,
+        S_WRITE,
+        S_VERIFY,
+        S_POST,
+        S_RETRY,
+        S_DONE,
+        S_FAILED,
+};
+
+struct fleet_sess_t {
+        struct reflash_session_t *fleet;
+        int dev;
+        char *host;
+        enum sess_state_t state;
+        int fd;
+        struct connect_race_t race;
+        const struct reflash_step_t *step;
+        int rec;
+        int batch;      /* most records per line, 0 when not batching */
+        int nbatch;     /* records in the line awaiting its reply */
+        int drain;      /* replies still due after a rejected write */
+        int skipped;
+        int erased;
+        int was_up;
+        int identified;
+        int tuned;
+        int tries;
+        double wake_at;
+        struct reflash_journal_t *jn;
+        struct reflash_capture_t *cap;
+        char rx[FLEET_LINE_MAX];
+        size_t rxlen;
+        char tx[BATCH_LINE_MAX + 1];
+        const char *txbuf;
+        size_t txlen;
+        size_t txoff;
+        char error[128];
+        struct timespec start;
+        double secs;
+        double sent;
+        struct wr_pipe_t pipe;
+        struct reflash_profile_t prof;
+        struct reflash_stats_t *stats;
+};
+
+struct reflash_session_t {
+        const struct reflash_target_t *t;
+        const struct reflash_dialect_t *d;
+        int ep;
+        int active;
+        struct fleet_sess_t **sess;
+        int nsess;
+        int next;
+        int jobs;
+        const struct srec_image_t *img;
+        struct srec_wire_t *wire;
+        int window;
+        int batch;
+        int cksum;
+        uint32_t want;
+        int want_ok;
+        char *journal;
+        char *profiles;
+        char *capture;
+        uint64_t hash;
+        int retries;
+        double connect_timeout;
+        double timeout_cmd;
+        double timeout_erase;
+        double timeout_write;
+        struct connect_cache_t *cache;
+        struct reflash_callbacks_t cb;
+};
+
+static void
+sess_log(struct fleet_sess_t *s, const char *fmt, ...)
+{
+        const struct reflash_callbacks_t *cb = &s->fleet->cb;
+        char msg[256];
+        va_list ap;
+
+        if (cb->log == NULL)
+                return;
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        cb->log(cb->arg, s->dev, msg);
+}
+
+/* Records [@from, @to) are acknowledged if @written, else skipped */
+static void
+sess_progress(struct fleet_sess_t *s, int from, int to, int written)
+{
+        const struct reflash_callbacks_t *cb = &s->fleet->cb;
+
+        if (cb->progress != NULL && to > from)
+                cb->progress(cb->arg, s->dev, from, to, written);
+}
+
+/* Let go of the connection, but not of the device */
+static void
+sess_drop(struct fleet_sess_t *s)
+{
+        if (s->fd >= 0) {
+                epoll_ctl(s->fleet->ep, EPOLL_CTL_DEL, s->fd, NULL);
+                close(s->fd);
+                s->fd = -1;
+        }
+        connect_race_cancel(&s->race);
+        s->rxlen = 0;
+        s->txlen = 0;
+        s->txoff = 0;
+}
+
+static void
+sess_close(struct fleet_sess_t *s)
+{
+        struct timespec now;
+
+        sess_drop(s);
+        journal_close(s->jn, s->state == S_DONE);
+        /* Keep the latest round trip and erase time for next time */
+        if (s->tuned && s->state == S_DONE && !s->skipped) {
+                /* A batch's round trip is not a record's */
+                if (s->pipe.rto.srtt > 0.0 && !s->fleet->batch)
+                        s->prof.rtt = s->pipe.rto.srtt;
+                profile_save(s->fleet->profiles, s->fleet->t, &s->prof);
+        }
+        s->jn = NULL;
+        if (s->cap != NULL) {
+                char path[PATH_MAX];
+
+                if (capture_save(s->cap, s->fleet->capture, path,
+                                 sizeof(path)) < 0)
+                        sess_log(s, "%s: %s", path, strerror(errno));
+                else
+                        sess_log(s, "transcript saved to %s", path);
+                capture_free(s->cap);
+                s->cap = NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        s->secs = (double)(now.tv_sec - s->start.tv_sec)
+                  + (double)(now.tv_nsec - s->start.tv_nsec) * 1e-9;
+        s->fleet->active--;
+        stats_finish(s->stats, s->state == S_DONE
+                               ? (s->skipped ? "current" : "ok")
+                               : s->state == S_FAILED ? "failed" : "aborted");
+        if (s->fleet->cb.done != NULL
+            && (s->state == S_DONE || s->state == S_FAILED)) {
+                struct reflash_result_t res;
+
+                res.result = s->state == S_FAILED ? REFLASH_FAILED
+                             : s->skipped ? REFLASH_CURRENT : REFLASH_OK;
+                res.records = s->rec;
+                res.secs = s->secs;
+                res.error = s->state == S_FAILED ? s->error : NULL;
+                s->fleet->cb.done(s->fleet->cb.arg, s->dev, &res);
+        }
+}
+
+static void
+sess_fail(struct fleet_sess_t *s, const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        vsnprintf(s->error, sizeof(s->error), fmt, ap);
+        va_end(ap);
+        capture_note(s->cap, CAPTURE_FAIL, "%s", s->error);
+        sess_log(s, "failed: %s", s->error);
+        /* What it never gets counts as dealt with */
+        sess_progress(s, s->rec, s->fleet->img->nrec, 0);
+        s->state = S_FAILED;
+        sess_close(s);
+}
+
+/*
+ * The connection broke.  Unless it never came up in the first place or
+ * the retries are used up, close it and try again after a while.  The
+ * retries start over whenever a record gets through.  Once erased, the
+ * device is not erased again, and writing resumes at the first record
+ * it has not acknowledged.
+ */
+static void
+sess_lost(struct fleet_sess_t *s, const char *fmt, ...)
+{
+        char msg[sizeof(s->error)];
+        int delay;
+        va_list ap;
+
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        if (!s->was_up || s->tries >= s->fleet->retries) {
+                sess_fail(s, "%s", msg);
+                return;
+        }
+        delay = s->tries < 3 ? 1 << s->tries : 8;
+        s->tries++;
+        sess_log(s, "%s; reconnecting in %d s (attempt %d of %d)",
+                 msg, delay, s->tries, s->fleet->retries);
+        sess_drop(s);
+        s->state = S_RETRY;
+        s->wake_at = stats_now() + delay;
+}
+
+static void
+sess_watch(struct fleet_sess_t *s, int op)
+{
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        if (s->txoff < s->txlen)
+                ev.events |= EPOLLOUT;
+        ev.data.ptr = s;
+        if (epoll_ctl(s->fleet->ep, op, s->fd, &ev) < 0)
+                sess_fail(s, "epoll_ctl: %s", strerror(errno));
+}
+
+static void
+sess_flush(struct fleet_sess_t *s)
+{
+        while (s->txoff < s->txlen) {
+                ssize_t res = send(s->fd, s->txbuf + s->txoff,
+                                   s->txlen - s->txoff, MSG_NOSIGNAL);
+                if (res < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                break;
+                        if (errno == EINTR)
+                                continue;
+                        capture_note(s->cap, CAPTURE_LOST, "send: %s",
+                                     strerror(errno));
+                        sess_lost(s, "send: %s", strerror(errno));
+                        return;
+                }
+                if (s->stats != NULL)
+                        s->stats->bytes_tx += res;
+                s->txoff += res;
+        }
+        sess_watch(s, EPOLL_CTL_MOD);
+}
+
+/* Seconds the device has to answer the command about to be sent */
+static double
+sess_budget(struct fleet_sess_t *s)
+{
+        if (s->state == S_WRITE)
+                return reflash_rto(&s->pipe.rto);
+        if ((s->state == S_PRE || s->state == S_POST) && s->step->erase)
+                return profile_erase_timeout(&s->prof, s->fleet->timeout_cmd,
+                                             s->fleet->timeout_erase);
+        return s->fleet->timeout_cmd;
+}
+
+/* Send @len bytes at @buf, which must stay put until they are sent */
+static void
+sess_send_buf(struct fleet_sess_t *s, const char *buf, size_t len)
+{
+        /* Every command is one line, '\r' last */
+        capture_add(s->cap, CAPTURE_SENT, buf, len - 1);
+        s->txbuf = buf;
+        s->txlen = len;
+        s->txoff = 0;
+        s->sent = stats_now();
+        s->wake_at = s->sent + sess_budget(s);
+        sess_flush(s);
+}
+
+static void
+sess_send(struct fleet_sess_t *s, const char *fmt, ...)
+{
+        va_list ap;
+        int len;
+
+        va_start(ap, fmt);
+        len = vsnprintf(s->tx, sizeof(s->tx) - 1, fmt, ap);
+        va_end(ap);
+        if (len < 0 || len >= (int)sizeof(s->tx) - 1) {
+                sess_fail(s, "command too long");
+                return;
+        }
+        s->tx[len++] = '\r';
+        sess_send_buf(s, s->tx, len);
+}
+
+/*
+ * The image's checksum and write commands are worked out once for every
+ * device, while the first device that needs them is busy: summing its
+ * flash, or erasing it.
+ */
+static void
+fleet_want(struct reflash_session_t *f)
+{
+        if (f->want_ok)
+                return;
+        f->want = srec_checksum(f->img, f->cksum);
+        f->want_ok = 1;
+}
+
+static int
+fleet_wire(struct reflash_session_t *f)
+{
+        if (f->wire == NULL)
+                f->wire = srec_wire(f->img, f->batch ? f->d->batch_fmt
+                                                     : f->d->write_fmt);
+        return f->wire != NULL ? 0 : -1;
+}
+
+/*
+ * Fill the window with the records that come next, and send those not
+ * sent yet.  The records in the ring are consecutive, and so are their
+ * commands in the wire buffer: whatever is still unsent of the earlier
+ * ones ends right where the new ones start.
+ */
+static void
+sess_pump(struct fleet_sess_t *s)
+{
+        struct wr_pipe_t *p = &s->pipe;
+        int nrec = s->fleet->img->nrec;
+        const char *cmd, *start = NULL;
+        struct wr_slot_t *sl;
+        size_t len, total = 0;
+
+        while (s->rec + p->count < nrec && p->count < p->cwnd) {
+                wr_pipe_slot(p, p->count)->recno = s->rec + p->count;
+                p->count++;
+        }
+        while (p->nsent < p->count && p->nsent < p->cwnd) {
+                sl = wr_pipe_slot(p, p->nsent);
+                sl->alone = p->nsent == 0;
+                sl->sent = stats_now();
+                cmd = srec_wire_cmd(s->fleet->wire, sl->recno, &len);
+                capture_add(s->cap, CAPTURE_SENT, cmd, len - 1);
+                if (start == NULL)
+                        start = cmd;
+                total += len;
+                p->nsent++;
+        }
+        /* The oldest record's reply is due first */
+        sl = wr_pipe_slot(p, 0);
+        s->sent = sl->sent;
+        s->wake_at = sl->sent + reflash_rto(&p->rto);
+        if (start == NULL)
+                return;
+        if (s->txoff < s->txlen) {
+                s->txlen += total;
+        } else {
+                s->txbuf = start;
+                s->txlen = total;
+                s->txoff = 0;
+        }
+        sess_flush(s);
+}
+
+/* Send whatever comes next, moving on to the next state as needed */
+static void
+sess_next(struct fleet_sess_t *s)
+{
+        const struct reflash_dialect_t *d = s->fleet->d;
+
+        while (s->state == S_PRE && s->step->erase && s->erased)
+                s->step++;
+        if (s->state == S_PRE && s->step->cmd == NULL) {
+                sess_log(s, "%s", d->write_banner);
+                s->state = S_WRITE;
+                stats_phase_begin(s->stats, "write");
+                /* A batch's round trip is not a record's */
+                wr_pipe_init(&s->pipe, d, s->fleet->window, &s->prof,
+                             s->tuned && !s->batch,
+                             s->fleet->timeout_write);
+                s->drain = 0;
+        }
+        if (s->state == S_WRITE && s->rec == s->fleet->img->nrec) {
+                stats_phase_end(s->stats);
+                if (s->fleet->cksum != REFLASH_CKSUM_NONE) {
+                        sess_log(s, "Verifying...");
+                        s->state = S_VERIFY;
+                        stats_phase_begin(s->stats, "verify");
+                        sess_send(s, "%s", d->checksum);
+                        fleet_want(s->fleet);
+                        return;
+                }
+                s->state = S_POST;
+                s->step = d->post;
+        }
+        if (s->state == S_POST && s->step->cmd == NULL) {
+                sess_log(s, "done");
+                s->state = S_DONE;
+                sess_close(s);
+                return;
+        }
+
+        if (s->state == S_WRITE && fleet_wire(s->fleet) < 0) {
+                sess_fail(s, "Cannot encode the records: %s",
+                          strerror(errno));
+                return;
+        }
+        if (s->state == S_WRITE && s->batch) {
+                size_t len;
+
+                s->nbatch = srec_wire_batch(s->fleet->wire, s->rec, s->batch,
+                                            d->batch_head, d->batch_tail,
+                                            d->batch_line, s->tx, &len);
+                if (s->nbatch == 0) {
+                        sess_fail(s, "Record %d does not fit the device's "
+                                  "input buffer", s->rec);
+                        return;
+                }
+                sess_send_buf(s, s->tx, len);
+        } else if (s->state == S_WRITE) {
+                sess_pump(s);
+        } else {
+                sess_log(s, "%s", s->step->banner);
+                stats_phase_begin(s->stats, s->step->phase);
+                sess_send(s, "%s", s->step->cmd);
+                /* Failing here, the first write fails in its turn */
+                if (s->step->erase)
+                        fleet_wire(s->fleet);
+        }
+}
+
+static void sess_begin(struct fleet_sess_t *s);
+
+/* Find out the firmware from @reply, if any, and look up its profile */
+static void
+sess_identify(struct fleet_sess_t *s, const char *reply)
+{
+        struct reflash_profile_t *p = &s->prof;
+        char fw[PROFILE_NAME_MAX];
+
+        profile_firmware(reply, fw, sizeof(fw));
+        profile_init(p, s->fleet->t, fw);
+        s->identified = 1;
+        if (profile_load(s->fleet->profiles, p) < 0)
+                return;
+        s->tuned = 1;
+        sess_log(s, "profile %s/%s, %.1f ms round trip", p->model,
+                 p->firmware, p->rtt * 1e3);
+}
+
+/*
+ * Take @line as the reply to the oldest record in the window, as
+ * flash_write() in reflash.c does.  Return: 0 to send more, 1 to wait
+ * for the next reply, -1 if the device failed.
+ */
+static int
+sess_written(struct fleet_sess_t *s, const char *line)
+{
+        struct wr_pipe_t *p = &s->pipe;
+        struct wr_slot_t *sl = wr_pipe_slot(p, 0);
+        const char *expect = s->fleet->d->write_expect;
+
+        if (s->drain == 0 && reflash_reply_ok(line, expect)) {
+                sess_progress(s, s->rec, s->rec + 1, 1);
+                if (s->stats != NULL)
+                        s->stats->records++;
+                s->rec++;
+                s->tries = 0;
+                journal_ack(s->jn, s->rec);
+                wr_pipe_ack(p, stats_now() - sl->sent);
+                return 0;
+        }
+        if (s->drain == 0) {
+                if (sl->alone) {
+                        sess_fail(s, "Unexpected result of FLASH WRITE "
+                                  "(record %d): %s", s->rec, line);
+                        return -1;
+                }
+                sess_log(s, "FLASH WRITE rejected with %d in flight, "
+                         "retrying at window 1: %s", p->nsent, line);
+                s->drain = p->nsent;
+        }
+        /* Whatever the replies to the others say, they are sent again */
+        if (--s->drain > 0) {
+                s->sent = stats_now();
+                s->wake_at = s->sent + reflash_rto(&p->rto);
+                return 1;
+        }
+        wr_pipe_backoff(p, &s->prof);
+        return 0;
+}
+
+static void
+sess_reply(struct fleet_sess_t *s, const char *line)
+{
+        const struct reflash_step_t *st = s->step;
+        int digits = reflash_cksum_digits(s->fleet->cksum);
+        uint32_t have;
+
+        if (s->stats != NULL && s->state != S_PRE && s->state != S_POST)
+                stats_rtt(s->stats, stats_now() - s->sent);
+        if (s->state == S_IDENT) {
+                sess_identify(s, line);
+                sess_begin(s);
+                return;
+        } else if (s->state == S_CHECK) {
+                stats_phase_end(s->stats);
+                if (reflash_parse_cksum(line, &have) == 0
+                    && have == s->fleet->want) {
+                        sess_log(s, "already up to date");
+                        sess_progress(s, 0, s->fleet->img->nrec, 0);
+                        s->skipped = 1;
+                        s->state = S_DONE;
+                        sess_close(s);
+                        return;
+                }
+                s->state = S_PRE;
+                s->step = s->fleet->d->pre;
+        } else if (s->state == S_VERIFY) {
+                if (reflash_parse_cksum(line, &have) < 0) {
+                        sess_fail(s, "No checksum in reply '%s'", line);
+                        return;
+                }
+                if (have != s->fleet->want) {
+                        sess_fail(s, "Checksum mismatch after write: "
+                                  "device %0*lX, image %0*lX",
+                                  digits, (unsigned long)have,
+                                  digits, (unsigned long)s->fleet->want);
+                        return;
+                }
+                stats_phase_end(s->stats);
+                s->state = S_POST;
+                s->step = s->fleet->d->post;
+        } else if (s->state == S_WRITE && !s->batch) {
+                if (sess_written(s, line) != 0)
+                        return;
+        } else if (s->state == S_WRITE) {
+                const struct reflash_dialect_t *d = s->fleet->d;
+
+                if (reflash_reply_ok(line, d->batch_expect)) {
+                        reflash_rto_sample(&s->pipe.rto,
+                                           stats_now() - s->sent);
+                        sess_progress(s, s->rec, s->rec + s->nbatch, 1);
+                        if (s->stats != NULL)
+                                s->stats->records += s->nbatch;
+                        s->rec += s->nbatch;
+                        s->tries = 0;
+                        journal_ack(s->jn, s->rec);
+                } else if (s->nbatch > 1) {
+                        /* Write them again one by one, to find the bad one */
+                        sess_log(s, "batch of %d records failed, writing "
+                                 "one at a time: %s", s->nbatch, line);
+                        s->batch = 1;
+                } else {
+                        sess_fail(s, "Unexpected result of FLASH WRITE "
+                                  "(record %d): %s", s->rec, line);
+                        return;
+                }
+        } else if (s->state == S_PRE || s->state == S_POST) {
+                if (!reflash_reply_ok(line, st->expect)) {
+                        if (st->progress != NULL
+                            && strstr(line, st->progress) != NULL) {
+                                return;
+                        }
+                        if (st->errmsg != NULL)
+                                sess_fail(s, "%s", st->errmsg);
+                        else
+                                sess_fail(s, "Unexpected result of %s: '%s'",
+                                          st->cmd, line);
+                        return;
+                }
+                stats_phase_end(s->stats);
+                if (st->erase) {
+                        s->prof.erase = stats_now() - s->sent;
+                        s->erased = 1;
+                        s->rec = 0;
+                        journal_erased(s->jn);
+                }
+                s->step++;
+        } else {
+                sess_fail(s, "Unsolicited reply: '%s'", line);
+                return;
+        }
+        sess_next(s);
+}
+
+static void sess_connected(struct fleet_sess_t *s);
+
+/*
+ * Carry on with the connection race, see connect.c, after a
+ * connect_race_xxx() call returned @fd.  Attempts still pending are
+ * watched for EPOLLOUT and the race is stepped again when one fires or
+ * at @wake_at, whichever comes first.
+ */
+static void
+sess_race(struct fleet_sess_t *s, int fd)
+{
+        struct epoll_event ev;
+        int fds[CONNECT_MAX];
+        int i, n;
+
+        if (fd >= 0) {
+                s->fd = fd;
+                /* Registered already if it was pending for a while */
+                epoll_ctl(s->fleet->ep, EPOLL_CTL_DEL, fd, NULL);
+                sess_watch(s, EPOLL_CTL_ADD);
+                if (s->state != S_FAILED)
+                        sess_connected(s);
+                return;
+        }
+        if (errno != EINPROGRESS) {
+                sess_lost(s, "connect: %s", strerror(errno));
+                return;
+        }
+
+        s->state = S_CONNECT;
+        s->wake_at = stats_now() + connect_race_timeout(&s->race) / 1000.0;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.ptr = s;
+        n = connect_race_fds(&s->race, fds);
+        for (i = 0; i < n; ++i) {
+                if (epoll_ctl(s->fleet->ep, EPOLL_CTL_ADD, fds[i], &ev) < 0
+                    && errno != EEXIST) {
+                        sess_fail(s, "epoll_ctl: %s", strerror(errno));
+                        return;
+                }
+        }
+}
+
+static void
+sess_resolve(struct fleet_sess_t *s)
+{
+        const struct addrinfo *list;
+        double t0 = stats_now();
+        int res;
+
+        res = connect_resolve(&s->fleet->cache, s->host, &list);
+        if (s->stats != NULL) {
+                s->stats->resolve += stats_now() - t0;
+                /* Connecting is timed like a round trip */
+                s->sent = stats_now();
+        }
+        if (res != 0) {
+                sess_lost(s, "getaddrinfo: %s", gai_strerror(res));
+                return;
+        }
+        sess_race(s, connect_race_start(&s->race, list,
+                                        s->fleet->connect_timeout));
+}
+
+static void
+sess_start(struct fleet_sess_t *s)
+{
+        struct reflash_session_t *f = s->fleet;
+        int acked;
+
+        clock_gettime(CLOCK_MONOTONIC, &s->start);
+        f->active++;
+        stats_init(s->stats, s->host);
+        s->jn = journal_open(f->journal, s->host, f->hash, f->img->nrec,
+                             f->cksum != REFLASH_CKSUM_NONE);
+        if (f->capture != NULL && (s->cap = capture_new(s->host)) == NULL)
+                sess_log(s, "capture: %s", strerror(errno));
+        if ((acked = journal_resume(s->jn)) >= 0) {
+                sess_log(s, "journal: %d of %d records already written "
+                         "after erasing", acked, f->img->nrec);
+                s->erased = 1;
+                s->rec = acked;
+                sess_progress(s, 0, acked, 0);
+        }
+        sess_resolve(s);
+}
+
+static void
+sess_connected(struct fleet_sess_t *s)
+{
+        s->was_up = 1;
+        capture_add(s->cap, CAPTURE_CONNECT, s->host, strlen(s->host));
+        if (s->stats != NULL) {
+                s->stats->connect += stats_now() - s->sent;
+                if (s->tries > 0)
+                        s->stats->reconnects++;
+        }
+        if (s->erased)
+                sess_log(s, "connected, resuming at record %d", s->rec);
+        else
+                sess_log(s, "connected");
+        if (s->fleet->profiles != NULL && !s->identified) {
+                if (s->fleet->d->ident != NULL) {
+                        s->state = S_IDENT;
+                        sess_send(s, "%s", s->fleet->d->ident);
+                        return;
+                }
+                sess_identify(s, NULL);
+        }
+        sess_begin(s);
+}
+
+/* Connected, and identified if need be: check, or go straight to work */
+static void
+sess_begin(struct fleet_sess_t *s)
+{
+        /* Once erased, the device cannot match until written again */
+        if (s->fleet->cksum != REFLASH_CKSUM_NONE && !s->erased) {
+                s->state = S_CHECK;
+                stats_phase_begin(s->stats, "check");
+                sess_send(s, "%s", s->fleet->d->checksum);
+                fleet_want(s->fleet);
+                return;
+        }
+        s->state = S_PRE;
+        s->step = s->fleet->d->pre;
+        sess_next(s);
+}
+
+static void
+sess_readable(struct fleet_sess_t *s)
+{
+        for (;;) {
+                ssize_t res;
+                char *nl;
+
+                res = recv(s->fd, s->rx + s->rxlen,
+                           sizeof(s->rx) - 1 - s->rxlen, 0);
+                if (res < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return;
+                        if (errno == EINTR)
+                                continue;
+                        capture_note(s->cap, CAPTURE_LOST, "recv: %s",
+                                     strerror(errno));
+                        sess_lost(s, "recv: %s", strerror(errno));
+                        return;
+                }
+                if (res == 0) {
+                        capture_note(s->cap, CAPTURE_LOST,
+                                     "Connection closed by device");
+                        sess_lost(s, "Connection closed by device");
+                        return;
+                }
+                if (s->stats != NULL)
+                        s->stats->bytes_rx += res;
+                s->rxlen += res;
+                s->rx[s->rxlen] = '\0';
+
+                while ((nl = strchr(s->rx, '\n')) != NULL) {
+                        char *end = nl;
+                        size_t used = nl + 1 - s->rx;
+
+                        while (end > s->rx && end[-1] == '\r')
+                                --end;
+                        *end = '\0';
+                        capture_add(s->cap, CAPTURE_RECEIVED, s->rx,
+                                    end - s->rx);
+                        sess_reply(s, s->rx);
+                        if (s->state == S_DONE || s->state == S_FAILED
+                            || s->state == S_RETRY) {
+                                return;
+                        }
+                        memmove(s->rx, s->rx + used, s->rxlen - used + 1);
+                        s->rxlen -= used;
+                }
+                if (s->rxlen == sizeof(s->rx) - 1) {
+                        sess_fail(s, "Reply too long");
+                        return;
+                }
+        }
+}
+
+static void
+sess_event(struct fleet_sess_t *s, uint32_t events)
+{
+        if (s->state == S_CONNECT) {
+                sess_race(s, connect_race_step(&s->race));
+                return;
+        }
+        if ((events & EPOLLOUT) != 0) {
+                sess_flush(s);
+                if (s->state == S_FAILED || s->state == S_RETRY)
+                        return;
+        }
+        if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+                sess_readable(s);
+}
+
+/*
+ * Whether @s has something due at @wake_at: a reconnect, a connect
+ * step, or the deadline for the reply to the command in flight.
+ */
+static int
+sess_timed(const struct fleet_sess_t *s)
+{
+        return s->state > S_IDLE && s->state < S_DONE;
+}
+
+/**
+ * reflash_session_new - Get ready to reflash devices
+ * @img:  Upgrade image, which must outlive the session
+ * @t:    Kind of device they all are
+ * @opts: User options, copied; @opts->jobs caps how many devices are in
+ *        progress at once.  @opts->probe is not used.
+ * @cb:   Callbacks, copied, or NULL for none
+ *
+ * With @opts->cksum set, devices whose checksum already matches the
+ * image are left alone, and the others are verified after writing.
+ * A device whose connection breaks is reconnected up to
+ * @opts->retries times, and picks up where it left off.  Devices are
+ * not probed, but one whose firmware has a profile in @opts->profiles
+ * starts with the write and erase timeouts the profile suggests, and
+ * with its depth of writes in flight.  Each device keeps up to
+ * @opts->window writes in flight of its own, as reflash_device() does.
+ * Targets that can take several records on one line get them in
+ * batches, as @opts->batch says.
+ *
+ * Return: The session, or NULL with errno set
+ */
+struct reflash_session_t *
+reflash_session_new(const struct srec_image_t *img,
+                    const struct reflash_target_t *t,
+                    const struct reflash_opts_t *opts,
+                    const struct reflash_callbacks_t *cb)
+{
+        struct reflash_session_t *f = calloc(1, sizeof(*f));
+        int err;
+
+        if (f == NULL)
+                return NULL;
+        f->t = t;
+        f->d = t->dialect;
+        f->img = img;
+        f->jobs = opts->jobs > 0 ? opts->jobs : 1;
+        f->window = opts->window;
+        if (f->d->batch_fmt != NULL && opts->batch != 1)
+                f->batch = opts->batch > 0 ? opts->batch : INT_MAX;
+        f->cksum = opts->cksum;
+        f->hash = srec_hash(img);
+        f->retries = opts->retries;
+        f->connect_timeout = opts->connect_timeout;
+        f->timeout_cmd = opts->timeout_cmd;
+        f->timeout_erase = opts->timeout_erase;
+        f->timeout_write = opts->timeout_write;
+        if (cb != NULL)
+                f->cb = *cb;
+        f->ep = -1;
+        if ((opts->journal != NULL
+                && (f->journal = strdup(opts->journal)) == NULL)
+            || (opts->profiles != NULL
+                && (f->profiles = strdup(opts->profiles)) == NULL)
+            || (opts->capture != NULL
+                && (f->capture = strdup(opts->capture)) == NULL)
+            || (f->ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+                err = errno;
+                reflash_session_free(f);
+                errno = err;
+                return NULL;
+        }
+        return f;
+}
+
+/**
+ * reflash_session_add - Add a device to @s
+ * @s:     Session
+ * @host:  Host name or address of the device, copied
+ * @stats: Where to record how its time went, or NULL.  It must outlive
+ *         @s.
+ *
+ * Devices are started on in the order added, as reflash_session_step()
+ * finds room for them.
+ *
+ * Return: The device's index, which the callbacks identify it by, or -1
+ * with errno set
+ */
+int
+reflash_session_add(struct reflash_session_t *s, const char *host,
+                    struct reflash_stats_t *stats)
+{
+        struct fleet_sess_t **sess, *d;
+
+        sess = realloc(s->sess, (s->nsess + 1) * sizeof(*sess));
+        if (sess == NULL)
+                return -1;
+        s->sess = sess;
+        if ((d = calloc(1, sizeof(*d))) == NULL)
+                return -1;
+        if ((d->host = strdup(host)) == NULL) {
+                free(d);
+                return -1;
+        }
+        d->fleet = s;
+        d->dev = s->nsess;
+        d->fd = -1;
+        d->batch = s->batch;
+        profile_init(&d->prof, s->t, "unknown");
+        if (stats != NULL) {
+                d->stats = stats;
+                stats_init(stats, host);
+                stats_finish(stats, "not started");
+        }
+        s->sess[s->nsess] = d;
+        return s->nsess++;
+}
+
+/**
+ * reflash_session_fd - File descriptor to wait on for @s
+ *
+ * It turns readable when reflash_session_step() has something to do.
+ */
+int
+reflash_session_fd(const struct reflash_session_t *s)
+{
+        return s->ep;
+}
+
+/**
+ * reflash_session_timeout - Longest to wait on reflash_session_fd()
+ *                           before calling reflash_session_step()
+ *
+ * Return: Milliseconds, or -1 if only the file descriptor matters
+ */
+int
+reflash_session_timeout(const struct reflash_session_t *s)
+{
+        double first = 0.0, now;
+        int i;
+
+        if (s->next < s->nsess && s->active < s->jobs)
+                return 0;
+        for (i = 0; i < s->next; ++i) {
+                if (sess_timed(s->sess[i])
+                    && (first == 0.0 || s->sess[i]->wake_at < first)) {
+                        first = s->sess[i]->wake_at;
+                }
+        }
+        if (first == 0.0)
+                return -1;
+        now = stats_now();
+        return first > now ? (int)((first - now) * 1000.0) + 1 : 0;
+}
+
+/**
+ * reflash_session_step - Get on with reflashing, without blocking
+ *
+ * Starts devices as there is room, handles whatever they sent, and
+ * whatever is due: reconnects, connect attempts, and replies that are
+ * late.  Looking up a host name is the one thing that can take a while.
+ *
+ * Return: How many devices are not finished yet, or -1 with errno set
+ * if waiting on the epoll set failed
+ */
+int
+reflash_session_step(struct reflash_session_t *s)
+{
+        struct epoll_event ev[FLEET_NEVENTS];
+        int i, n;
+
+        while (s->next < s->nsess && s->active < s->jobs)
+                sess_start(s->sess[s->next++]);
+
+        n = epoll_wait(s->ep, ev, FLEET_NEVENTS, 0);
+        if (n < 0 && errno != EINTR)
+                return -1;
+        for (i = 0; i < n; ++i) {
+                struct fleet_sess_t *d = ev[i].data.ptr;
+                if (d->state != S_DONE && d->state != S_FAILED
+                    && d->state != S_RETRY) {
+                        sess_event(d, ev[i].events);
+                }
+        }
+        for (i = 0; i < s->next; ++i) {
+                struct fleet_sess_t *d = s->sess[i];
+
+                if (!sess_timed(d) || d->wake_at > stats_now())
+                        continue;
+                if (d->state == S_RETRY)
+                        sess_resolve(d);
+                else if (d->state == S_CONNECT)
+                        sess_race(d, connect_race_step(&d->race));
+                else if (d->state == S_WRITE && d->nbatch > 1) {
+                        /* Perhaps too long for the device after all */
+                        d->batch = 1;
+                        capture_add(d->cap, CAPTURE_TIMEOUT, "", 0);
+                        sess_lost(d, "No reply to a batch of %d records "
+                                  "within %.1f s", d->nbatch,
+                                  d->wake_at - d->sent);
+                } else {
+                        capture_add(d->cap, CAPTURE_TIMEOUT, "", 0);
+                        sess_lost(d, "No reply within %.1f s",
+                                  d->wake_at - d->sent);
+                }
+        }
+
+        while (s->next < s->nsess && s->active < s->jobs)
+                sess_start(s->sess[s->next++]);
+        return s->active + (s->nsess - s->next);
+}
+
+/**
+ * reflash_session_free - Done with @s
+ *
+ * Devices still in progress are dropped where they are, without a done
+ * callback; their journals stay behind for the next run.
+ */
+void
+reflash_session_free(struct reflash_session_t *s)
+{
+        int i;
+
+        if (s == NULL)
+                return;
+        for (i = 0; i < s->nsess; ++i) {
+                struct fleet_sess_t *d = s->sess[i];
+
+                if (i < s->next && d->state != S_DONE
+                    && d->state != S_FAILED)
+                        sess_close(d);
+                free(d->host);
+                free(d);
+        }
+        free(s->sess);
+        if (s->ep >= 0)
+                close(s->ep);
+        srec_wire_free(s->wire);
+        connect_forget(&s->cache);
+        free(s->journal);
+        free(s->profiles);
+        free(s->capture);
+        free(s);
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HTIREFLASH_H
+#define HTIREFLASH_H
+
+/*
+ * libhtireflash: reflashing HTI devices over TCP.
+ *
+ * reflash_device() does one device start to finish and returns, printing
+ * its progress to stdout like hti-tcp-reflash does.  A struct
+ * reflash_session_t reflashes any number of devices without ever
+ * blocking, driven from the caller's own event loop:
+ *
+ *      s = reflash_session_new(img, target, &opts, &callbacks);
+ *      reflash_session_add(s, "p620-00123", NULL);
+ *      ...
+ *      while (reflash_session_step(s) > 0) {
+ *              struct pollfd pfd = { reflash_session_fd(s), POLLIN };
+ *              poll(&pfd, 1, reflash_session_timeout(s));
+ *      }
+ *      reflash_session_free(s);
+ *
+ * and reports through the callbacks, never on stdout.  Nothing in the
+ * library is global: sessions, and reflash_device() calls, can run side
+ * by side in as many threads as the caller likes, as long as each is used
+ * by one thread at a time.  Images and targets are only read, and can be
+ * shared by all of them.
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct srec_image_t;
+struct reflash_target_t;
+struct reflash_session_t;
+
+enum {
+        /* Upper bound for struct reflash_opts_t @window */
+        REFLASH_WINDOW_MAX = 64,
+        /* Defaults reflash_opts_init() fills in */
+        REFLASH_JOBS = 32,
+        REFLASH_RETRIES = 3,
+        REFLASH_CONNECT_TIMEOUT = 10,
+        REFLASH_TIMEOUT_CMD = 10,
+        REFLASH_TIMEOUT_ERASE = 120,
+        REFLASH_TIMEOUT_WRITE = 10,
+};
+
+/* Checksum algorithms for struct reflash_opts_t @cksum */
+enum {
+        REFLASH_CKSUM_NONE = 0,
+        REFLASH_CKSUM_SUM16,
+        REFLASH_CKSUM_SUM32,
+        REFLASH_CKSUM_CRC32,
+};
+
+/* Upgrade file formats image_load() reads */
+enum {
+        REFLASH_IMAGE_AUTO = 0,
+        REFLASH_IMAGE_SREC,
+        REFLASH_IMAGE_IHEX,
+        REFLASH_IMAGE_ELF,
+        REFLASH_IMAGE_BIN,
+};
+
+/* struct reflash_stats_t sizes and stats_print() formats */
+enum {
+        REFLASH_STATS_NBUCKETS = 256,
+        REFLASH_STATS_NPHASES = 12,
+        REFLASH_STATS_TEXT = 1,
+        REFLASH_STATS_JSON,
+};
+
+/**
+ * struct stats_hist_t - Fixed-size latency histogram
+ * @bucket: Counts, log-linear in microseconds, see stats.c
+ * @n:      Number of samples
+ * @min:    Smallest sample, us
+ * @max:    Largest sample, us
+ * @sum:    Sum of samples, us
+ */
+struct stats_hist_t {
+        uint64_t bucket[REFLASH_STATS_NBUCKETS];
+        uint64_t n;
+        uint64_t min;
+        uint64_t max;
+        uint64_t sum;
+};
+
+/**
+ * struct reflash_stats_t - Where one device's reflash spent its time
+ * @device:    Host name the device was reached by
+ * @result:    Outcome, set by stats_finish()
+ * @start:     stats_now() when the device was started on
+ * @total:     Seconds from @start to stats_finish()
+ * @resolve:   Seconds spent looking up the host name
+ * @connect:   Seconds spent connecting
+ * @phase:     Seconds spent in each named phase, in the order first begun
+ * @nphase:    Number of entries in @phase
+ * @cur:       Phase being timed, or NULL
+ * @cur_start: stats_now() when @cur began
+ * @records:   S-records written
+ * @bytes_tx:  Bytes sent to the device
+ * @bytes_rx:  Bytes received from the device
+ * @reconnects: Times the connection was lost and made again
+ * @rtt:       Command-to-reply times
+ */
+struct reflash_stats_t {
+        char device[64];
+        char result[32];
+        double start;
+        double total;
+        double resolve;
+        double connect;
+        struct {
+                const char *name;
+                double secs;
+        } phase[REFLASH_STATS_NPHASES];
+        int nphase;
+        const char *cur;
+        double cur_start;
+        unsigned long records;
+        uint64_t bytes_tx;
+        uint64_t bytes_rx;
+        unsigned int reconnects;
+        struct stats_hist_t rtt;
+};
+
+/**
+ * struct reflash_opts_t - User options passed down to the reflash routines
+ * @window: Maximum number of FLASH WRITE commands in flight at once.  1
+ *          is plain stop-and-wait.  Larger values are an upper bound;
+ *          the window actually used grows and shrinks with the replies.
+ *          0 takes the bound from the device's profile, or 1 without one.
+ * @batch:  Most records a target that cannot pipeline (the SCPI ones)
+ *          gets in one command line, to acknowledge all at once.  0 is
+ *          as many as fit its input buffer, 1, the default, sends every
+ *          record in a command of its own.
+ * @jobs:   Maximum number of devices a struct reflash_session_t works
+ *          on at once
+ * @cksum:  REFLASH_CKSUM_xxx algorithm the device's checksum query
+ *          uses, or REFLASH_CKSUM_NONE to neither skip up-to-date devices
+ *          nor verify
+ * @journal: Directory of progress journals, or NULL to keep none.  One
+ *           left by an earlier run is only carried on from with @cksum.
+ * @profiles: Directory of tuning profiles, or NULL to keep none
+ * @capture: Directory to save a transcript of each device's connection
+ *           in when it is done, or NULL to keep none
+ * @probe:   Nonzero to probe the device, by reflash_device(), between
+ *           unlocking and erasing, and replace its profile with what
+ *           was found.  Needs @profiles.
+ * @retries: How many times a lost connection is made again before the
+ *           device is given up on
+ * @connect_timeout: Seconds to let a connection take
+ * @timeout_cmd:   Seconds to wait for the reply to a command other than
+ *                 an erase or a write: unlock, lock, checksum...
+ * @timeout_erase: Seconds to wait for an erase to complete
+ * @timeout_write: Upper bound of the adaptive FLASH WRITE timeout
+ */
+struct reflash_opts_t {
+        int window;
+        int batch;
+        int jobs;
+        int cksum;
+        const char *journal;
+        const char *profiles;
+        const char *capture;
+        int probe;
+        int retries;
+        double connect_timeout;
+        double timeout_cmd;
+        double timeout_erase;
+        double timeout_write;
+};
+
+/**
+ * struct image_opts_t - How image_open() reads and reshapes an upgrade
+ *                       file
+ * @format:      REFLASH_IMAGE_xxx
+ * @base:        Address of the first byte of a REFLASH_IMAGE_BIN file
+ * @reblock:     -1 to leave the records as they are, otherwise merge
+ *               them into records as long as the target takes, or of
+ *               at most @reblock data bytes if not 0
+ * @skip_erased: Nonzero to leave out data erased flash is taken to
+ *               hold already; see --skip-erased in the man page
+ */
+struct image_opts_t {
+        int format;
+        uint32_t base;
+        int reblock;
+        int skip_erased;
+};
+
+/* How a device in a struct reflash_session_t ended up */
+enum {
+        REFLASH_FAILED = -1,
+        REFLASH_OK = 0,
+        /* Its checksum already matched the image */
+        REFLASH_CURRENT,
+};
+
+/**
+ * struct reflash_result_t - How a device in a struct reflash_session_t
+ *                           ended up
+ * @result:  REFLASH_xxx
+ * @records: Records the device has acknowledged, in this run or before
+ * @secs:    Seconds from starting on the device to finishing with it
+ * @error:   Why it failed, or NULL
+ */
+struct reflash_result_t {
+        int result;
+        int records;
+        double secs;
+        const char *error;
+};
+
+/**
+ * struct reflash_qual_t - How the link to one device measured up, and
+ *                         how long reflashing it would take
+ * @device:   Host name the device was reached by
+ * @queries:  Queries sent
+ * @lost:     Of those, how many got no reply in time
+ * @lost_secs: Seconds spent waiting on them before giving up
+ * @stalls:   Replies taking QUALIFY_STALL times the median round trip
+ * @rtt_min:  Round trips of the answered queries, seconds
+ * @rtt_p50:  ...their median
+ * @rtt_p90:  ...90th percentile
+ * @rtt_p99:  ...99th percentile
+ * @rtt_max:  ...longest
+ * @rtt_mean: ...mean
+ * @window:   Writes the reflash would keep in flight, 1 if replies were
+ *            lost with more in flight
+ * @pace:     Seconds between replies with @window queries in flight, or
+ *            0 if not measured
+ * @lines:    Write command lines the reflash would send
+ * @connect:  Seconds connecting took
+ * @erase:    Seconds the device's last erase took, or the erase timeout
+ *            if not known
+ * @erase_bound: Nonzero if @erase is the erase timeout
+ * @write:    Projected seconds of writing
+ * @project:  Projected seconds of the whole reflash
+ */
+struct reflash_qual_t {
+        char device[64];
+        int queries;
+        int lost;
+        double lost_secs;
+        int stalls;
+        double rtt_min;
+        double rtt_p50;
+        double rtt_p90;
+        double rtt_p99;
+        double rtt_max;
+        double rtt_mean;
+        int window;
+        double pace;
+        int lines;
+        double connect;
+        double erase;
+        int erase_bound;
+        double write;
+        double project;
+};
+
+/**
+ * struct reflash_callbacks_t - What a struct reflash_session_t reports
+ * @arg:      Passed to each callback
+ * @log:      A line of news about device @dev, the index
+ *            reflash_session_add() returned: "Erasing...", "connected"
+ * @progress: Device @dev's records from @from up to @to are dealt with:
+ *            acknowledged if @written, otherwise skipped, because they
+ *            were written by an earlier run, the device already holds
+ *            the image, or it failed and will never get them
+ * @done:     Device @dev is finished with, as @res says
+ *
+ * Any of them may be NULL.  They are called from within
+ * reflash_session_step() and must not call back into the session.
+ */
+struct reflash_callbacks_t {
+        void *arg;
+        void (*log)(void *arg, int dev, const char *msg);
+        void (*progress)(void *arg, int dev, int from, int to, int written);
+        void (*done)(void *arg, int dev, const struct reflash_result_t *res);
+};
+
+/* srec.c */
+extern struct srec_image_t *srec_load(FILE *fp, const char *name,
+                                      FILE *err);
+extern void srec_free(struct srec_image_t *img);
+extern int srec_reblock(struct srec_image_t *img, int maxtext, int maxdata);
+extern int srec_skip_erased(struct srec_image_t *img, int erased,
+                            size_t *nbytes);
+
+/* image.c */
+extern struct srec_image_t *image_load(FILE *fp, const char *name,
+                                       FILE *err, int format, uint32_t base,
+                                       int maxtext, int maxdata);
+extern struct srec_image_t *image_open(const char *path,
+                                       const struct reflash_target_t *t,
+                                       const struct image_opts_t *io,
+                                       const char *profiles, FILE *out,
+                                       FILE *err);
+
+/* stats.c */
+extern void stats_print(FILE *fp, const struct reflash_stats_t *st,
+                        int format);
+
+/* reflash.c */
+extern void reflash_opts_init(struct reflash_opts_t *opts);
+extern const struct reflash_target_t *reflash_target(const char *name);
+extern int reflash_target_fits(const struct reflash_target_t *t,
+                               const struct srec_image_t *img);
+extern int reflash_device(const char *host, const struct srec_image_t *img,
+                          const struct reflash_target_t *t,
+                          const struct reflash_opts_t *opts,
+                          struct reflash_stats_t *stats);
+
+/* fleet.c */
+extern struct reflash_session_t *
+reflash_session_new(const struct srec_image_t *img,
+                    const struct reflash_target_t *t,
+                    const struct reflash_opts_t *opts,
+                    const struct reflash_callbacks_t *cb);
+extern int reflash_session_add(struct reflash_session_t *s, const char *host,
+                               struct reflash_stats_t *stats);
+extern int reflash_session_fd(const struct reflash_session_t *s);
+extern int reflash_session_timeout(const struct reflash_session_t *s);
+extern int reflash_session_step(struct reflash_session_t *s);
+extern void reflash_session_free(struct reflash_session_t *s);
+
+/* qualify.c */
+extern int reflash_qualify(const char *host, const struct srec_image_t *img,
+                           const struct reflash_target_t *t,
+                           const struct reflash_opts_t *opts, int count,
+                           struct reflash_qual_t *q,
+                           struct reflash_stats_t *stats);
+extern void qualify_print(FILE *fp, const struct reflash_qual_t *q,
+                          int format);
+
+/* daemon.c */
+extern int reflash_daemon(const char *path, const struct reflash_opts_t *opts,
+                          const struct image_opts_t *io,
+                          volatile sig_atomic_t *stop, FILE *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTIREFLASH_H */
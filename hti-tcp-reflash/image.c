@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Upgrade files other than S-records
+ *
+ * Intel HEX, ELF and raw binary files are read whole and reduced to
+ * segments, runs of bytes at consecutive addresses.  The segments are
+ * cut into data records as long as the target takes, between an S0
+ * header and a termination record, which makes the same struct
+ * srec_image_t srec_load() makes of an S-record file; srec_wire() then
+ * encodes it straight into write commands.  No S-record file is ever
+ * written.
+ *
+ * Addresses that fit in 24 bits make S2 records, as in the .s28 files
+ * the targets are made for, others S3.
+ */
+#include "reflash.h"
+#include <elf.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+        /* ":" + count, address, type, 255 data bytes and checksum */
+        IHEX_TEXT_MAX = 1 + 2 * (1 + 2 + 1 + 255 + 1),
+        /* Bytes of the file name an S0 header carries */
+        IMAGE_HEADER_MAX = 32,
+};
+
+/**
+ * struct seg_t - Bytes at consecutive addresses
+ * @addr:  Address of the first
+ * @off:   Where they are in struct seglist_t @data
+ * @len:   How many
+ * @where: Line or program header they start in, for error messages
+ */
+struct seg_t {
+        uint64_t addr;
+        size_t off;
+        size_t len;
+        int where;
+};
+
+struct seglist_t {
+        struct seg_t *seg;
+        int n;
+        int size;
+        const unsigned char *data;
+        uint64_t entry;
+        const char *where;      /* what struct seg_t @where counts */
+};
+
+/* Add @len bytes at @off for @addr, onto the last segment if they follow */
+static int
+seg_add(struct seglist_t *l, uint64_t addr, size_t off, size_t len,
+        int where)
+{
+        struct seg_t *last = l->n > 0 ? &l->seg[l->n - 1] : NULL;
+
+        if (len == 0)
+                return 0;
+        if (last != NULL && last->addr + last->len == addr
+            && last->off + last->len == off) {
+                last->len += len;
+                return 0;
+        }
+        if (l->n == l->size) {
+                int size = l->size ? 2 * l->size : 16;
+                struct seg_t *tmp = realloc(l->seg, size * sizeof(*tmp));
+
+                if (tmp == NULL)
+                        return -1;
+                l->seg = tmp;
+                l->size = size;
+        }
+        l->seg[l->n].addr = addr;
+        l->seg[l->n].off = off;
+        l->seg[l->n].len = len;
+        l->seg[l->n].where = where;
+        l->n++;
+        return 0;
+}
+
+/* All of @fp from where it is, in @*size bytes, or NULL */
+static unsigned char *
+read_all(FILE *fp, size_t *size)
+{
+        unsigned char *buf = NULL, *tmp;
+        size_t len = 0, cap = 0, n;
+
+        do {
+                if (len == cap) {
+                        cap = cap ? 2 * cap : 65536;
+                        if ((tmp = realloc(buf, cap)) == NULL) {
+                                free(buf);
+                                return NULL;
+                        }
+                        buf = tmp;
+                }
+                n = fread(&buf[len], 1, cap - len, fp);
+                len += n;
+        } while (n > 0);
+        if (ferror(fp)) {
+                free(buf);
+                return NULL;
+        }
+        *size = len;
+        return buf;
+}
+
+static int
+load_bin(const unsigned char *buf, size_t size, uint32_t base,
+         struct seglist_t *l, const char *name, FILE *err)
+{
+        if ((uint64_t)base + size > 0x100000000ull) {
+                fprintf(err, "%s: %lu bytes at 0x%lX run past 32-bit "
+                        "addresses\n", name, (unsigned long)size,
+                        (unsigned long)base);
+                return -1;
+        }
+        l->data = buf;
+        l->entry = base;
+        l->where = "byte";
+        return seg_add(l, base, 0, size, 0);
+}
+
+/*
+ * Intel HEX: data records (type 00) at 16-bit addresses, offset by the
+ * last extended segment (02) or linear (04) address record, up to the
+ * end-of-file record (01).  Start address records (03, 05) give the
+ * entry point.  Decoded bytes go to @out, which has room for them all.
+ */
+static int
+load_ihex(const unsigned char *buf, size_t size, unsigned char *out,
+          struct seglist_t *l, const char *name, FILE *err)
+{
+        const char *p = (const char *)buf, *end = p + size, *nl;
+        unsigned char b[IHEX_TEXT_MAX / 2];
+        uint64_t upper = 0;
+        size_t nout = 0;
+        int lineno = 0, eof = 0;
+
+        l->data = out;
+        l->where = "line";
+        for (; p < end && !eof; p = nl + 1) {
+                const char *msg = NULL;
+                unsigned int i, count, sum = 0;
+                size_t len;
+
+                if ((nl = memchr(p, '\n', end - p)) == NULL)
+                        nl = end;
+                len = nl - p;
+                ++lineno;
+                while (len > 0 && p[len - 1] == '\r')
+                        --len;
+                if (len == 0)
+                        continue;
+                if (p[0] != ':' || len < 11 || len > IHEX_TEXT_MAX
+                    || (len & 1) == 0) {
+                        msg = "not an Intel HEX record";
+                } else if (srec_hex_decode(p + 1, len - 1, b) < 0) {
+                        msg = "invalid hex digit";
+                } else if ((count = b[0]) != (len - 11) / 2) {
+                        msg = "byte count does not match record length";
+                } else {
+                        for (i = 0; i < (len - 1) / 2; ++i)
+                                sum += b[i];
+                        if ((sum & 0xffu) != 0)
+                                msg = "bad checksum";
+                }
+                if (msg == NULL) {
+                        uint32_t addr = b[1] << 8 | b[2];
+                        uint32_t v = 0;
+
+                        for (i = 0; i < count && i < 4; ++i)
+                                v = v << 8 | b[4 + i];
+                        switch (b[3]) {
+                        case 0x00:
+                                memcpy(&out[nout], &b[4], count);
+                                if (seg_add(l, upper + addr, nout, count,
+                                            lineno) < 0)
+                                        msg = "out of memory";
+                                nout += count;
+                                break;
+                        case 0x01:
+                                eof = 1;
+                                break;
+                        case 0x02:
+                        case 0x04:
+                                if (count != 2)
+                                        msg = "bad extended address record";
+                                upper = (uint64_t)v << (b[3] == 0x02 ? 4 : 16);
+                                break;
+                        case 0x03:
+                        case 0x05:
+                                if (count != 4)
+                                        msg = "bad start address record";
+                                l->entry = b[3] == 0x05 ? v
+                                           : (v >> 16) * 16 + (v & 0xffff);
+                                break;
+                        default:
+                                msg = "unknown record type";
+                        }
+                }
+                if (msg != NULL) {
+                        fprintf(err, "%s:%d: %s\n", name, lineno, msg);
+                        return -1;
+                }
+        }
+        if (!eof) {
+                fprintf(err, "%s: no end-of-file record, "
+                        "file truncated?\n", name);
+                return -1;
+        }
+        return 0;
+}
+
+/* Field of @size bytes at @off of @buf, in the file's byte order */
+static uint64_t
+elf_get(const unsigned char *buf, size_t off, int size, int big)
+{
+        uint64_t v = 0;
+        int i;
+
+        for (i = 0; i < size; ++i)
+                v |= (uint64_t)buf[off + i] << 8 * (big ? size - 1 - i : i);
+        return v;
+}
+
+#define ELF_GET(buf, type, field, big) \
+        elf_get(buf, offsetof(type, field), sizeof(((type *)0)->field), big)
+
+/*
+ * ELF, 32 or 64-bit, either byte order: the file bytes of every PT_LOAD
+ * segment, at its physical address, where it lives in flash.  What is
+ * only zeroed at run time (.bss) takes no room in flash.
+ */
+static int
+load_elf(const unsigned char *buf, size_t size, struct seglist_t *l,
+         const char *name, FILE *err)
+{
+        uint64_t phoff, entsize, i, phnum;
+        int is64, big;
+
+        l->data = buf;
+        l->where = "program header";
+        if (size < sizeof(Elf32_Ehdr) || memcmp(buf, ELFMAG, SELFMAG) != 0
+            || (buf[EI_CLASS] != ELFCLASS32 && buf[EI_CLASS] != ELFCLASS64)
+            || (buf[EI_DATA] != ELFDATA2LSB && buf[EI_DATA] != ELFDATA2MSB)) {
+                fprintf(err, "%s: not an ELF file\n", name);
+                return -1;
+        }
+        is64 = buf[EI_CLASS] == ELFCLASS64;
+        big = buf[EI_DATA] == ELFDATA2MSB;
+        if (is64 && size < sizeof(Elf64_Ehdr)) {
+                fprintf(err, "%s: truncated ELF header\n", name);
+                return -1;
+        }
+        if (is64) {
+                l->entry = ELF_GET(buf, Elf64_Ehdr, e_entry, big);
+                phoff = ELF_GET(buf, Elf64_Ehdr, e_phoff, big);
+                entsize = ELF_GET(buf, Elf64_Ehdr, e_phentsize, big);
+                phnum = ELF_GET(buf, Elf64_Ehdr, e_phnum, big);
+        } else {
+                l->entry = ELF_GET(buf, Elf32_Ehdr, e_entry, big);
+                phoff = ELF_GET(buf, Elf32_Ehdr, e_phoff, big);
+                entsize = ELF_GET(buf, Elf32_Ehdr, e_phentsize, big);
+                phnum = ELF_GET(buf, Elf32_Ehdr, e_phnum, big);
+        }
+        if (entsize < (is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr))
+            || phoff > size || phnum > (size - phoff) / entsize) {
+                fprintf(err, "%s: program headers out of the file\n",
+                        name);
+                return -1;
+        }
+        for (i = 0; i < phnum; ++i) {
+                const unsigned char *ph = buf + phoff + i * entsize;
+                uint64_t type, off, addr, len;
+
+                if (is64) {
+                        type = ELF_GET(ph, Elf64_Phdr, p_type, big);
+                        off = ELF_GET(ph, Elf64_Phdr, p_offset, big);
+                        addr = ELF_GET(ph, Elf64_Phdr, p_paddr, big);
+                        len = ELF_GET(ph, Elf64_Phdr, p_filesz, big);
+                } else {
+                        type = ELF_GET(ph, Elf32_Phdr, p_type, big);
+                        off = ELF_GET(ph, Elf32_Phdr, p_offset, big);
+                        addr = ELF_GET(ph, Elf32_Phdr, p_paddr, big);
+                        len = ELF_GET(ph, Elf32_Phdr, p_filesz, big);
+                }
+                if (type != PT_LOAD || len == 0)
+                        continue;
+                if (off > size || len > size - off) {
+                        fprintf(err, "%s: segment %lu runs past the end "
+                                "of the file\n", name, (unsigned long)i);
+                        return -1;
+                }
+                if (seg_add(l, addr, off, len, i) < 0) {
+                        fprintf(err, "realloc: %s\n", strerror(errno));
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static int
+cmp_seg(const void *a, const void *b)
+{
+        const struct seg_t *sa = a, *sb = b;
+
+        if (sa->addr != sb->addr)
+                return sa->addr < sb->addr ? -1 : 1;
+        return 0;
+}
+
+/* Overlapping or out-of-range segments, checked on a sorted copy */
+static int
+seg_check(const struct seglist_t *l, const char *name, FILE *err)
+{
+        struct seg_t *s;
+        int i, res = 0;
+
+        if (l->n == 0) {
+                fprintf(err, "%s: no data\n", name);
+                return -1;
+        }
+        if ((s = malloc(l->n * sizeof(*s))) == NULL) {
+                fprintf(err, "malloc: %s\n", strerror(errno));
+                return -1;
+        }
+        memcpy(s, l->seg, l->n * sizeof(*s));
+        qsort(s, l->n, sizeof(*s), cmp_seg);
+        for (i = 1; i < l->n && res == 0; ++i) {
+                if (s[i - 1].addr + s[i - 1].len > s[i].addr) {
+                        fprintf(err, "%s: data of %s %d overlaps %s %d\n",
+                                name, l->where, s[i].where, l->where,
+                                s[i - 1].where);
+                        res = -1;
+                }
+        }
+        if (res == 0 && s[l->n - 1].addr + s[l->n - 1].len > 0x100000000ull) {
+                fprintf(err, "%s: data beyond 32-bit addresses\n", name);
+                res = -1;
+        }
+        free(s);
+        return res;
+}
+
+/*
+ * Cut @l into records of at most @maxtext characters and @maxdata data
+ * bytes (0 for no limit), after an S0 header with the base name of
+ * @name, and end with a termination record carrying the entry point.
+ */
+static struct srec_image_t *
+seg_image(const struct seglist_t *l, const char *name, FILE *err,
+          int maxtext, int maxdata)
+{
+        const char *base = strrchr(name, '/') ? strrchr(name, '/') + 1
+                                               : name;
+        struct srec_image_t *img;
+        uint64_t hi = 0;
+        size_t ndata, hlen;
+        int i, nrec, alen, per;
+        char type;
+
+        for (i = 0; i < l->n; ++i) {
+                if (l->seg[i].addr + l->seg[i].len > hi)
+                        hi = l->seg[i].addr + l->seg[i].len;
+        }
+        type = hi <= 0x1000000 ? '2' : '3';
+        alen = type == '2' ? 3 : 4;
+        /* "Stnn" + address, data and checksum bytes in hex */
+        per = (maxtext - 4) / 2 - alen - 1;
+        if (per > 255 - alen - 1)
+                per = 255 - alen - 1;
+        if (maxdata > 0 && maxdata < per)
+                per = maxdata;
+        if (per < 1)
+                per = 1;
+
+        hlen = strlen(base);
+        if (hlen > IMAGE_HEADER_MAX)
+                hlen = IMAGE_HEADER_MAX;
+        if ((int)hlen > per)
+                hlen = per;
+        nrec = 2;
+        ndata = hlen;
+        for (i = 0; i < l->n; ++i) {
+                nrec += (l->seg[i].len + per - 1) / per;
+                ndata += l->seg[i].len;
+        }
+        if ((img = calloc(1, sizeof(*img))) == NULL
+            || (img->rec = calloc(nrec, sizeof(*img->rec))) == NULL
+            || (img->data = malloc(ndata)) == NULL) {
+                fprintf(err, "malloc: %s\n", strerror(errno));
+                if (img != NULL)
+                        srec_free(img);
+                return NULL;
+        }
+
+        img->rec[0].type = '0';
+        img->rec[0].len = hlen;
+        memcpy(img->data, base, hlen);
+        img->ndata = hlen;
+        img->nrec = 1;
+        for (i = 0; i < l->n; ++i) {
+                const struct seg_t *s = &l->seg[i];
+                size_t at, chunk = per;
+
+                memcpy(&img->data[img->ndata], &l->data[s->off], s->len);
+                for (at = 0; at < s->len; at += chunk) {
+                        struct srec_rec_t *r = &img->rec[img->nrec++];
+
+                        r->type = type;
+                        r->len = s->len - at < chunk ? s->len - at : chunk;
+                        r->addr = s->addr + at;
+                        r->off = img->ndata + at;
+                        r->lineno = s->where;
+                }
+                img->ndata += s->len;
+        }
+        img->rec[img->nrec].type = type == '2' ? '8' : '7';
+        img->rec[img->nrec].addr = l->entry < (1ull << 8 * alen)
+                                   ? (uint32_t)l->entry : 0;
+        img->rec[img->nrec].off = img->ndata;
+        img->nrec++;
+        if (srec_validate(img, name, err) < 0) {
+                srec_free(img);
+                return NULL;
+        }
+        return img;
+}
+
+/**
+ * image_load - Read and check a whole upgrade file, of any format
+ * @fp:      File to read
+ * @name:    File name for error messages
+ * @err:     Where to print them
+ * @format:  REFLASH_IMAGE_xxx, or REFLASH_IMAGE_AUTO to tell S-records,
+ *           Intel HEX and ELF apart by their first byte
+ * @base:    Address of the first byte of a REFLASH_IMAGE_BIN file
+ * @maxtext: Longest S-record text to cut the data into, for formats
+ *           other than S-records
+ * @maxdata: Most data bytes per record, or 0 for no limit besides
+ *           @maxtext
+ *
+ * S-record files go to srec_load() and keep their own records.
+ *
+ * Return: The image, to be freed with srec_free(), or NULL after
+ * printing the reason to @err
+ */
+struct srec_image_t *
+image_load(FILE *fp, const char *name, FILE *err, int format,
+           uint32_t base, int maxtext, int maxdata)
+{
+        struct srec_image_t *img = NULL;
+        struct seglist_t l;
+        unsigned char *buf, *out = NULL;
+        size_t size;
+        int c, res = -1;
+
+        if (format == REFLASH_IMAGE_AUTO) {
+                c = getc(fp);
+                ungetc(c, fp);
+                if (c == 'S')
+                        format = REFLASH_IMAGE_SREC;
+                else if (c == ':')
+                        format = REFLASH_IMAGE_IHEX;
+                else if (c == ELFMAG0)
+                        format = REFLASH_IMAGE_ELF;
+                else {
+                        fprintf(err, "%s: not S-records, Intel HEX or "
+                                "ELF; a raw binary needs its format and "
+                                "base address given\n", name);
+                        return NULL;
+                }
+        }
+        if (format == REFLASH_IMAGE_SREC)
+                return srec_load(fp, name, err);
+
+        if ((buf = read_all(fp, &size)) == NULL) {
+                fprintf(err, "%s: %s\n", name, strerror(errno));
+                return NULL;
+        }
+        memset(&l, 0, sizeof(l));
+        if (format == REFLASH_IMAGE_BIN) {
+                res = load_bin(buf, size, base, &l, name, err);
+        } else if (format == REFLASH_IMAGE_ELF) {
+                res = load_elf(buf, size, &l, name, err);
+        } else if ((out = malloc(size / 2 + 1)) == NULL) {
+                fprintf(err, "malloc: %s\n", strerror(errno));
+        } else {
+                res = load_ihex(buf, size, out, &l, name, err);
+        }
+        if (res == 0 && seg_check(&l, name, err) == 0)
+                img = seg_image(&l, name, err, maxtext, maxdata);
+        free(l.seg);
+        free(out);
+        free(buf);
+        return img;
+}
+
+/**
+ * image_open - Read an upgrade file for @t, check it, and shape it for
+ *              writing
+ * @path:     File to read
+ * @t:        Kind of device it is for
+ * @io:       How to read and reshape it
+ * @profiles: Directory of tuning profiles, or NULL.  Records are made
+ *            no longer than every firmware of @t seen so far takes.
+ * @out:      Where to say what the file holds and what was done to it
+ * @err:      Where to say why it will not do
+ *
+ * Return: The image, to be freed with srec_free(), or NULL after
+ * printing the reason to @err
+ */
+struct srec_image_t *
+image_open(const char *path, const struct reflash_target_t *t,
+           const struct image_opts_t *io, const char *profiles, FILE *out,
+           FILE *err)
+{
+        int maxtext = profile_srec_max(profiles, t);
+        struct srec_image_t *img;
+        FILE *fp;
+
+        if ((fp = fopen(path, "r")) == NULL) {
+                fprintf(err, "Cannot open reflash file %s: %s\n",
+                        path, strerror(errno));
+                return NULL;
+        }
+        /* Other formats are cut into records as long as --reblock would */
+        img = image_load(fp, path, err, io->format, io->base, maxtext,
+                         io->reblock > 0 ? io->reblock : 0);
+        fclose(fp);
+        if (img == NULL)
+                return NULL;
+        if (!reflash_target_fits(t, img)) {
+                fprintf(err, "%s: data up to 0x%lX, but %s upgrade "
+                        "files have %d-bit addresses.  Wrong upgrade "
+                        "file?\n", path, (unsigned long)img->hi, t->name,
+                        t->addr_bits);
+                srec_free(img);
+                return NULL;
+        }
+        fprintf(out, "%s: %d records, data at 0x%lX-0x%lX\n",
+                path, img->nrec, (unsigned long)img->lo,
+                (unsigned long)img->hi);
+        if (t->erased >= 0 && io->skip_erased) {
+                size_t nbytes;
+                int n;
+
+                /* Every write follows an erase, or resumes after one */
+                if ((n = srec_skip_erased(img, t->erased, &nbytes)) < 0)
+                        goto nomem;
+                if (nbytes > 0) {
+                        fprintf(out, "Skipping %lu bytes of erased flash, "
+                                "%d records of them whole\n",
+                                (unsigned long)nbytes, n);
+                }
+        }
+        if (io->reblock >= 0) {
+                int nrec = img->nrec;
+
+                if (srec_reblock(img, maxtext, io->reblock) < 0)
+                        goto nomem;
+                fprintf(out, "Re-blocked into %d records (%.0f%% fewer)\n",
+                        img->nrec, 100.0 * (nrec - img->nrec) / nrec);
+        }
+        return img;
+
+nomem:
+        fprintf(err, "malloc: %s\n", strerror(errno));
+        srec_free(img);
+        return NULL;
+}
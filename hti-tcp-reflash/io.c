@@ -34,154 +34,431 @@
  */
 
 #include "reflash.h"
-#include <arpa/inet.h>
+#include <errno.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-
 enum {
-        HTI_PORT = 2000,
+        TCP_RXBUF = 8192,
+        TCP_TXBUF = 16384,
+        TCP_IOV_MAX = 64,
+        TCP_NODE_MAX = 256,
 };
 
-static const char *HTI_SERVICE = "2000";
-
+/*
+ * One socket, no stdio.
+ *
+ * Received bytes collect in @rx.  tcp_getline() hands out each line in
+ * place, nul-terminated where its line ending was, and only moves the
+ * unread tail down to the front of @rx when the buffer runs out of room.
+ *
+ * Commands are formatted into @tx, or left where they are by
+ * tcp_queue_buf(), and gathered in @iov; nothing goes out until
+ * tcp_flush(), which sends the whole batch with one sendmsg().
+ * Nagle is off, since batching is done here rather than in the kernel.
+ *
+ * The socket is non-blocking and every wait is a poll() bounded by
+ * @deadline, set with tcp_deadline(), so a device that stops answering
+ * or reading makes the call fail with ETIMEDOUT instead of hanging.
+ * @node's addresses are looked up once, into @cache, for reconnecting.
+ * With @cap set, what goes over the wire is recorded there as well.
+ */
 struct reflash_tcp_t {
-        FILE *fp;
-        FILE *fpin;
-        char *lineptr;
-        size_t n;
+        int fd;
+        size_t rxhead;
+        size_t rxtail;
+        size_t txlen;
+        int niov;
+        struct iovec iov[TCP_IOV_MAX];
+        struct reflash_stats_t *stats;
+        struct reflash_capture_t *cap;
+        double timeout;
+        double deadline;
+        char node[TCP_NODE_MAX];
+        struct connect_cache_t *cache;
+        char rx[TCP_RXBUF];
+        char tx[TCP_TXBUF];
 };
 
+/*
+ * Race connects to every address @tcp's node resolves to, see connect.c,
+ * printing each as it is tried.  Timings go to @st, if not NULL.  Return
+ * a non-blocking socket, or -1 with errno set.
+ */
 static int
-open_remote_socket(const char *node, int socktype)
+open_remote_socket(struct reflash_tcp_t *tcp, struct reflash_stats_t *st)
 {
-        struct addrinfo hints;
-        struct addrinfo *list, *rp;
-        int res, fd = -1;
+        const char *node = tcp->node;
+        double timeout = tcp->timeout;
+        const struct addrinfo *list;
+        struct connect_race_t race;
+        char addr[NI_MAXHOST], host[NI_MAXHOST];
+        int res, fd, printed = 0;
+        double t0 = stats_now();
 
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET;
-        hints.ai_socktype = socktype;
-
-        res = getaddrinfo(node, HTI_SERVICE, &hints, &list);
+        res = connect_resolve(&tcp->cache, node, &list);
+        if (st != NULL)
+                st->resolve = stats_now() - t0;
+        t0 = stats_now();
         if (res != 0) {
                 fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
+                errno = EHOSTUNREACH;
                 return -1;
         }
 
-        for (rp = list; rp != NULL; rp = rp->ai_next) {
-                struct sockaddr_in sin;
-
-                if (rp->ai_family != AF_INET
-                    || rp->ai_addrlen != sizeof(sin)) {
-                        continue;
-                }
+        fd = connect_race_start(&race, list, timeout);
+        for (;;) {
+                struct pollfd pfd[CONNECT_MAX];
+                int fds[CONNECT_MAX];
+                int i, n;
 
-                fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-                if (fd == -1)
-                        continue;
-
-                memcpy(&sin, rp->ai_addr, sizeof(sin));
-                sin.sin_port = HTI_PORT;
-                printf("Trying %s...\n", inet_ntoa(sin.sin_addr));
-                if (connect(fd, rp->ai_addr, rp->ai_addrlen) != -1) {
-                        char host[NI_MAXHOST];
-                        const char *socktype_name = (socktype == SOCK_STREAM)
-                                                   ? "TCP" : "UDP";
-                        res = getnameinfo(rp->ai_addr, rp->ai_addrlen,
-                                          host, sizeof(host), NULL, 0, 0);
-                        if (res != 0) {
-                                printf("Connecting via %s to <%s/%d>\n",
-                                       socktype_name,
-                                       inet_ntoa(sin.sin_addr),
-                                       (unsigned int)sin.sin_port);
-                        } else {
-                                printf("Connecting via %s to <%s/%d> '%s'\n",
-                                       socktype_name,
-                                       inet_ntoa(sin.sin_addr),
-                                       (unsigned int)sin.sin_port,
-                                       host);
+                for (; printed < race.next; ++printed) {
+                        const struct addrinfo *ai = race.ai[printed];
+                        if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
+                                        addr, sizeof(addr), NULL, 0,
+                                        NI_NUMERICHOST) == 0) {
+                                printf("Trying %s...\n", addr);
                         }
+                }
+                if (fd >= 0 || errno != EINPROGRESS)
                         break;
+                n = connect_race_fds(&race, fds);
+                for (i = 0; i < n; ++i) {
+                        pfd[i].fd = fds[i];
+                        pfd[i].events = POLLOUT;
                 }
-                close(fd);
-                fd = -1;
+                poll(pfd, n, connect_race_timeout(&race));
+                fd = connect_race_step(&race);
         }
+        if (st != NULL)
+                st->connect = stats_now() - t0;
+        if (fd < 0)
+                return -1;
 
-        freeaddrinfo(list);
+        res = getnameinfo(race.winner->ai_addr, race.winner->ai_addrlen,
+                          addr, sizeof(addr), NULL, 0, NI_NUMERICHOST);
+        if (res != 0)
+                snprintf(addr, sizeof(addr), "?");
+        res = getnameinfo(race.winner->ai_addr, race.winner->ai_addrlen,
+                          host, sizeof(host), NULL, 0, 0);
+        if (res != 0) {
+                printf("Connecting via TCP to <%s/%d>\n", addr, HTI_PORT);
+        } else {
+                printf("Connecting via TCP to <%s/%d> '%s'\n",
+                       addr, HTI_PORT, host);
+        }
         return fd;
 }
 
+/* Wait until @fd is ready for @events, or the deadline passes */
 static int
-tcp_vfprintf(struct reflash_tcp_t *tcp, const char *fmt, va_list ap)
+tcp_wait(struct reflash_tcp_t *tcp, short events)
 {
-        int res = vfprintf(tcp->fp, fmt, ap);
-        if (res < 0)
-                return res;
-        fputc('\r', tcp->fp);
-        fflush(tcp->fp);
+        struct pollfd pfd;
+        int res, ms = -1;
+
+        pfd.fd = tcp->fd;
+        pfd.events = events;
+        do {
+                if (tcp->deadline != 0.0) {
+                        double left = tcp->deadline - stats_now();
+                        if (left <= 0.0) {
+                                capture_add(tcp->cap, CAPTURE_TIMEOUT, "", 0);
+                                errno = ETIMEDOUT;
+                                return -1;
+                        }
+                        ms = (int)(left * 1000.0) + 1;
+                }
+                res = poll(&pfd, 1, ms);
+        } while (res == 0 || (res < 0 && errno == EINTR));
+        return res < 0 ? -1 : 0;
+}
+
+/*
+ * Send everything queued.  With @more set the kernel is told more data
+ * follows (MSG_MORE), so a batch too big for @tx still leaves in full
+ * segments.
+ */
+static int
+tcp_flush_(struct reflash_tcp_t *tcp, int more)
+{
+        struct msghdr msg;
+        struct iovec *iov = tcp->iov;
+        int niov = tcp->niov;
+        int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        int i;
+
+        for (i = 0; tcp->cap != NULL && i < niov; ++i) {
+                /* Every entry is one command, '\r' last */
+                capture_add(tcp->cap, CAPTURE_SENT, iov[i].iov_base,
+                            iov[i].iov_len - 1);
+        }
+        while (niov > 0) {
+                ssize_t res;
+
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = niov;
+                res = sendmsg(tcp->fd, &msg, flags);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                if (tcp_wait(tcp, POLLOUT) < 0)
+                                        return -1;
+                                continue;
+                        }
+                        capture_note(tcp->cap, CAPTURE_LOST, "send: %s",
+                                     strerror(errno));
+                        return -1;
+                }
+                if (tcp->stats != NULL)
+                        tcp->stats->bytes_tx += res;
+                while (niov > 0 && (size_t)res >= iov->iov_len) {
+                        res -= iov->iov_len;
+                        ++iov;
+                        --niov;
+                }
+                if (niov > 0) {
+                        iov->iov_base = (char *)iov->iov_base + res;
+                        iov->iov_len -= res;
+                }
+        }
+        tcp->niov = 0;
+        tcp->txlen = 0;
+        return 0;
+}
+
+static int
+tcp_vqueue(struct reflash_tcp_t *tcp, const char *fmt, va_list ap)
+{
+        size_t avail;
+        va_list aq;
+        int res;
+
+        if (tcp->niov == TCP_IOV_MAX && tcp_flush_(tcp, 1) < 0)
+                return -1;
+        for (;;) {
+                /* The '\r' goes where vsnprintf puts its nul */
+                avail = sizeof(tcp->tx) - tcp->txlen;
+                va_copy(aq, ap);
+                res = vsnprintf(&tcp->tx[tcp->txlen], avail, fmt, aq);
+                va_end(aq);
+                if (res < 0)
+                        return res;
+                if ((size_t)res < avail)
+                        break;
+                if (tcp->txlen == 0) {
+                        errno = EMSGSIZE;
+                        return -1;
+                }
+                if (tcp_flush_(tcp, 1) < 0)
+                        return -1;
+        }
+        tcp->tx[tcp->txlen + res] = '\r';
+        tcp->iov[tcp->niov].iov_base = &tcp->tx[tcp->txlen];
+        tcp->iov[tcp->niov].iov_len = res + 1;
+        tcp->niov++;
+        tcp->txlen += res + 1;
         return 0;
 }
 
+/**
+ * tcp_open_timeout - Connect to a device
+ * @node:    Host name or address
+ * @timeout: Seconds to let connecting take, now and when reconnecting
+ * @st:      Where to record timings and byte counts, or NULL.  It must
+ *           outlive the connection.
+ *
+ * Return: Connection, or NULL with errno set
+ */
 struct reflash_tcp_t *
-tcp_open(const char *node)
+tcp_open_timeout(const char *node, double timeout, struct reflash_stats_t *st)
 {
         struct reflash_tcp_t *tcp = malloc(sizeof(*tcp));
-        int fd, fdin;
+        int one = 1;
+
         if (!tcp)
-                goto e_tcp;
+                return NULL;
         memset(tcp, 0, sizeof(*tcp));
-        fd = open_remote_socket(node, SOCK_STREAM);
-        if (fd < 0)
-                goto e_fd;
-        tcp->fp = fdopen(fd, "w");
-        if (!tcp->fp)
-                goto e_fp;
-        /*
-         * ``dup" so we can call fclose on fp and fpin independently
-         * when tcp_close() is called.
-         */
-        fdin = dup(fd);
-        if (fdin < 0)
-                goto e_dup;
-        tcp->fpin = fdopen(fdin, "r");
-        if (!tcp->fpin)
-                goto e_fpin;
-
+        tcp->stats = st;
+        tcp->timeout = timeout;
+        snprintf(tcp->node, sizeof(tcp->node), "%s", node);
+        tcp->fd = open_remote_socket(tcp, st);
+        if (tcp->fd < 0) {
+                int err = errno;
+                connect_forget(&tcp->cache);
+                free(tcp);
+                errno = err;
+                return NULL;
+        }
+        setsockopt(tcp->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
         return tcp;
+}
 
-e_fpin:
-        if (fdin >= 0)
-                close(fdin);
-e_dup:
-        fclose(tcp->fp);
-e_fp:
-        if (fd >= 0)
-                close(fd);
-        fd = -1;
-e_fd:
-        free(tcp);
-e_tcp:
-        return NULL;
+struct reflash_tcp_t *
+tcp_open(const char *node)
+{
+        return tcp_open_timeout(node, REFLASH_CONNECT_TIMEOUT, NULL);
+}
+
+/**
+ * tcp_stats - Statistics given to tcp_open_timeout(), or NULL
+ */
+struct reflash_stats_t *
+tcp_stats(struct reflash_tcp_t *tcp)
+{
+        return tcp->stats;
+}
+
+/**
+ * tcp_set_capture - Record what goes over the wire in @cap from now on,
+ *                   or stop recording if it is NULL
+ *
+ * @cap must outlive the connection, or be replaced first.
+ */
+void
+tcp_set_capture(struct reflash_tcp_t *tcp, struct reflash_capture_t *cap)
+{
+        tcp->cap = cap;
+        capture_add(cap, CAPTURE_CONNECT, tcp->node, strlen(tcp->node));
+}
+
+/**
+ * tcp_capture - Transcript given to tcp_set_capture(), or NULL
+ */
+struct reflash_capture_t *
+tcp_capture(struct reflash_tcp_t *tcp)
+{
+        return tcp->cap;
+}
+
+/**
+ * tcp_node - Host name the connection was opened with
+ */
+const char *
+tcp_node(struct reflash_tcp_t *tcp)
+{
+        return tcp->node;
+}
+
+/**
+ * tcp_deadline - Bound every wait from now on
+ * @tcp:  Connection
+ * @when: stats_now() time after which sends and receives fail with
+ *        ETIMEDOUT, or 0 to wait for ever
+ */
+void
+tcp_deadline(struct reflash_tcp_t *tcp, double when)
+{
+        tcp->deadline = when;
+}
+
+/**
+ * tcp_reconnect - Replace a broken connection with a new one
+ *
+ * Anything queued or received but not yet read is dropped.
+ *
+ * Return: 0, or -1 if the device could not be reached.  @tcp is still
+ * valid either way, and may be tried again.
+ */
+int
+tcp_reconnect(struct reflash_tcp_t *tcp)
+{
+        int one = 1;
+
+        if (tcp->fd >= 0)
+                close(tcp->fd);
+        tcp->rxhead = tcp->rxtail = 0;
+        tcp->txlen = 0;
+        tcp->niov = 0;
+        tcp->deadline = 0.0;
+        tcp->fd = open_remote_socket(tcp, NULL);
+        if (tcp->fd < 0)
+                return -1;
+        setsockopt(tcp->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        capture_add(tcp->cap, CAPTURE_CONNECT, tcp->node, strlen(tcp->node));
+        if (tcp->stats != NULL)
+                tcp->stats->reconnects++;
+        return 0;
+}
+
+/**
+ * tcp_queue_buf - Add a command, line ending and all, to the next batch
+ * @tcp: Connection
+ * @buf: The command, which must stay put until tcp_flush()
+ * @len: Its length
+ *
+ * @buf is sent from where it is, not copied into @tcp.
+ *
+ * Return: 0, or -1 if the batch had to be sent early and that failed
+ */
+int
+tcp_queue_buf(struct reflash_tcp_t *tcp, const char *buf, size_t len)
+{
+        if (tcp->niov == TCP_IOV_MAX && tcp_flush_(tcp, 1) < 0)
+                return -1;
+        tcp->iov[tcp->niov].iov_base = (char *)buf;
+        tcp->iov[tcp->niov].iov_len = len;
+        tcp->niov++;
+        return 0;
+}
+
+/**
+ * tcp_queue - Add a command to the next batch without sending it
+ * @tcp: Connection
+ * @fmt: printf format of the command, without the line ending
+ *
+ * Return: 0, or -1 if the batch had to be sent early and that failed
+ */
+int
+tcp_queue(struct reflash_tcp_t *tcp, const char *fmt, ...)
+{
+        va_list ap;
+        int res;
+
+        va_start(ap, fmt);
+        res = tcp_vqueue(tcp, fmt, ap);
+        va_end(ap);
+        return res;
+}
+
+/**
+ * tcp_flush - Send every command queued so far in one system call
+ */
+int
+tcp_flush(struct reflash_tcp_t *tcp)
+{
+        return tcp_flush_(tcp, 0);
 }
 
 const char *
 tcp_io(struct reflash_tcp_t *tcp, const char *fmt, ...)
 {
         va_list ap;
+        const char *line;
+        double t0;
         int res;
 
         va_start(ap, fmt);
-        res = tcp_vfprintf(tcp, fmt, ap);
+        res = tcp_vqueue(tcp, fmt, ap);
         va_end(ap);
-        if (res < 0)
+        t0 = tcp->stats != NULL ? stats_now() : 0.0;
+        if (res < 0 || tcp_flush(tcp) < 0)
                 return NULL;
-        return tcp_getline(tcp);
+        line = tcp_getline(tcp);
+        if (line != NULL)
+                stats_rtt(tcp->stats, stats_now() - t0);
+        return line;
 }
 
 int
@@ -191,27 +468,82 @@ tcp_io_sendonly(struct reflash_tcp_t *tcp, const char *fmt, ...)
         int res;
 
         va_start(ap, fmt);
-        res = tcp_vfprintf(tcp, fmt, ap);
+        res = tcp_vqueue(tcp, fmt, ap);
         va_end(ap);
-        return res;
+        if (res < 0)
+                return res;
+        return tcp_flush(tcp);
 }
 
+/**
+ * tcp_getline - Read one line from the device
+ *
+ * Return: The line without its line ending, or NULL with errno set,
+ * ETIMEDOUT if the tcp_deadline() passed first.  The line lives in
+ * @tcp's receive buffer and is good until the next call that reads from
+ * @tcp.
+ */
 const char *
 tcp_getline(struct reflash_tcp_t *tcp)
 {
-        if (getline(&tcp->lineptr, &tcp->n, tcp->fpin) < 0)
-                return NULL;
-        return tcp->lineptr;
+        for (;;) {
+                char *line = &tcp->rx[tcp->rxhead];
+                char *nl = memchr(line, '\n', tcp->rxtail - tcp->rxhead);
+                ssize_t res;
+
+                if (nl != NULL) {
+                        tcp->rxhead = nl + 1 - tcp->rx;
+                        while (nl > line && nl[-1] == '\r')
+                                --nl;
+                        *nl = '\0';
+                        capture_add(tcp->cap, CAPTURE_RECEIVED, line,
+                                    nl - line);
+                        return line;
+                }
+
+                if (tcp->rxhead == tcp->rxtail) {
+                        tcp->rxhead = tcp->rxtail = 0;
+                } else if (tcp->rxtail == sizeof(tcp->rx)) {
+                        if (tcp->rxhead == 0) {
+                                errno = EMSGSIZE;
+                                return NULL;
+                        }
+                        memmove(tcp->rx, line, tcp->rxtail - tcp->rxhead);
+                        tcp->rxtail -= tcp->rxhead;
+                        tcp->rxhead = 0;
+                }
+
+                res = recv(tcp->fd, &tcp->rx[tcp->rxtail],
+                           sizeof(tcp->rx) - tcp->rxtail, 0);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                if (tcp_wait(tcp, POLLIN) < 0)
+                                        return NULL;
+                                continue;
+                        }
+                        capture_note(tcp->cap, CAPTURE_LOST, "recv: %s",
+                                     strerror(errno));
+                        return NULL;
+                }
+                if (res == 0) {
+                        capture_note(tcp->cap, CAPTURE_LOST,
+                                     "Connection closed by device");
+                        errno = ECONNRESET;
+                        return NULL;
+                }
+                if (tcp->stats != NULL)
+                        tcp->stats->bytes_rx += res;
+                tcp->rxtail += res;
+        }
 }
 
 void
 tcp_close(struct reflash_tcp_t *tcp)
 {
-        if (tcp->lineptr != NULL)
-                free(tcp->lineptr);
-        if (tcp->fp != NULL)
-                fclose(tcp->fp);
-        if (tcp->fpin != NULL)
-                fclose(tcp->fpin);
+        if (tcp->fd >= 0)
+                close(tcp->fd);
+        connect_forget(&tcp->cache);
+        free(tcp);
 }
-
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Progress journal, so an interrupted reflash can carry on from the
+ * last acknowledged record instead of erasing and starting over.
+ *
+ * One small text file per device and image, named
+ * <device>-<image hash>.jnl.  It is created once the erase has
+ * completed, so its mere existence says the flash was erased for this
+ * image, and its "acked" line counts the records, in file order, that
+ * the device has acknowledged since.  Replies arrive in order, so that
+ * count is always a prefix of the file.  It is rewritten in place with
+ * one pwrite() per record; surviving a crash of the process only needs
+ * the page cache, not fsync().
+ *
+ * Erasing a device removes every other journal for it, since none of
+ * them describe its flash any more.  The journal is removed when the
+ * reflash completes.
+ *
+ * A journal only says which host name was erased, not that the unit
+ * answering to it now is the same one, or that nothing has written to
+ * it since.  So one from an earlier run is only carried on from when
+ * the reflash is verified by checksum at the end; otherwise the device
+ * is erased again, and the journal started over.
+ *
+ * Trouble with the journal itself is reported once and then ignored:
+ * it must never be the reason a reflash fails.
+ */
+#include "reflash.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+        JOURNAL_NAME_MAX = 64,
+        /* "%010d" */
+        JOURNAL_ACKED_LEN = 10,
+};
+
+struct reflash_journal_t {
+        int fd;
+        int nrec;
+        int resume;
+        off_t acked_off;
+        uint64_t hash;
+        char device[JOURNAL_NAME_MAX];
+        char dir[PATH_MAX];
+        char path[PATH_MAX];
+};
+
+static const char journal_magic[] = "hti-tcp-reflash journal 1";
+
+static void
+journal_warn(struct reflash_journal_t *j, const char *what)
+{
+        fprintf(stderr, "%s: %s: %s; continuing without a journal\n",
+                j->path, what, strerror(errno));
+        if (j->fd >= 0)
+                close(j->fd);
+        j->fd = -1;
+}
+
+/* Create @dir and any missing parents */
+int
+mkdir_p(const char *dir)
+{
+        char buf[PATH_MAX];
+        char *p;
+
+        if (snprintf(buf, sizeof(buf), "%s", dir) >= (int)sizeof(buf)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        for (p = buf + 1; *p != '\0'; ++p) {
+                if (*p != '/')
+                        continue;
+                *p = '\0';
+                if (mkdir(buf, 0777) < 0 && errno != EEXIST)
+                        return -1;
+                *p = '/';
+        }
+        if (mkdir(buf, 0777) < 0 && errno != EEXIST)
+                return -1;
+        return 0;
+}
+
+/* Read back an existing journal, return records acked or -1 */
+static int
+journal_read(struct reflash_journal_t *j)
+{
+        char magic[64], device[JOURNAL_NAME_MAX];
+        unsigned long long hash;
+        int nrec, acked;
+        FILE *fp;
+        int n;
+
+        if ((fp = fopen(j->path, "r")) == NULL)
+                return -1;
+        n = fscanf(fp, "%63[^\n]\ndevice %63s\nimage %llx %d\nacked %d",
+                   magic, device, &hash, &nrec, &acked);
+        fclose(fp);
+        if (n != 5 || strcmp(magic, journal_magic) != 0
+            || strcmp(device, j->device) != 0 || hash != j->hash
+            || nrec != j->nrec || acked < 0 || acked > nrec) {
+                fprintf(stderr, "%s: not a journal for this device and "
+                        "image, ignoring it\n", j->path);
+                return -1;
+        }
+        return acked;
+}
+
+/**
+ * journal_open - Look up the journal of one device and image
+ * @dir:    Directory journals live in, or NULL to keep no journal
+ * @device: Host name of the device
+ * @hash:   srec_hash() of the image
+ * @nrec:   Number of records in the image
+ * @verify: Nonzero if the result is checked against the image's
+ *          checksum; an existing journal is ignored otherwise
+ *
+ * Nothing is written until journal_erased().
+ *
+ * Return: Journal, or NULL if @dir is NULL or memory ran out.  Every
+ * journal_xxx() call accepts NULL and does nothing.
+ */
+struct reflash_journal_t *
+journal_open(const char *dir, const char *device, uint64_t hash, int nrec,
+             int verify)
+{
+        struct reflash_journal_t *j;
+        char *p;
+
+        if (dir == NULL)
+                return NULL;
+        if ((j = calloc(1, sizeof(*j))) == NULL)
+                return NULL;
+        j->fd = -1;
+        j->nrec = nrec;
+        j->hash = hash;
+        /* Keep the host name usable both as a file name and a glob */
+        snprintf(j->device, sizeof(j->device), "%s", device);
+        for (p = j->device; *p != '\0'; ++p) {
+                if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-')
+                        *p = '_';
+        }
+        snprintf(j->dir, sizeof(j->dir), "%s", dir);
+        snprintf(j->path, sizeof(j->path), "%s/%s-%016llx.jnl",
+                 dir, j->device, (unsigned long long)hash);
+        if (!verify) {
+                if (access(j->path, F_OK) == 0) {
+                        fprintf(stderr, "%s: an unverified reflash is not "
+                                "resumed, erasing again\n", j->path);
+                }
+                j->resume = -1;
+        } else {
+                j->resume = journal_read(j);
+        }
+        if (j->resume >= 0) {
+                /* The count is the last line */
+                j->fd = open(j->path, O_WRONLY | O_CLOEXEC);
+                if (j->fd < 0) {
+                        journal_warn(j, "open");
+                        j->resume = -1;
+                } else {
+                        j->acked_off = lseek(j->fd, 0, SEEK_END)
+                                       - 1 - JOURNAL_ACKED_LEN;
+                }
+        }
+        return j;
+}
+
+/**
+ * journal_resume - Where an earlier, interrupted run left off
+ *
+ * Return: Number of records already written since the flash was erased
+ * for this image, or -1 if the device has to be erased and written from
+ * the start
+ */
+int
+journal_resume(const struct reflash_journal_t *j)
+{
+        return j != NULL ? j->resume : -1;
+}
+
+/* Remove journals for other images of the same device */
+static void
+journal_purge(struct reflash_journal_t *j)
+{
+        char pattern[PATH_MAX];
+        glob_t g;
+        size_t i;
+
+        if (snprintf(pattern, sizeof(pattern), "%s/%s-*.jnl",
+                     j->dir, j->device) >= (int)sizeof(pattern)
+            || glob(pattern, 0, NULL, &g) != 0) {
+                return;
+        }
+        for (i = 0; i < g.gl_pathc; ++i) {
+                /* Only <device>-<16 hex digits>.jnl, nothing longer */
+                const char *tail = g.gl_pathv[i] + strlen(pattern) - 5;
+                if (strlen(tail) == 20 && strspn(tail, "0123456789abcdef")
+                    == 16)
+                        unlink(g.gl_pathv[i]);
+        }
+        globfree(&g);
+}
+
+/**
+ * journal_erased - Note that the flash was just erased for this image
+ */
+void
+journal_erased(struct reflash_journal_t *j)
+{
+        char buf[256];
+        int len;
+
+        if (j == NULL)
+                return;
+        if (j->fd >= 0)
+                close(j->fd);
+        j->fd = -1;
+        if (mkdir_p(j->dir) < 0) {
+                journal_warn(j, "mkdir");
+                return;
+        }
+        journal_purge(j);
+        len = snprintf(buf, sizeof(buf),
+                       "%s\ndevice %s\nimage %016llx %d\nacked %0*d\n",
+                       journal_magic, j->device, (unsigned long long)j->hash,
+                       j->nrec, JOURNAL_ACKED_LEN, 0);
+        j->acked_off = len - 1 - JOURNAL_ACKED_LEN;
+        j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (j->fd < 0) {
+                journal_warn(j, "open");
+                return;
+        }
+        if (write(j->fd, buf, len) != len)
+                journal_warn(j, "write");
+}
+
+/**
+ * journal_ack - Record that the first @nacked records are written
+ */
+void
+journal_ack(struct reflash_journal_t *j, int nacked)
+{
+        char buf[JOURNAL_ACKED_LEN + 1];
+
+        if (j == NULL || j->fd < 0)
+                return;
+        snprintf(buf, sizeof(buf), "%0*d", JOURNAL_ACKED_LEN, nacked);
+        if (pwrite(j->fd, buf, JOURNAL_ACKED_LEN, j->acked_off)
+            != JOURNAL_ACKED_LEN) {
+                journal_warn(j, "write");
+        }
+}
+
+/**
+ * journal_close - Forget a journal
+ * @j:    Journal
+ * @done: Nonzero if the reflash completed, which removes the file
+ */
+void
+journal_close(struct reflash_journal_t *j, int done)
+{
+        if (j == NULL)
+                return;
+        if (j->fd >= 0)
+                close(j->fd);
+        if (done)
+                unlink(j->path);
+        free(j);
+}
+
+/**
+ * journal_default_dir - Where journals go unless told otherwise
+ * @buf:  Where the directory's name goes
+ * @size: Size of @buf
+ *
+ * Return: @buf, holding $XDG_STATE_HOME/hti-tcp-reflash, or
+ * $HOME/.local/state/hti-tcp-reflash, or NULL if neither variable is set or the
+ * name does not fit
+ */
+const char *
+journal_default_dir(char *buf, size_t size)
+{
+        const char *base;
+        int len;
+
+        if ((base = getenv("XDG_STATE_HOME")) != NULL && base[0] == '/')
+                len = snprintf(buf, size, "%s/hti-tcp-reflash", base);
+        else if ((base = getenv("HOME")) != NULL && base[0] != '\0')
+                len = snprintf(buf, size, "%s/.local/state/hti-tcp-reflash",
+                               base);
+        else
+                return NULL;
+        return len >= 0 && (size_t)len < size ? buf : NULL;
+}
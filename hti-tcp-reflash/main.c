@@ -33,70 +33,750 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include "reflash.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static const struct target_lut_t {
+enum {
+        HOSTNAME_MAX = 64,
+};
+
+static const struct cksum_lut_t {
         const char *name;
-        int (*reflash)(struct reflash_tcp_t *tcp, FILE *fp);
-} target_lut[] = {
-        { "p620", generic_reflash },
-        { "p545", generic_reflash },
-        { "p470", generic_reflash },
-        { "p330", generic_reflash },
-        { "t680", t680_reflash },
-        { "v120", t680_reflash },
-        { "v124", t680_reflash },
-        { "p900", p900_reflash },
-        { "t500", t500_reflash },
-        { NULL, NULL },
+        int algo;
+} cksum_lut[] = {
+        { "sum16", REFLASH_CKSUM_SUM16 },
+        { "sum32", REFLASH_CKSUM_SUM32 },
+        { "crc32", REFLASH_CKSUM_CRC32 },
+        { NULL, REFLASH_CKSUM_NONE },
 };
 
-static const struct target_lut_t *
-target_lookup(const char *target)
+static const struct stats_lut_t {
+        const char *name;
+        int format;
+} stats_lut[] = {
+        { "text", REFLASH_STATS_TEXT },
+        { "json", REFLASH_STATS_JSON },
+        { NULL, 0 },
+};
+
+static const struct format_lut_t {
+        const char *name;
+        int format;
+} format_lut[] = {
+        { "srec", REFLASH_IMAGE_SREC },
+        { "ihex", REFLASH_IMAGE_IHEX },
+        { "elf", REFLASH_IMAGE_ELF },
+        { "bin", REFLASH_IMAGE_BIN },
+        { NULL, 0 },
+};
+
+/* Long options without a short equivalent */
+enum {
+        OPT_STATS = 256,
+        OPT_BATCH,
+        OPT_STATS_FILE,
+        OPT_JOURNAL,
+        OPT_NO_JOURNAL,
+        OPT_PROFILES,
+        OPT_NO_PROFILES,
+        OPT_PROBE,
+        OPT_CAPTURE,
+        OPT_DISCOVER,
+        OPT_NUMERIC,
+        OPT_HOSTS,
+        OPT_RETRIES,
+        OPT_REBLOCK,
+        OPT_SKIP_ERASED,
+        OPT_FORMAT,
+        OPT_BASE,
+        OPT_CONNECT_TIMEOUT,
+        OPT_CMD_TIMEOUT,
+        OPT_ERASE_TIMEOUT,
+        OPT_WRITE_TIMEOUT,
+        OPT_DAEMON,
+        OPT_SUBMIT,
+        OPT_QUALIFY,
+        OPT_MAX_TIME,
+};
+
+static const struct option long_opts[] = {
+        { "stats", required_argument, NULL, OPT_STATS },
+        { "batch", optional_argument, NULL, OPT_BATCH },
+        { "stats-file", required_argument, NULL, OPT_STATS_FILE },
+        { "journal", required_argument, NULL, OPT_JOURNAL },
+        { "no-journal", no_argument, NULL, OPT_NO_JOURNAL },
+        { "profiles", required_argument, NULL, OPT_PROFILES },
+        { "no-profiles", no_argument, NULL, OPT_NO_PROFILES },
+        { "probe", no_argument, NULL, OPT_PROBE },
+        { "capture", required_argument, NULL, OPT_CAPTURE },
+        { "discover", required_argument, NULL, OPT_DISCOVER },
+        { "numeric", no_argument, NULL, OPT_NUMERIC },
+        { "hosts", required_argument, NULL, OPT_HOSTS },
+        { "retries", required_argument, NULL, OPT_RETRIES },
+        { "reblock", optional_argument, NULL, OPT_REBLOCK },
+        { "skip-erased", no_argument, NULL, OPT_SKIP_ERASED },
+        { "format", required_argument, NULL, OPT_FORMAT },
+        { "base", required_argument, NULL, OPT_BASE },
+        { "connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT },
+        { "cmd-timeout", required_argument, NULL, OPT_CMD_TIMEOUT },
+        { "erase-timeout", required_argument, NULL, OPT_ERASE_TIMEOUT },
+        { "write-timeout", required_argument, NULL, OPT_WRITE_TIMEOUT },
+        { "daemon", required_argument, NULL, OPT_DAEMON },
+        { "submit", required_argument, NULL, OPT_SUBMIT },
+        { "qualify", optional_argument, NULL, OPT_QUALIFY },
+        { "max-time", required_argument, NULL, OPT_MAX_TIME },
+        { NULL, 0, NULL, 0 },
+};
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr, "Usage: %s [-s serial | -i ip | --hosts=file]... "
+                "[-w window] [--batch[=records]] "
+                "[-j jobs] [-c sum16|sum32|crc32] [--stats=text|json] "
+                "[--stats-file=path] [--journal=dir | --no-journal] "
+                "[--profiles=dir | --no-profiles] [--probe] "
+                "[--capture=dir] "
+                "[--retries=n] [--reblock[=bytes]] [--skip-erased] "
+                "[--format=srec|ihex|elf|bin] [--base=address] "
+                "[--connect-timeout=seconds] [--cmd-timeout=seconds] "
+                "[--erase-timeout=seconds] [--write-timeout=seconds] "
+                "[--qualify[=queries]] [--max-time=seconds] "
+                "target filename\n"
+                "       %s --submit=socket [-s serial | -i ip | "
+                "--hosts=file]... target filename\n"
+                "       %s --daemon=socket [options]\n"
+                "       %s --discover=cidr... [--numeric] "
+                "[--connect-timeout=seconds]\n",
+                argv0, argv0, argv0, argv0);
+        exit(1);
+}
+
+static int
+get_stats(const char *arg)
+{
+        int i;
+        for (i = 0; stats_lut[i].name != NULL; ++i) {
+                if (!strcmp(arg, stats_lut[i].name))
+                        return stats_lut[i].format;
+        }
+        fprintf(stderr, "Invalid stats format '%s'\n", arg);
+        exit(1);
+}
+
+static int
+get_format(const char *arg)
+{
+        int i;
+        for (i = 0; format_lut[i].name != NULL; ++i) {
+                if (!strcmp(arg, format_lut[i].name))
+                        return format_lut[i].format;
+        }
+        fprintf(stderr, "Invalid file format '%s'\n", arg);
+        exit(1);
+}
+
+static uint32_t
+get_addr(const char *arg, const char *what)
 {
+        char *end;
+        unsigned long long v = strtoull(arg, &end, 0);
+        if (end == arg || *end != '\0' || v > 0xffffffffull) {
+                fprintf(stderr, "%s must be a 32-bit address\n", what);
+                exit(1);
+        }
+        return v;
+}
+
+static void
+print_stats(const char *path, const struct reflash_stats_t *stats, int n,
+            int format)
+{
+        FILE *fp = stdout;
         int i;
-        for (i = 0; target_lut[i].name != NULL; ++i) {
-                if (!strcmp(target, target_lut[i].name))
-                        return &target_lut[i];
+
+        if (path != NULL && (fp = fopen(path, "w")) == NULL) {
+                perror(path);
+                return;
+        }
+        if (fp == stdout && format == REFLASH_STATS_TEXT)
+                putchar('\n');
+        for (i = 0; i < n; ++i)
+                stats_print(fp, &stats[i], format);
+        if (fp != stdout)
+                fclose(fp);
+}
+
+static int
+get_cksum(const char *arg)
+{
+        int i;
+        for (i = 0; cksum_lut[i].name != NULL; ++i) {
+                if (!strcmp(arg, cksum_lut[i].name))
+                        return cksum_lut[i].algo;
+        }
+        fprintf(stderr, "Invalid checksum '%s'\n", arg);
+        exit(1);
+}
+
+static int
+get_posint(const char *arg, int max, const char *what)
+{
+        int v = atoi(arg);
+        if (v < 1 || v > max) {
+                fprintf(stderr, "%s must be from 1 to %d\n", what, max);
+                exit(1);
+        }
+        return v;
+}
+
+static double
+get_secs(const char *arg, const char *what)
+{
+        char *end;
+        double v = strtod(arg, &end);
+        if (end == arg || *end != '\0' || !(v > 0.0) || v > 3600.0) {
+                fprintf(stderr, "%s must be more than 0 and at most 3600 "
+                        "seconds\n", what);
+                exit(1);
+        }
+        return v;
+}
+
+/*
+ * Sweep the ranges and print what answered as an inventory that --hosts
+ * reads back: address, model, firmware and host name, one device per
+ * line, with a '#' header.
+ */
+static int
+discover(const struct discover_range_t *r, int nr, double timeout,
+         int numeric)
+{
+        struct discover_dev_t *devs;
+        double t0 = stats_now();
+        uint64_t total = 0;
+        int i, n;
+
+        for (i = 0; i < nr; ++i)
+                total += r[i].count;
+        fprintf(stderr, "Sweeping %llu addresses...\n",
+                (unsigned long long)total);
+        if ((n = discover_sweep(r, nr, DISCOVER_JOBS, timeout, numeric,
+                                &devs)) < 0) {
+                perror("discover_sweep");
+                return -1;
+        }
+        printf("# %-15s %-8s %-12s %s\n",
+               "ADDRESS", "MODEL", "FIRMWARE", "NAME");
+        for (i = 0; i < n; ++i) {
+                char addr[INET_ADDRSTRLEN];
+                struct in_addr in;
+
+                in.s_addr = htonl(devs[i].addr);
+                inet_ntop(AF_INET, &in, addr, sizeof(addr));
+                printf("%-17s %-8s %-12s %s\n", addr, devs[i].model,
+                       devs[i].firmware, devs[i].name);
+        }
+        fprintf(stderr, "%d devices found in %.1f s\n", n,
+                stats_now() - t0);
+        free(devs);
+        return 0;
+}
+
+/*
+ * Append the hosts listed in @path, "-" for stdin, to @hosts.  The first
+ * word of each line is the host; a second one, if any, is its model,
+ * and hosts of any other model than @target's, "unknown" included, are
+ * left out: the wrong upgrade file can ruin a device.  Blank lines and
+ * '#' comments are ignored.
+ */
+static char **
+read_hosts(const char *path, const struct reflash_target_t *target,
+           char **hosts, int *nhosts)
+{
+        FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+        char line[512], host[HOSTNAME_MAX], model[PROFILE_NAME_MAX];
+        int skipped = 0;
+
+        if (fp == NULL) {
+                perror(path);
+                exit(1);
+        }
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                int n = sscanf(line, "%63s %63s", host, model);
+
+                if (n < 1 || host[0] == '#')
+                        continue;
+                if (n == 2 && strcmp(model, target->name) != 0) {
+                        ++skipped;
+                        continue;
+                }
+                hosts = realloc(hosts, (*nhosts + 1) * sizeof(*hosts));
+                if (hosts == NULL || (hosts[*nhosts] = strdup(host)) == NULL) {
+                        perror("malloc");
+                        exit(1);
+                }
+                ++*nhosts;
+        }
+        if (fp != stdin)
+                fclose(fp);
+        if (skipped > 0) {
+                printf("%s: left out %d devices that are not %s\n", path,
+                       skipped, target->name);
+        }
+        return hosts;
+}
+
+/*
+ * Several devices at once: a struct reflash_session_t, with its news
+ * printed as it comes, the records of all of them shown as one progress
+ * count, and a table of how each one went at the end.
+ */
+struct many_t {
+        char *const *hosts;
+        const struct srec_image_t *img;
+        struct reflash_progress_t progress;
+        struct reflash_result_t *res;
+};
+
+static void
+many_log(void *arg, int dev, const char *msg)
+{
+        struct many_t *m = arg;
+
+        progress_hide(&m->progress);
+        printf("%s: %s\n", m->hosts[dev], msg);
+}
+
+static void
+many_progress(void *arg, int dev, int from, int to, int written)
+{
+        struct many_t *m = arg;
+
+        (void)dev;
+        if (!written) {
+                progress_skip(&m->progress, m->img, from, to);
+                return;
+        }
+        for (; from < to; ++from)
+                progress_ack(&m->progress, m->img->rec[from].len);
+}
+
+static void
+many_done(void *arg, int dev, const struct reflash_result_t *res)
+{
+        struct many_t *m = arg;
+
+        m->res[dev] = *res;
+        if (res->error != NULL) {
+                /* Outlives the session */
+                m->res[dev].error = strdup(res->error);
+        }
+}
+
+static int
+reflash_many(char *const *hosts, int nhosts, const struct srec_image_t *img,
+             const struct reflash_target_t *t,
+             const struct reflash_opts_t *opts,
+             struct reflash_stats_t *stats)
+{
+        struct reflash_callbacks_t cb = {
+                .log = many_log,
+                .progress = many_progress,
+                .done = many_done,
+        };
+        struct reflash_session_t *s;
+        struct many_t m;
+        int i, nfail = 0;
+
+        memset(&m, 0, sizeof(m));
+        m.hosts = hosts;
+        m.img = img;
+        m.res = calloc(nhosts, sizeof(*m.res));
+        cb.arg = &m;
+        if (m.res == NULL || (s = reflash_session_new(img, t, opts,
+                                                      &cb)) == NULL) {
+                perror("reflash_session_new");
+                free(m.res);
+                return -1;
+        }
+        for (i = 0; i < nhosts; ++i) {
+                m.res[i].result = REFLASH_FAILED;
+                if (reflash_session_add(s, hosts[i],
+                                        stats ? &stats[i] : NULL) < 0) {
+                        perror("reflash_session_add");
+                        reflash_session_free(s);
+                        free(m.res);
+                        return -1;
+                }
+        }
+
+        progress_init(&m.progress, NULL, img, nhosts);
+        while (reflash_session_step(s) > 0) {
+                struct pollfd pfd;
+                int ms = reflash_session_timeout(s);
+
+                if (ms < 0 || progress_timeout(&m.progress) < ms)
+                        ms = progress_timeout(&m.progress);
+                pfd.fd = reflash_session_fd(s);
+                pfd.events = POLLIN;
+                if (poll(&pfd, 1, ms) < 0 && errno != EINTR) {
+                        perror("poll");
+                        break;
+                }
+                progress_poll(&m.progress);
+        }
+        progress_end(&m.progress);
+        reflash_session_free(s);
+
+        printf("\n%-24s %-7s %9s %9s  %s\n",
+               "DEVICE", "RESULT", "RECORDS", "SECONDS", "ERROR");
+        for (i = 0; i < nhosts; ++i) {
+                const struct reflash_result_t *res = &m.res[i];
+
+                if (res->result == REFLASH_FAILED)
+                        ++nfail;
+                printf("%-24s %-7s %4d/%-4d %9.2f  %s\n", hosts[i],
+                       res->result == REFLASH_FAILED ? "FAILED"
+                       : res->result == REFLASH_CURRENT ? "CURRENT" : "OK",
+                       res->records, img->nrec, res->secs,
+                       res->error != NULL ? res->error : "");
+                free((char *)res->error);
+        }
+        printf("%d of %d devices reflashed\n", nhosts - nfail, nhosts);
+        free(m.res);
+        return nfail == 0 ? 0 : -1;
+}
+
+/*
+ * Qualify the link to each of @hosts and print how it measured up.
+ * Those that did not answer, or are projected to take longer than
+ * @max_time seconds if that is not 0, are left out of @hosts, and the
+ * number left out returned.
+ */
+static int
+qualify_hosts(char **hosts, int *nhosts, const struct srec_image_t *img,
+              const struct reflash_target_t *t,
+              const struct reflash_opts_t *opts, int count, double max_time,
+              int format)
+{
+        struct reflash_qual_t q;
+        int i, n = 0;
+
+        for (i = 0; i < *nhosts; ++i) {
+                if (reflash_qualify(hosts[i], img, t, opts, count, &q,
+                                    NULL) < 0) {
+                        fprintf(stderr, "%s: left out: %s\n", hosts[i],
+                                errno == EOPNOTSUPP
+                                ? "query not supported by this target"
+                                : strerror(errno));
+                        free(hosts[i]);
+                        continue;
+                }
+                qualify_print(stdout, &q,
+                              format == REFLASH_STATS_JSON
+                              ? REFLASH_STATS_JSON : REFLASH_STATS_TEXT);
+                if (max_time > 0.0 && q.project > max_time) {
+                        fprintf(stderr, "%s: left out: projected %.1f s, "
+                                "over %.1f s\n", hosts[i], q.project,
+                                max_time);
+                        free(hosts[i]);
+                        continue;
+                }
+                hosts[n++] = hosts[i];
+        }
+        i = *nhosts - n;
+        *nhosts = n;
+        return i;
+}
+
+static volatile sig_atomic_t daemon_stop;
+
+static void
+daemon_signal(int sig)
+{
+        (void)sig;
+        daemon_stop = 1;
+}
+
+/*
+ * Run the reflash daemon on @path until SIGINT or SIGTERM, logging to
+ * stdout
+ */
+static int
+run_daemon(const char *path, const struct reflash_opts_t *opts,
+           const struct image_opts_t *io)
+{
+        struct sigaction sa;
+
+        /* No SA_RESTART: the daemon's wait for events returns to notice */
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = daemon_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        if (reflash_daemon(path, opts, io, &daemon_stop, stdout) < 0) {
+                fprintf(stderr, "%s: %s\n", path, errno == EADDRINUSE
+                        ? "a daemon is already listening" : strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Hand the devices to the reflash daemon listening on @sock, and print
+ * what it says about them until it has finished with every one.
+ */
+static int
+submit(const char *sock, char *const *hosts, int nhosts, const char *target,
+       const char *path)
+{
+        char file[PATH_MAX], line[4096];
+        struct sockaddr_un sun;
+        int fd, i, ndone = 0, nfail = 0;
+        FILE *fp;
+
+        if (realpath(path, file) == NULL) {
+                perror(path);
+                return -1;
         }
-        return NULL;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(sock) >= sizeof(sun.sun_path)) {
+                fprintf(stderr, "%s: socket path too long\n", sock);
+                return -1;
+        }
+        strcpy(sun.sun_path, sock);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+            || (fp = fdopen(fd, "r+")) == NULL) {
+                perror(sock);
+                if (fd >= 0)
+                        close(fd);
+                return -1;
+        }
+        for (i = 0; i < nhosts; ++i)
+                fprintf(fp, "%s %s %s\n", target, hosts[i], file);
+        fflush(fp);
+        while (ndone < nhosts && fgets(line, sizeof(line), fp) != NULL) {
+                char result[16];
+                unsigned long id;
+
+                fputs(line, stdout);
+                fflush(stdout);
+                if (sscanf(line, "%lu done %15s", &id, result) != 2)
+                        continue;
+                ++ndone;
+                if (strcmp(result, "ok") && strcmp(result, "current"))
+                        ++nfail;
+        }
+        fclose(fp);
+        if (ndone < nhosts) {
+                fprintf(stderr, "%s: daemon went away\n", sock);
+                return -1;
+        }
+        printf("%d of %d devices reflashed\n", nhosts - nfail, nhosts);
+        return nfail == 0 ? 0 : -1;
 }
 
 int
 main(int argc, char **argv)
 {
-        struct reflash_tcp_t *h;
         /* default caltable's serial number */
-        int serial = -1;
+        int *serials;
+        char **ips;
+        char **hosts;
+        const char **host_files;
+        struct discover_range_t *ranges;
+        int nserial = 0, nip = 0, nfiles = 0, nranges = 0, nhosts, i;
+        int numeric = 0;
+        double discover_timeout = DISCOVER_TIMEOUT;
         int opt;
         int ret;
-        FILE *fp;
-        char hostname[64];
-        char *ip = NULL;
-        const struct target_lut_t *lut;
+        struct srec_image_t *img;
+        const struct reflash_target_t *lut;
+        struct reflash_opts_t opts;
+        int no_journal = 0;
+        int no_profiles = 0;
+        char journal_dir[PATH_MAX], profile_dir[PATH_MAX];
+        /* -1: leave records as they are, 0: as long as the target takes */
+        struct image_opts_t io = { REFLASH_IMAGE_AUTO, 0, -1, 0 };
+        /* A raw binary has no address of its own */
+        int have_base = 0;
+        struct reflash_stats_t *stats = NULL;
+        int stats_format = 0;
+        const char *stats_file = NULL;
+        const char *daemon_path = NULL, *submit_path = NULL;
+        /* 0: reflash without qualifying the links first */
+        int qualify = 0;
+        double max_time = 0.0;
+        int qualified_out = 0;
 
-        /* TODO: Add '-i' for direct IP address */
-        while ((opt = getopt(argc, argv, "s:i:")) != -1) {
+        reflash_opts_init(&opts);
+
+        /* At most one host per argument */
+        serials = malloc(argc * sizeof(*serials));
+        ips = malloc(argc * sizeof(*ips));
+        hosts = malloc(argc * sizeof(*hosts));
+        host_files = malloc(argc * sizeof(*host_files));
+        ranges = malloc(argc * sizeof(*ranges));
+        if (!serials || !ips || !hosts || !host_files || !ranges) {
+                perror("malloc");
+                exit(1);
+        }
+
+        while ((opt = getopt_long(argc, argv, "s:i:w:j:c:",
+                                  long_opts, NULL)) != -1) {
                 switch (opt) {
                 case 's':
-                        serial = atoi(optarg);
+                        serials[nserial++] = atoi(optarg);
                         break;
                 case 'i':
-                        ip = optarg;
+                        ips[nip++] = optarg;
+                        break;
+                case 'w':
+                        opts.window = get_posint(optarg, REFLASH_WINDOW_MAX,
+                                                 "Window");
+                        break;
+                case OPT_BATCH:
+                        opts.batch = optarg == NULL ? 0
+                                     : get_posint(optarg, BATCH_LINE_MAX,
+                                                  "Batch");
+                        break;
+                case 'j':
+                        opts.jobs = get_posint(optarg, 1024, "Jobs");
+                        break;
+                case 'c':
+                        opts.cksum = get_cksum(optarg);
+                        break;
+                case OPT_STATS:
+                        stats_format = get_stats(optarg);
+                        break;
+                case OPT_STATS_FILE:
+                        stats_file = optarg;
+                        break;
+                case OPT_JOURNAL:
+                        opts.journal = optarg;
+                        break;
+                case OPT_NO_JOURNAL:
+                        no_journal = 1;
+                        break;
+                case OPT_PROFILES:
+                        opts.profiles = optarg;
+                        break;
+                case OPT_NO_PROFILES:
+                        no_profiles = 1;
+                        break;
+                case OPT_PROBE:
+                        opts.probe = 1;
+                        break;
+                case OPT_CAPTURE:
+                        opts.capture = optarg;
+                        break;
+                case OPT_DISCOVER:
+                        if (discover_range(optarg, &ranges[nranges++]) < 0) {
+                                fprintf(stderr, "Invalid address range "
+                                        "'%s'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case OPT_NUMERIC:
+                        numeric = 1;
+                        break;
+                case OPT_HOSTS:
+                        host_files[nfiles++] = optarg;
+                        break;
+                case OPT_REBLOCK:
+                        io.reblock = optarg == NULL ? 0
+                                     : get_posint(optarg, 255,
+                                                  "Reblock size");
+                        break;
+                case OPT_SKIP_ERASED:
+                        io.skip_erased = 1;
+                        break;
+                case OPT_FORMAT:
+                        io.format = get_format(optarg);
+                        break;
+                case OPT_BASE:
+                        io.base = get_addr(optarg, "Base");
+                        have_base = 1;
+                        break;
+                case OPT_CONNECT_TIMEOUT:
+                        opts.connect_timeout = get_secs(optarg,
+                                                        "Connect timeout");
+                        discover_timeout = opts.connect_timeout;
+                        break;
+                case OPT_CMD_TIMEOUT:
+                        opts.timeout_cmd = get_secs(optarg, "Command timeout");
+                        break;
+                case OPT_ERASE_TIMEOUT:
+                        opts.timeout_erase = get_secs(optarg, "Erase timeout");
+                        break;
+                case OPT_WRITE_TIMEOUT:
+                        opts.timeout_write = get_secs(optarg, "Write timeout");
+                        break;
+                case OPT_DAEMON:
+                        daemon_path = optarg;
+                        break;
+                case OPT_SUBMIT:
+                        submit_path = optarg;
+                        break;
+                case OPT_QUALIFY:
+                        qualify = optarg == NULL ? QUALIFY_COUNT
+                                  : get_posint(optarg, 100000, "Queries");
+                        break;
+                case OPT_MAX_TIME:
+                        max_time = get_secs(optarg, "Max time");
+                        break;
+                case OPT_RETRIES:
+                        /* 0 is fine: give up at the first lost connection */
+                        opts.retries = strcmp(optarg, "0") == 0
+                                       ? 0 : get_posint(optarg, 100,
+                                                        "Retries");
                         break;
                 default:
-                        fprintf(stderr, "Usage: %s [-s serial] target filename\n",
-                                argv[0]);
-                        exit(1);
+                        usage(argv[0]);
                         break;
                 }
         }
 
-        if (!((serial < 0) ^ (ip == NULL))) {
-                fprintf(stderr, "Expected: one of -s or -i\n");
+        if (no_journal)
+                opts.journal = NULL;
+        else if (opts.journal == NULL)
+                opts.journal = journal_default_dir(journal_dir,
+                                                   sizeof(journal_dir));
+        if (no_profiles)
+                opts.profiles = NULL;
+        else if (opts.profiles == NULL)
+                opts.profiles = profile_default_dir(profile_dir,
+                                                     sizeof(profile_dir));
+
+        if (nranges > 0)
+                exit(discover(ranges, nranges, discover_timeout, numeric) == 0
+                     ? EXIT_SUCCESS : EXIT_FAILURE);
+
+        if (daemon_path != NULL) {
+                if (io.format == REFLASH_IMAGE_BIN && !have_base) {
+                        fprintf(stderr, "A raw binary needs --base\n");
+                        exit(1);
+                }
+                exit(run_daemon(daemon_path, &opts, &io) == 0
+                     ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        if (nserial + nip + nfiles == 0) {
+                fprintf(stderr, "Expected: at least one -s, -i or --hosts\n");
                 exit(1);
         }
 
@@ -105,32 +785,103 @@ main(int argc, char **argv)
                 exit(1);
         }
 
-        if ((lut = target_lookup(argv[optind])) == NULL) {
+        if ((lut = reflash_target(argv[optind])) == NULL) {
                 fprintf(stderr, "Invalid target '%s'\n",
                         argv[optind]);
                 exit(1);
         }
 
-        fp = fopen(argv[optind + 1], "r");
-        if (fp == NULL) {
-                perror("Cannot open reflash file");
+        if (io.format == REFLASH_IMAGE_BIN && !have_base) {
+                fprintf(stderr, "A raw binary needs --base\n");
                 exit(1);
         }
 
-        if (ip != NULL)
-                strncpy(hostname, ip, sizeof(hostname));
-        else
-                snprintf(hostname, sizeof(hostname), "%s-%05u", lut->name, serial);
-        hostname[sizeof(hostname) - 1] = '\0';
-        h = tcp_open(hostname);
-        if (h == NULL) {
-                perror("TCP open failed");
+        nhosts = 0;
+        for (i = 0; i < nserial + nip; ++i) {
+                char *hostname = malloc(HOSTNAME_MAX);
+                if (hostname == NULL) {
+                        perror("malloc");
+                        exit(1);
+                }
+                if (i < nserial) {
+                        if (serials[i] < 0) {
+                                fprintf(stderr, "Invalid serial number\n");
+                                exit(1);
+                        }
+                        snprintf(hostname, HOSTNAME_MAX, "%s-%05u",
+                                 lut->name, serials[i]);
+                } else {
+                        strncpy(hostname, ips[i - nserial], HOSTNAME_MAX);
+                }
+                hostname[HOSTNAME_MAX - 1] = '\0';
+                hosts[nhosts++] = hostname;
+        }
+        for (i = 0; i < nfiles; ++i)
+                hosts = read_hosts(host_files[i], lut, hosts, &nhosts);
+        if (nhosts == 0) {
+                fprintf(stderr, "No devices to reflash\n");
+                exit(1);
+        }
+
+        /* The daemon reads the file itself, with its own options */
+        if (submit_path != NULL)
+                exit(submit(submit_path, hosts, nhosts, lut->name,
+                            argv[optind + 1]) == 0
+                     ? EXIT_SUCCESS : EXIT_FAILURE);
+
+        img = image_open(argv[optind + 1], lut, &io, opts.profiles, stdout,
+                         stderr);
+        if (img == NULL) {
+                fprintf(stderr, "Reflash file rejected, device untouched\n");
                 exit(1);
         }
 
-        printf("Wait\n");
-        ret = lut->reflash(h, fp) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        /* Only measuring, or keeping out what would take too long */
+        if (qualify > 0 || max_time > 0.0) {
+                int nall = nhosts;
+                int ndrop = qualify_hosts(hosts, &nhosts, img, lut, &opts,
+                                          qualify > 0 ? qualify
+                                                      : QUALIFY_COUNT,
+                                          max_time, stats_format);
 
-        tcp_close(h);
+                if (qualify > 0) {
+                        printf("%d of %d links qualify\n", nhosts, nall);
+                        exit(ndrop == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+                }
+                if (nhosts == 0) {
+                        fprintf(stderr, "No devices to reflash\n");
+                        exit(1);
+                }
+                qualified_out = ndrop;
+        }
+
+        if (stats_file != NULL && stats_format == 0)
+                stats_format = REFLASH_STATS_JSON;
+        if (stats_format != 0) {
+                stats = calloc(nhosts, sizeof(*stats));
+                if (stats == NULL) {
+                        perror("calloc");
+                        exit(1);
+                }
+        }
+
+        if (nhosts > 1)
+                ret = reflash_many(hosts, nhosts, img, lut, &opts, stats);
+        else
+                ret = reflash_device(hosts[0], img, lut, &opts, stats);
+        ret = ret == 0 && qualified_out == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+        if (stats != NULL) {
+                print_stats(stats_file, stats, nhosts, stats_format);
+                free(stats);
+        }
+        for (i = 0; i < nhosts; ++i)
+                free(hosts[i]);
+        free(hosts);
+        free(host_files);
+        free(ranges);
+        free(ips);
+        free(serials);
+        srec_free(img);
         return ret;
 }
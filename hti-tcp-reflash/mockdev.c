@@ -0,0 +1,832 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * hti-mock-device - Stand-in for the TCP command port of an HTI device
+ *
+ * Speaks the dialect of one target from target_lut: the "FLASH xxx"
+ * commands of the p620 family, the same with "31" progress lines while
+ * erasing for the t680 family, or SCPI for the p900 and t500.  Flash is
+ * simulated (erased bytes read 0xFF, writes can only clear bits), and
+ * the timing and failures of a real device on a real network can be
+ * dialled in from the command line.
+ *
+ * The device is single: every connection sees the same flash, as with
+ * the real thing.
+ */
+#include "reflash.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+        MOCK_RXBUF = 8192,
+        MOCK_NEVENTS = 64,
+        MOCK_ERRQ = 16,
+        /* Interval between the t680's "31" lines while erasing */
+        T680_PROGRESS_MS = 250,
+        PAGE_BITS = 16,
+        PAGE_SIZE = 1 << PAGE_BITS,
+        NPAGES = 1 << (32 - PAGE_BITS),
+};
+
+enum mock_kind_t {
+        K_GENERIC,
+        K_T680,
+        K_SCPI,
+};
+
+static const struct mock_target_t {
+        const char *name;
+        enum mock_kind_t kind;
+} mock_targets[] = {
+        { "p620", K_GENERIC },
+        { "p545", K_GENERIC },
+        { "p470", K_GENERIC },
+        { "p330", K_GENERIC },
+        { "t680", K_T680 },
+        { "v120", K_T680 },
+        { "v124", K_T680 },
+        { "p900", K_SCPI },
+        { "t500", K_SCPI },
+        { NULL, K_GENERIC },
+};
+
+/* A reply waiting for its time to go out */
+struct reply_t {
+        struct reply_t *next;
+        double due;
+        size_t len;
+        char text[];
+};
+
+struct conn_t {
+        struct conn_t *next;
+        int fd;
+        int closed;
+        int wantout;
+        int discarding;
+        size_t rxlen;
+        struct reply_t *head;
+        struct reply_t *tail;
+        int npending;
+        size_t txoff;
+        double last_due;
+        char rx[MOCK_RXBUF];
+};
+
+/**
+ * struct mock_t - The simulated device and how it misbehaves
+ * @latency:   Added to every reply, in ms.  Overlaps between commands,
+ *             like network delay.
+ * @proc:      Time the device is busy with each command, in ms
+ * @jitter:    Up to this much more is added to each reply, in ms
+ * @erase_ms:  Time an erase keeps the device busy, in ms
+ * @err_rate:  Chance of a FLASH WRITE failing
+ * @drop_rate: Chance of the connection being dropped at each command
+ * @line_max:  Longest command line accepted
+ * @depth:     Most commands that may await their reply, 0 for no limit.
+ *             Beyond it the p620 family replies with an error and SCPI
+ *             targets lose the command.
+ * @cksum:     Algorithm of the checksum query
+ * @firmware:  Firmware revision "*IDN?" reports
+ * @verbose:   Log every command and reply to stderr
+ */
+static struct mock_t {
+        const struct mock_target_t *target;
+        double latency;
+        double proc;
+        double jitter;
+        double erase_ms;
+        double err_rate;
+        double drop_rate;
+        int line_max;
+        int depth;
+        int cksum;
+        const char *firmware;
+        int verbose;
+        int lock_switch;
+        int unlocked;
+        double busy_until;
+        int written;
+        uint32_t lo;
+        uint32_t hi;
+        int nerr;
+        char errq[MOCK_ERRQ][64];
+        unsigned char *page[NPAGES];
+} mock = {
+        .erase_ms = 2000.0,
+        .cksum = REFLASH_CKSUM_SUM16,
+        .firmware = "MOCK",
+};
+
+static double
+now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+/* The device works on one command at a time; return when this one ends */
+static double
+dev_exec(double cost)
+{
+        double start = mock.busy_until;
+        double now = now_ms();
+
+        if (start < now)
+                start = now;
+        mock.busy_until = start + cost;
+        return mock.busy_until;
+}
+
+static void
+queue_reply(struct conn_t *c, double due, const char *fmt, ...)
+{
+        struct reply_t *r;
+        va_list ap;
+        int len;
+
+        va_start(ap, fmt);
+        len = vsnprintf(NULL, 0, fmt, ap);
+        va_end(ap);
+        r = malloc(sizeof(*r) + len + 3);
+        if (r == NULL) {
+                perror("malloc");
+                exit(1);
+        }
+        va_start(ap, fmt);
+        vsnprintf(r->text, len + 1, fmt, ap);
+        va_end(ap);
+        if (mock.verbose)
+                fprintf(stderr, "-> %s\n", r->text);
+        strcpy(&r->text[len], "\r\n");
+        r->len = len + 2;
+
+        due += mock.latency + mock.jitter * drand48();
+        if (due < c->last_due)
+                due = c->last_due;
+        c->last_due = due;
+        r->due = due;
+        r->next = NULL;
+        if (c->tail != NULL)
+                c->tail->next = r;
+        else
+                c->head = r;
+        c->tail = r;
+        c->npending++;
+}
+
+static void
+push_error(const char *fmt, ...)
+{
+        va_list ap;
+
+        if (mock.nerr == MOCK_ERRQ) {
+                snprintf(mock.errq[MOCK_ERRQ - 1], sizeof(mock.errq[0]),
+                         "-350,\"Queue overflow\"");
+                return;
+        }
+        va_start(ap, fmt);
+        vsnprintf(mock.errq[mock.nerr++], sizeof(mock.errq[0]), fmt, ap);
+        va_end(ap);
+}
+
+static void
+flash_erase(void)
+{
+        int i;
+        for (i = 0; i < NPAGES; ++i) {
+                free(mock.page[i]);
+                mock.page[i] = NULL;
+        }
+        mock.written = 0;
+}
+
+static unsigned char *
+flash_byte(uint32_t addr, int alloc)
+{
+        unsigned char **pg = &mock.page[addr >> PAGE_BITS];
+
+        if (*pg == NULL) {
+                if (!alloc)
+                        return NULL;
+                if ((*pg = malloc(PAGE_SIZE)) == NULL) {
+                        perror("malloc");
+                        exit(1);
+                }
+                memset(*pg, 0xff, PAGE_SIZE);
+        }
+        return &(*pg)[addr & (PAGE_SIZE - 1)];
+}
+
+/* Return an error message, or NULL if the record was written */
+static const char *
+flash_write(const char *srec, size_t len)
+{
+        unsigned char data[SREC_TEXT_LIMIT / 2];
+        struct srec_rec_t r;
+        const char *msg;
+        unsigned int i;
+
+        if (!mock.unlocked)
+                return "flash locked";
+        if ((msg = srec_decode(srec, len, &r, data)) != NULL)
+                return msg;
+        if (r.type < '1' || r.type > '3' || r.len == 0)
+                return NULL;
+        if ((uint64_t)r.addr + r.len > 0x100000000ull)
+                return "address out of range";
+        if (drand48() < mock.err_rate)
+                return "write failed";
+
+        /* Flash can only clear bits */
+        for (i = 0; i < r.len; ++i) {
+                unsigned char *p = flash_byte(r.addr + i, 0);
+                if (p != NULL && (*p & data[i]) != data[i])
+                        return "not erased";
+        }
+        for (i = 0; i < r.len; ++i)
+                *flash_byte(r.addr + i, 1) = data[i];
+
+        if (!mock.written || r.addr < mock.lo)
+                mock.lo = r.addr;
+        if (!mock.written || r.addr + r.len - 1 > mock.hi)
+                mock.hi = r.addr + r.len - 1;
+        mock.written = 1;
+        return NULL;
+}
+
+static uint32_t
+flash_checksum(void)
+{
+        uint32_t sum = srec_cksum_start(mock.cksum);
+        uint64_t addr;
+
+        if (!mock.written)
+                return srec_cksum_end(mock.cksum, sum);
+        for (addr = mock.lo; addr <= mock.hi; ) {
+                uint64_t end = (addr | (PAGE_SIZE - 1)) + 1;
+                unsigned char *p = flash_byte(addr, 0);
+
+                if (end > (uint64_t)mock.hi + 1)
+                        end = (uint64_t)mock.hi + 1;
+                if (p == NULL)
+                        sum = srec_cksum_fill(mock.cksum, sum, end - addr);
+                else
+                        sum = srec_cksum_update(mock.cksum, sum, p,
+                                                end - addr);
+                addr = end;
+        }
+        return srec_cksum_end(mock.cksum, sum);
+}
+
+static int
+cksum_digits(void)
+{
+        return mock.cksum == REFLASH_CKSUM_SUM16 ? 4 : 8;
+}
+
+/* Start an erase; return when it ends */
+static double
+start_erase(struct conn_t *c, int progress)
+{
+        double start = dev_exec(mock.proc);
+        double done = dev_exec(mock.erase_ms);
+        double t;
+
+        if (progress) {
+                for (t = start + T680_PROGRESS_MS; t < done;
+                     t += T680_PROGRESS_MS) {
+                        queue_reply(c, t, "31");
+                }
+        }
+        flash_erase();
+        return done;
+}
+
+static int
+has_prefix(const char *s, const char *prefix)
+{
+        return strncasecmp(s, prefix, strlen(prefix)) == 0;
+}
+
+/* FLASH UNLOCK, FLASH ERASE, FLASH WRITE... */
+static void
+generic_cmd(struct conn_t *c, const char *line)
+{
+        const char *msg;
+        double done;
+
+        if (!strcasecmp(line, "FLASH UNLOCK")) {
+                mock.unlocked = 1;
+                queue_reply(c, dev_exec(mock.proc), "OK");
+        } else if (!strcasecmp(line, "FLASH LOCK")) {
+                mock.unlocked = 0;
+                queue_reply(c, dev_exec(mock.proc), "OK");
+        } else if (!strcasecmp(line, "FLASH ERASE")) {
+                if (!mock.unlocked) {
+                        queue_reply(c, dev_exec(mock.proc),
+                                    "ERROR flash locked");
+                        return;
+                }
+                done = start_erase(c, mock.target->kind == K_T680);
+                queue_reply(c, done, "OK");
+        } else if (has_prefix(line, "FLASH WRITE ")) {
+                line += strlen("FLASH WRITE ");
+                done = dev_exec(mock.proc);
+                if ((msg = flash_write(line, strlen(line))) != NULL)
+                        queue_reply(c, done, "ERROR %s", msg);
+                else
+                        queue_reply(c, done, "OK");
+        } else if (!strcasecmp(line, "FLASH CHECKSUM")) {
+                queue_reply(c, dev_exec(mock.proc), "%0*lX",
+                            cksum_digits(), (unsigned long)flash_checksum());
+        } else {
+                queue_reply(c, dev_exec(mock.proc), "ERROR unknown command");
+        }
+}
+
+static void
+scpi_append(char *resp, size_t size, const char *fmt, ...)
+{
+        size_t len = strlen(resp);
+        va_list ap;
+
+        if (len > 0 && len + 1 < size)
+                resp[len++] = ';';
+        va_start(ap, fmt);
+        vsnprintf(&resp[len], size - len, fmt, ap);
+        va_end(ap);
+}
+
+/* One SCPI message unit, without its ';' */
+static double
+scpi_unit(struct conn_t *c, char *unit, char *resp, size_t size)
+{
+        const char *msg;
+        double done = dev_exec(mock.proc);
+
+        if (!strcasecmp(unit, "*OPC?")) {
+                scpi_append(resp, size, "1");
+        } else if (!strcasecmp(unit, "*IDN?")) {
+                scpi_append(resp, size, "HIGHLAND TECHNOLOGY,%s,0,%s",
+                            mock.target->name, mock.firmware);
+        } else if (!strcasecmp(unit, "*CLS")) {
+                mock.nerr = 0;
+        } else if (!strcasecmp(unit, "STATUS:LOCK?")) {
+                scpi_append(resp, size, "%d", mock.lock_switch);
+        } else if (!strcasecmp(unit, "FLASH:UNLOCK")) {
+                if (mock.lock_switch)
+                        push_error("-203,\"Command protected\"");
+                else
+                        mock.unlocked = 1;
+        } else if (!strcasecmp(unit, "FLASH:LOCK")) {
+                mock.unlocked = 0;
+        } else if (!strcasecmp(unit, "FLASH:ERASE")) {
+                if (!mock.unlocked)
+                        push_error("-203,\"Command protected\"");
+                else
+                        done = start_erase(c, 0);
+        } else if (has_prefix(unit, "FLASH:WRITE ")) {
+                char *s = unit + strlen("FLASH:WRITE ");
+                size_t len = strlen(s);
+
+                if (len < 2 || s[0] != '"' || s[len - 1] != '"')
+                        msg = "string data expected";
+                else
+                        msg = flash_write(s + 1, len - 2);
+                if (msg != NULL)
+                        push_error("-200,\"Execution error; %s\"", msg);
+        } else if (!strcasecmp(unit, "FLASH:CHECKSUM?")) {
+                scpi_append(resp, size, "%0*lX", cksum_digits(),
+                            (unsigned long)flash_checksum());
+        } else if (!strcasecmp(unit, "SYST:ERR?")
+                   || !strcasecmp(unit, "SYSTEM:ERROR?")
+                   || !strcasecmp(unit, "SYST:ERROR?")) {
+                if (mock.nerr == 0) {
+                        scpi_append(resp, size, "0,\"No error\"");
+                } else {
+                        scpi_append(resp, size, "%s", mock.errq[0]);
+                        memmove(mock.errq[0], mock.errq[1],
+                                --mock.nerr * sizeof(mock.errq[0]));
+                }
+        } else {
+                push_error("-113,\"Undefined header\"");
+        }
+        return done;
+}
+
+/* A program message: units separated by ';' outside quotes */
+static void
+scpi_cmd(struct conn_t *c, char *line)
+{
+        char resp[MOCK_RXBUF];
+        double done = 0.0;
+        char *unit = line;
+        int inquote = 0;
+
+        resp[0] = '\0';
+        for (;; ++line) {
+                if (*line == '"') {
+                        inquote = !inquote;
+                } else if ((*line == ';' && !inquote) || *line == '\0') {
+                        int last = *line == '\0';
+
+                        *line = '\0';
+                        while (isspace((unsigned char)*unit))
+                                ++unit;
+                        if (*unit != '\0')
+                                done = scpi_unit(c, unit, resp, sizeof(resp));
+                        if (last)
+                                break;
+                        unit = line + 1;
+                }
+        }
+        if (resp[0] != '\0')
+                queue_reply(c, done, "%s", resp);
+}
+
+static void
+conn_command(struct conn_t *c, char *line)
+{
+        if (mock.verbose)
+                fprintf(stderr, "<- %s\n", line);
+        if (drand48() < mock.drop_rate) {
+                fprintf(stderr, "dropping connection\n");
+                c->closed = 1;
+                return;
+        }
+        if (mock.depth > 0 && c->npending >= mock.depth) {
+                if (mock.target->kind != K_SCPI)
+                        queue_reply(c, now_ms(), "ERROR input overflow");
+                return;
+        }
+        if (mock.target->kind == K_SCPI)
+                scpi_cmd(c, line);
+        else
+                generic_cmd(c, line);
+}
+
+/* Overlong line: the device's input buffer overflows */
+static void
+conn_overrun(struct conn_t *c)
+{
+        if (mock.verbose)
+                fprintf(stderr, "<- (too long)\n");
+        if (mock.target->kind == K_SCPI)
+                push_error("-363,\"Input buffer overrun\"");
+        else
+                queue_reply(c, dev_exec(mock.proc), "ERROR line too long");
+}
+
+static void
+conn_readable(struct conn_t *c)
+{
+        for (;;) {
+                ssize_t res;
+                size_t i, start;
+
+                res = recv(c->fd, &c->rx[c->rxlen],
+                           sizeof(c->rx) - c->rxlen, 0);
+                if (res < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                c->closed = 1;
+                        return;
+                }
+                if (res == 0) {
+                        c->closed = 1;
+                        return;
+                }
+                c->rxlen += res;
+
+                start = 0;
+                for (i = 0; i < c->rxlen && !c->closed; ++i) {
+                        if (c->rx[i] != '\r' && c->rx[i] != '\n')
+                                continue;
+                        c->rx[i] = '\0';
+                        if (c->discarding)
+                                c->discarding = 0;
+                        else if (i - start > (size_t)mock.line_max)
+                                conn_overrun(c);
+                        else if (i > start)
+                                conn_command(c, &c->rx[start]);
+                        start = i + 1;
+                }
+                memmove(c->rx, &c->rx[start], c->rxlen - start);
+                c->rxlen -= start;
+
+                if (c->rxlen > (size_t)mock.line_max) {
+                        if (!c->discarding)
+                                conn_overrun(c);
+                        c->discarding = 1;
+                        c->rxlen = 0;
+                }
+        }
+}
+
+/* Send the replies that are due; return nonzero if the socket is full */
+static int
+conn_flush(struct conn_t *c, double now)
+{
+        while (c->head != NULL && c->head->due <= now) {
+                struct reply_t *r = c->head;
+                ssize_t res = send(c->fd, &r->text[c->txoff],
+                                   r->len - c->txoff, MSG_NOSIGNAL);
+                if (res < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 1;
+                        if (errno == EINTR)
+                                continue;
+                        c->closed = 1;
+                        return 0;
+                }
+                c->txoff += res;
+                if (c->txoff < r->len)
+                        continue;
+                c->txoff = 0;
+                c->head = r->next;
+                if (c->head == NULL)
+                        c->tail = NULL;
+                c->npending--;
+                free(r);
+        }
+        return 0;
+}
+
+static void
+conn_free(struct conn_t *c)
+{
+        while (c->head != NULL) {
+                struct reply_t *r = c->head;
+                c->head = r->next;
+                free(r);
+        }
+        close(c->fd);
+        free(c);
+}
+
+static int
+listen_socket(const char *addr, int port)
+{
+        struct sockaddr_in sin;
+        int fd, one = 1;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+                fprintf(stderr, "Invalid address '%s'\n", addr);
+                exit(1);
+        }
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("socket");
+                exit(1);
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0
+            || listen(fd, 128) < 0) {
+                perror("bind");
+                exit(1);
+        }
+        return fd;
+}
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr,
+"Usage: %s [options] target\n"
+"  -a ADDR      listen on ADDR (default 127.0.0.1)\n"
+"  -p PORT      listen on PORT (default %d)\n"
+"  -l MS        latency added to every reply\n"
+"  -P MS        time the device is busy with each command\n"
+"  -J MS        random extra latency, up to MS\n"
+"  -E MS        erase time (default 2000)\n"
+"  -e RATE      chance of a FLASH WRITE failing, 0 to 1\n"
+"  -x RATE      chance of dropping the connection at each command\n"
+"  -b LEN       longest command line accepted\n"
+"  -d DEPTH     most commands awaiting a reply, 0 for no limit\n"
+"  -c ALGO      checksum query answers sum16, sum32 or crc32\n"
+"  -F REV       firmware revision *IDN? reports (default MOCK)\n"
+"  -L           hardware lock switch on (p900)\n"
+"  -S SEED      random seed\n"
+"  -v           log commands and replies\n",
+                argv0, HTI_PORT);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        const char *addr = "127.0.0.1";
+        struct conn_t *conns = NULL;
+        int port = HTI_PORT;
+        int opt, lfd, ep, i;
+        struct epoll_event ev;
+
+        srand48(time(NULL));
+        mock.line_max = -1;
+        while ((opt = getopt(argc, argv, "a:p:l:P:J:E:e:x:b:d:c:F:LS:v")) != -1) {
+                switch (opt) {
+                case 'a':
+                        addr = optarg;
+                        break;
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 'l':
+                        mock.latency = atof(optarg);
+                        break;
+                case 'P':
+                        mock.proc = atof(optarg);
+                        break;
+                case 'J':
+                        mock.jitter = atof(optarg);
+                        break;
+                case 'E':
+                        mock.erase_ms = atof(optarg);
+                        break;
+                case 'e':
+                        mock.err_rate = atof(optarg);
+                        break;
+                case 'x':
+                        mock.drop_rate = atof(optarg);
+                        break;
+                case 'b':
+                        mock.line_max = atoi(optarg);
+                        break;
+                case 'd':
+                        mock.depth = atoi(optarg);
+                        break;
+                case 'c':
+                        if (!strcmp(optarg, "sum16"))
+                                mock.cksum = REFLASH_CKSUM_SUM16;
+                        else if (!strcmp(optarg, "sum32"))
+                                mock.cksum = REFLASH_CKSUM_SUM32;
+                        else if (!strcmp(optarg, "crc32"))
+                                mock.cksum = REFLASH_CKSUM_CRC32;
+                        else
+                                usage(argv[0]);
+                        break;
+                case 'F':
+                        mock.firmware = optarg;
+                        break;
+                case 'L':
+                        mock.lock_switch = 1;
+                        break;
+                case 'S':
+                        srand48(atol(optarg));
+                        break;
+                case 'v':
+                        mock.verbose = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                        break;
+                }
+        }
+        if (argc - optind < 1)
+                usage(argv[0]);
+        for (i = 0; mock_targets[i].name != NULL; ++i) {
+                if (!strcmp(argv[optind], mock_targets[i].name))
+                        mock.target = &mock_targets[i];
+        }
+        if (mock.target == NULL) {
+                fprintf(stderr, "Invalid target '%s'\n", argv[optind]);
+                exit(1);
+        }
+        if (mock.line_max < 0) {
+                mock.line_max = mock.target->kind == K_SCPI
+                                ? 1024 : SREC_TEXT_MAX + 32;
+        }
+        if (mock.line_max >= MOCK_RXBUF)
+                mock.line_max = MOCK_RXBUF - 1;
+
+        lfd = listen_socket(addr, port);
+        ep = epoll_create1(EPOLL_CLOEXEC);
+        if (ep < 0) {
+                perror("epoll_create1");
+                exit(1);
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+        fprintf(stderr, "%s mock listening on %s:%d\n",
+                mock.target->name, addr, port);
+
+        for (;;) {
+                struct epoll_event evs[MOCK_NEVENTS];
+                struct conn_t **pc, *c;
+                double now = now_ms(), next = -1.0;
+                int n, timeout = -1;
+
+                for (c = conns; c != NULL; c = c->next) {
+                        if (c->head != NULL
+                            && (next < 0.0 || c->head->due < next)) {
+                                next = c->head->due;
+                        }
+                }
+                if (next >= 0.0)
+                        timeout = next > now ? (int)(next - now) + 1 : 0;
+
+                n = epoll_wait(ep, evs, MOCK_NEVENTS, timeout);
+                if (n < 0 && errno != EINTR) {
+                        perror("epoll_wait");
+                        exit(1);
+                }
+                for (i = 0; i < n; ++i) {
+                        if (evs[i].data.ptr == NULL) {
+                                int fd;
+                                while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+                                        fcntl(fd, F_SETFL, O_NONBLOCK);
+                                        c = calloc(1, sizeof(*c));
+                                        if (c == NULL) {
+                                                perror("calloc");
+                                                exit(1);
+                                        }
+                                        c->fd = fd;
+                                        c->next = conns;
+                                        conns = c;
+                                        ev.events = EPOLLIN;
+                                        ev.data.ptr = c;
+                                        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+                                }
+                                continue;
+                        }
+                        c = evs[i].data.ptr;
+                        if ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                            != 0) {
+                                conn_readable(c);
+                        }
+                }
+
+                now = now_ms();
+                for (pc = &conns; (c = *pc) != NULL; ) {
+                        int full = 0;
+                        if (!c->closed)
+                                full = conn_flush(c, now);
+                        if (c->closed) {
+                                *pc = c->next;
+                                epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+                                conn_free(c);
+                                continue;
+                        }
+                        if (full != c->wantout) {
+                                c->wantout = full;
+                                ev.events = EPOLLIN | (full ? EPOLLOUT : 0);
+                                ev.data.ptr = c;
+                                epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+                        }
+                        pc = &c->next;
+                }
+        }
+        return 0;
+}
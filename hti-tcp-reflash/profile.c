@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Tuning profiles, so a device whose model and firmware have been seen
+ * before is written at the settings probed then, with no probing and no
+ * slow start.
+ *
+ * One small text file per model and firmware revision, named
+ * <model>-<firmware>.prof, of "key value" lines.  It is written to a
+ * temporary file and renamed into place, so runs going on at the same
+ * time only ever see whole profiles.  A profile that cannot be read is
+ * as good as none, and trouble saving one is reported and ignored: like
+ * the journal, it must never be the reason a reflash fails.
+ */
+#include "reflash.h"
+#include <ctype.h>
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char profile_magic[] = "hti-tcp-reflash profile 1";
+
+/* Keep @s usable as a file name and a glob */
+static void
+profile_sanitize(char *s)
+{
+        for (; *s != '\0'; ++s) {
+                if (!isalnum((unsigned char)*s) && *s != '.' && *s != '-')
+                        *s = '_';
+        }
+}
+
+/**
+ * profile_init - Start @p off at what @t is known to take without
+ *                probing
+ * @p:        Profile
+ * @t:        Kind of device
+ * @firmware: Firmware revision, see profile_firmware()
+ */
+void
+profile_init(struct reflash_profile_t *p, const struct reflash_target_t *t,
+             const char *firmware)
+{
+        memset(p, 0, sizeof(*p));
+        snprintf(p->model, sizeof(p->model), "%s", t->name);
+        snprintf(p->firmware, sizeof(p->firmware), "%s", firmware);
+        profile_sanitize(p->model);
+        profile_sanitize(p->firmware);
+        p->srec_max = t->srec_max;
+        p->depth = 1;
+}
+
+/**
+ * profile_firmware - Firmware revision from a reply to the dialect's
+ *                    identification query
+ * @reply: The reply, or NULL if the dialect has no such query
+ * @buf:   Set to the revision, or "unknown"
+ * @size:  Size of @buf
+ *
+ * An IEEE 488.2 "*IDN?" reply is maker, model, serial number and
+ * firmware revision, separated by commas; only the last of them is
+ * taken, so devices of one revision share a profile.  Any other reply,
+ * short of an error, is taken whole.
+ */
+void
+profile_firmware(const char *reply, char *buf, size_t size)
+{
+        const char *p;
+        int i;
+
+        if (reply == NULL || reply[0] == '\0'
+            || strncmp(reply, "ERR", 3) == 0) {
+                snprintf(buf, size, "unknown");
+                return;
+        }
+        for (i = 0, p = reply; i < 3 && p != NULL; ++i) {
+                p = strchr(p, ',');
+                if (p != NULL)
+                        ++p;
+        }
+        if (p == NULL)
+                p = reply;
+        p += strspn(p, " \t");
+        snprintf(buf, size, "%.*s", (int)strcspn(p, ","), p);
+        profile_sanitize(buf);
+}
+
+static int
+profile_path(char *buf, size_t size, const char *dir,
+             const struct reflash_profile_t *p)
+{
+        return snprintf(buf, size, "%s/%s-%s.prof", dir, p->model,
+                        p->firmware) < (int)size ? 0 : -1;
+}
+
+/*
+ * Whether @p is for a known firmware revision.  The limits of a device
+ * whose firmware cannot be told, by a dialect without an identification
+ * query or a device without an answer to it, are not kept: they would
+ * carry over to the next firmware, which may take less.
+ */
+static int
+profile_known(const struct reflash_profile_t *p)
+{
+        return strcmp(p->firmware, "unknown") != 0;
+}
+
+/* Read the profile at @path into @p; return 0, or -1 if it is no good */
+static int
+profile_read(const char *path, struct reflash_profile_t *p)
+{
+        char magic[64], model[PROFILE_NAME_MAX], fw[PROFILE_NAME_MAX];
+        struct reflash_profile_t q;
+        FILE *fp;
+        int n;
+
+        if ((fp = fopen(path, "r")) == NULL)
+                return -1;
+        memset(&q, 0, sizeof(q));
+        n = fscanf(fp, "%63[^\n]\nmodel %63s\nfirmware %63s\nsrec_max %d\n"
+                   "depth %d\nrtt %lf\nerase %lf",
+                   magic, model, fw, &q.srec_max, &q.depth, &q.rtt,
+                   &q.erase);
+        fclose(fp);
+        if (n != 7 || strcmp(magic, profile_magic) != 0
+            || q.srec_max < 10 || q.srec_max > SREC_TEXT_LIMIT
+            || q.depth < 1 || q.depth > REFLASH_WINDOW_MAX
+            || !(q.rtt >= 0.0) || !(q.erase >= 0.0)) {
+                fprintf(stderr, "%s: not a profile, ignoring it\n", path);
+                return -1;
+        }
+        memcpy(q.model, model, sizeof(q.model));
+        memcpy(q.firmware, fw, sizeof(q.firmware));
+        *p = q;
+        return 0;
+}
+
+/**
+ * profile_load - Look up the profile for @p's model and firmware
+ * @dir: Directory profiles live in, or NULL to keep none
+ * @p:   From profile_init(); filled in from the profile if there is one,
+ *       but for the limits of an unknown firmware, which keep
+ *       profile_init()'s defaults
+ *
+ * Return: 0 if found, -1 if not
+ */
+int
+profile_load(const char *dir, struct reflash_profile_t *p)
+{
+        int srec_max = p->srec_max, depth = p->depth;
+        char path[PATH_MAX];
+
+        if (dir == NULL || profile_path(path, sizeof(path), dir, p) < 0
+            || profile_read(path, p) < 0)
+                return -1;
+        if (!profile_known(p)) {
+                p->srec_max = srec_max;
+                p->depth = depth;
+        }
+        return 0;
+}
+
+/**
+ * profile_save - Store @p for later runs, replacing what was there
+ * @dir: Directory profiles live in, or NULL to keep none
+ * @t:   Kind of device @p is for
+ * @p:   Profile.  Of an unknown firmware, only the times are stored,
+ *       with @t's default limits.
+ */
+void
+profile_save(const char *dir, const struct reflash_target_t *t,
+             const struct reflash_profile_t *p)
+{
+        char path[PATH_MAX], tmp[PATH_MAX];
+        struct reflash_profile_t q;
+        FILE *fp;
+
+        if (dir == NULL || profile_path(path, sizeof(path), dir, p) < 0
+            || snprintf(tmp, sizeof(tmp), "%s.%ld", path,
+                        (long)getpid()) >= (int)sizeof(tmp)) {
+                return;
+        }
+        if (mkdir_p(dir) < 0 || (fp = fopen(tmp, "w")) == NULL) {
+                fprintf(stderr, "%s: %s; profile not saved\n", path,
+                        strerror(errno));
+                return;
+        }
+        if (!profile_known(p)) {
+                profile_init(&q, t, p->firmware);
+                q.rtt = p->rtt;
+                q.erase = p->erase;
+                p = &q;
+        }
+        fprintf(fp, "%s\nmodel %s\nfirmware %s\nsrec_max %d\ndepth %d\n"
+                "rtt %.6f\nerase %.3f\n",
+                profile_magic, p->model, p->firmware, p->srec_max,
+                p->depth, p->rtt, p->erase);
+        if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+                fprintf(stderr, "%s: %s; profile not saved\n", path,
+                        strerror(errno));
+                unlink(tmp);
+        }
+}
+
+/**
+ * profile_srec_max - Longest S-record every firmware of @t seen so far
+ *                    takes
+ * @dir: Directory profiles live in, or NULL to keep none
+ * @t:   Kind of device
+ *
+ * This is what records can be re-blocked into before it is known which
+ * firmware the devices run.
+ *
+ * Return: The shortest @srec_max of @t's profiles, or @t->srec_max if
+ * there are none
+ */
+int
+profile_srec_max(const char *dir, const struct reflash_target_t *t)
+{
+        struct reflash_profile_t p;
+        char pattern[PATH_MAX];
+        int max = -1;
+        glob_t g;
+        size_t i;
+
+        profile_init(&p, t, "");
+        if (dir == NULL
+            || snprintf(pattern, sizeof(pattern), "%s/%s-*.prof", dir,
+                        p.model) >= (int)sizeof(pattern)
+            || glob(pattern, 0, NULL, &g) != 0) {
+                return t->srec_max;
+        }
+        for (i = 0; i < g.gl_pathc; ++i) {
+                if (profile_read(g.gl_pathv[i], &p) == 0
+                    && profile_known(&p) && !strcmp(p.model, t->name)
+                    && (max < 0 || p.srec_max < max)) {
+                        max = p.srec_max;
+                }
+        }
+        globfree(&g);
+        return max < 0 ? t->srec_max : max;
+}
+
+/**
+ * profile_erase_timeout - How long an erase may take on a device of @p
+ * @p:             Profile
+ * @timeout_cmd:   Seconds any command may take
+ * @timeout_erase: Seconds an erase may take at most
+ *
+ * Return: Three times what the last erase took, plus @timeout_cmd, or
+ * @timeout_erase if that is shorter or no erase was timed yet
+ */
+double
+profile_erase_timeout(const struct reflash_profile_t *p, double timeout_cmd,
+                      double timeout_erase)
+{
+        double t = 3.0 * p->erase + timeout_cmd;
+
+        return p->erase > 0.0 && t < timeout_erase ? t : timeout_erase;
+}
+
+/**
+ * profile_default_dir - Where profiles go unless told otherwise
+ * @buf:  Where the directory's name goes
+ * @size: Size of @buf
+ *
+ * Return: @buf, holding $XDG_CACHE_HOME/hti-tcp-reflash, or
+ * $HOME/.cache/hti-tcp-reflash, or NULL if neither variable is set or the
+ * name does not fit
+ */
+const char *
+profile_default_dir(char *buf, size_t size)
+{
+        const char *base;
+        int len;
+
+        if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] == '/')
+                len = snprintf(buf, size, "%s/hti-tcp-reflash", base);
+        else if ((base = getenv("HOME")) != NULL && base[0] != '\0')
+                len = snprintf(buf, size, "%s/.cache/hti-tcp-reflash", base);
+        else
+                return NULL;
+        return len >= 0 && (size_t)len < size ? buf : NULL;
+}
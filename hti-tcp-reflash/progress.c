@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "reflash.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Progress of the write phase.  Acknowledged records only bump counters;
+ * the display is drawn at most PROGRESS_HZ times a second, so a fast
+ * link costs one terminal write per tick, not one per record.  On a
+ * terminal that is one status line, redrawn in place.  Anywhere else,
+ * such as a log file or a pipe to a supervising program, every tick is
+ * a line holding one JSON object.
+ */
+
+/* Weight of the latest tick in the smoothed rates */
+#define PROGRESS_ALPHA 0.3
+
+static uint64_t
+span_bytes(const struct srec_image_t *img, int from, int to)
+{
+        uint64_t n = 0;
+
+        for (; from < to; ++from)
+                n += img->rec[from].len;
+        return n;
+}
+
+/**
+ * progress_init - Start showing progress
+ * @p:      Progress to start
+ * @device: Device name for the JSON ticks, or NULL
+ * @img:    Image being written
+ * @copies: How many devices @img is written to
+ */
+void
+progress_init(struct reflash_progress_t *p, const char *device,
+              const struct srec_image_t *img, int copies)
+{
+        memset(p, 0, sizeof(*p));
+        p->device = device;
+        p->json = !isatty(STDOUT_FILENO);
+        p->total = img->nrec * copies;
+        p->total_bytes = span_bytes(img, 0, img->nrec) * copies;
+        p->start = p->last = stats_now();
+        p->next = p->start + 1.0 / PROGRESS_HZ;
+}
+
+/**
+ * progress_skip - Count records [@from, @to) of @img as done, without
+ *                 them adding to the rates
+ *
+ * For records already written by an earlier run, and for those a device
+ * that is up to date or has failed will never get.
+ */
+void
+progress_skip(struct reflash_progress_t *p, const struct srec_image_t *img,
+              int from, int to)
+{
+        uint64_t n = span_bytes(img, from, to);
+
+        p->done += to - from;
+        p->bytes += n;
+        p->last_done += to - from;
+        p->last_bytes += n;
+}
+
+static void
+fmt_bytes(char *buf, size_t size, double n)
+{
+        if (n >= 1024.0 * 1024.0)
+                snprintf(buf, size, "%.1f MiB", n / (1024.0 * 1024.0));
+        else if (n >= 1024.0)
+                snprintf(buf, size, "%.1f KiB", n / 1024.0);
+        else
+                snprintf(buf, size, "%.0f B", n);
+}
+
+static void
+draw(struct reflash_progress_t *p, double now)
+{
+        double pct = p->total ? 100.0 * p->done / p->total : 100.0;
+        double eta = p->rate > 0.0 ? (p->total - p->done) / p->rate : -1.0;
+        char rate[32];
+
+        if (p->json) {
+                printf("{");
+                if (p->device != NULL) {
+                        printf("\"device\":");
+                        stats_json_string(stdout, p->device);
+                        printf(",");
+                }
+                printf("\"elapsed_s\":%.3f,\"records\":%d,"
+                       "\"total_records\":%d,\"percent\":%.1f,"
+                       "\"bytes\":%llu,\"total_bytes\":%llu,"
+                       "\"records_per_s\":%.1f,\"bytes_per_s\":%.0f,",
+                       now - p->start, p->done, p->total, pct,
+                       (unsigned long long)p->bytes,
+                       (unsigned long long)p->total_bytes,
+                       p->rate, p->byte_rate);
+                if (eta < 0.0)
+                        printf("\"eta_s\":null}\n");
+                else
+                        printf("\"eta_s\":%.1f}\n", eta);
+        } else {
+                fmt_bytes(rate, sizeof(rate), p->byte_rate);
+                printf("\r%5.1f%%  %d/%d records  %.0f rec/s  %s/s",
+                       pct, p->done, p->total, p->rate, rate);
+                if (eta >= 0.0) {
+                        printf("  ETA %d:%02d",
+                               (int)eta / 60, (int)eta % 60);
+                }
+                printf("\033[K");
+                p->shown = 1;
+        }
+        fflush(stdout);
+}
+
+static void
+tick(struct reflash_progress_t *p, double now)
+{
+        double dt = now - p->last;
+
+        /*
+         * Too short an interval, as at progress_end(), says little,
+         * unless it is all there is
+         */
+        if (dt >= 0.5 / PROGRESS_HZ || (p->last == p->start && dt > 0.0)) {
+                double rate = (p->done - p->last_done) / dt;
+                double byte_rate = (p->bytes - p->last_bytes) / dt;
+
+                /* The first tick seeds the averages */
+                if (p->last == p->start) {
+                        p->rate = rate;
+                        p->byte_rate = byte_rate;
+                } else {
+                        p->rate += PROGRESS_ALPHA * (rate - p->rate);
+                        p->byte_rate += PROGRESS_ALPHA
+                                        * (byte_rate - p->byte_rate);
+                }
+                p->last = now;
+                p->last_done = p->done;
+                p->last_bytes = p->bytes;
+        }
+        p->next = now + 1.0 / PROGRESS_HZ;
+        draw(p, now);
+}
+
+/**
+ * progress_ack - Count one record, of @len data bytes, as written
+ */
+void
+progress_ack(struct reflash_progress_t *p, unsigned int len)
+{
+        double now;
+
+        p->done++;
+        p->bytes += len;
+        if ((now = stats_now()) >= p->next)
+                tick(p, now);
+}
+
+/**
+ * progress_poll - Tick if one is due, whether or not records came in
+ */
+void
+progress_poll(struct reflash_progress_t *p)
+{
+        double now = stats_now();
+
+        if (now >= p->next)
+                tick(p, now);
+}
+
+/**
+ * progress_timeout - Milliseconds until the next tick is due
+ */
+int
+progress_timeout(const struct reflash_progress_t *p)
+{
+        double now = stats_now();
+
+        return p->next > now ? (int)((p->next - now) * 1000.0) + 1 : 0;
+}
+
+/**
+ * progress_hide - Clear the status line, so other output can follow
+ *
+ * It comes back at the next tick.
+ */
+void
+progress_hide(struct reflash_progress_t *p)
+{
+        if (!p->shown)
+                return;
+        printf("\r\033[K");
+        p->shown = 0;
+}
+
+/**
+ * progress_end - Show the final count and leave the line be
+ */
+void
+progress_end(struct reflash_progress_t *p)
+{
+        tick(p, stats_now());
+        if (p->shown)
+                putchar('\n');
+        p->shown = 0;
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Link qualification: whether a device can be reflashed over the link
+ * to it, found out before anything is erased.
+ *
+ * The query is "*IDN?", which no dialect acts on.  The SCPI targets
+ * answer it with their identity.  The FLASH command families have no
+ * query of their own to spare, and are assumed to answer it, as any
+ * command they do not know, with an error line: hti-mock-device does,
+ * but nothing says the firmware of every unit does.  So on a target
+ * with no identity query, a first query that times out ends the
+ * qualification as not supported by the target, rather than being
+ * counted lost, and reconnected after, QUERIES times over.
+ *
+ * It is timed one at a time, for the round
+ * trip, then, if the dialect pipelines and the reflash would keep
+ * several writes in flight, as many again with that many in flight,
+ * for the pace the device replies at.  A query with no reply in time
+ * is lost, and costs a reconnect, as a write would; a reply taking
+ * QUALIFY_STALL times the median round trip is a stall.
+ *
+ * The projection is what the reflash would cost at those rates: its
+ * steps and checksum queries at the mean round trip, the erase as long
+ * as the device's profile says the last one took, or the erase timeout
+ * without one, and its write command lines, as many as it would send,
+ * at the pace of the window.  A window that lost replies is not paced:
+ * the reflash would shrink it, so the lines are projected one round
+ * trip each.  Each line is expected to be lost as often as the queries
+ * were, at the price of the time it took to notice and the first
+ * reconnect delay.
+ */
+#include "reflash.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char qualify_query[] = "*IDN?";
+
+static int
+cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *)a, y = *(const double *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+/* Sample below which fraction @p of the @n sorted samples @v fall */
+static double
+percentile(const double *v, int n, double p)
+{
+        int i = (int)(p * n + 0.5) - 1;
+
+        if (i < 0)
+                i = 0;
+        if (i >= n)
+                i = n - 1;
+        return v[i];
+}
+
+/*
+ * Lost the replies to @n queries, waited for since @since: start over
+ * on a new connection, or return -1
+ */
+static int
+qualify_lost(struct reflash_tcp_t *h, struct reflash_qual_t *q, int n,
+             double since)
+{
+        q->lost += n;
+        q->lost_secs += stats_now() - since;
+        return tcp_reconnect(h);
+}
+
+/*
+ * Time @count queries one at a time into @rtt, sorted; return the
+ * number answered, or -1 if the connection could not be made again, or
+ * with errno EOPNOTSUPP if the target, having no @ident, does not
+ * answer the query at all
+ */
+static int
+qualify_rtt(struct reflash_tcp_t *h, const struct reflash_opts_t *opts,
+            const char *ident, struct reflash_qual_t *q, int count,
+            double *rtt, char *reply, size_t size)
+{
+        const char *line;
+        int i, n = 0;
+
+        for (i = 0; i < count; ++i) {
+                double t0 = stats_now();
+
+                ++q->queries;
+                tcp_deadline(h, t0 + opts->timeout_cmd);
+                if (tcp_io_sendonly(h, "%s", qualify_query) < 0
+                    || (line = tcp_getline(h)) == NULL) {
+                        if (i == 0 && ident == NULL && errno == ETIMEDOUT) {
+                                errno = EOPNOTSUPP;
+                                return -1;
+                        }
+                        if (qualify_lost(h, q, 1, t0) < 0)
+                                return -1;
+                        continue;
+                }
+                rtt[n] = stats_now() - t0;
+                stats_rtt(tcp_stats(h), rtt[n]);
+                if (n++ == 0 && ident != NULL)
+                        snprintf(reply, size, "%s", line);
+        }
+        qsort(rtt, n, sizeof(*rtt), cmp_double);
+        return n;
+}
+
+/*
+ * Time the replies to @count queries with @q->window of them kept in
+ * flight, each reply letting the next one go as the write window does,
+ * into @q->pace.  A window's worth more go out after them, so that
+ * every reply timed was followed by more queries, as all but the last
+ * writes of a reflash are.  If replies are lost, @q->window drops to 1
+ * and @q->pace stays 0.  Return -1 if the connection could not be made
+ * again after that, 0 otherwise.
+ */
+static int
+qualify_pace(struct reflash_tcp_t *h, const struct reflash_opts_t *opts,
+             struct reflash_qual_t *q, int count)
+{
+        int total = count + q->window, sent = 0, got = 0;
+        double first = 0.0, last = 0.0;
+
+        while (got < total) {
+                double t0 = stats_now();
+
+                while (sent < total && sent - got < q->window) {
+                        if (tcp_queue(h, "%s", qualify_query) < 0)
+                                break;
+                        ++sent;
+                        ++q->queries;
+                }
+                tcp_deadline(h, t0 + opts->timeout_cmd);
+                if (tcp_flush(h) < 0 || tcp_getline(h) == NULL) {
+                        q->window = 1;
+                        return qualify_lost(h, q, sent - got, t0);
+                }
+                if (got == 0)
+                        first = stats_now();
+                if (++got == count)
+                        last = stats_now();
+        }
+        if (count > 1)
+                q->pace = (last - first) / (count - 1);
+        return 0;
+}
+
+/* Write command lines the reflash of @img would send */
+static int
+qualify_lines(const struct srec_image_t *img, const struct reflash_dialect_t *d,
+              const struct reflash_opts_t *opts)
+{
+        char line[BATCH_LINE_MAX + 1];
+        struct srec_wire_t *w;
+        int batch, i, n, lines = 0;
+        size_t len;
+
+        if (d->batch_fmt == NULL || opts->batch == 1)
+                return img->nrec;
+        batch = opts->batch > 0 ? opts->batch : INT_MAX;
+        if ((w = srec_wire(img, d->batch_fmt)) == NULL)
+                return img->nrec;
+        for (i = 0; i < img->nrec; i += n, ++lines) {
+                n = srec_wire_batch(w, i, batch, d->batch_head, d->batch_tail,
+                                    d->batch_line, line, &len);
+                /* The reflash would go record by record from here */
+                if (n == 0) {
+                        lines += img->nrec - i;
+                        break;
+                }
+        }
+        srec_wire_free(w);
+        return lines;
+}
+
+/* Work out @q->project from the measurements */
+static void
+qualify_project(struct reflash_qual_t *q, const struct srec_image_t *img,
+                const struct reflash_target_t *t,
+                const struct reflash_opts_t *opts,
+                const struct reflash_profile_t *prof)
+{
+        const struct reflash_dialect_t *d = t->dialect;
+        const struct reflash_step_t *st;
+        double line, loss;
+        int steps = 0;
+
+        for (st = d->pre; st->cmd != NULL; ++st)
+                steps += !st->erase;
+        for (st = d->post; st->cmd != NULL; ++st)
+                ++steps;
+        /* Checking before, verifying after */
+        if (opts->cksum != REFLASH_CKSUM_NONE)
+                steps += 2;
+
+        q->lines = qualify_lines(img, d, opts);
+        line = q->rtt_mean / q->window;
+        if (q->pace > line)
+                line = q->pace;
+        /* Noticing, then the first reconnect delay, as reflash_run() has */
+        loss = q->lost > 0 ? (q->lost_secs / q->lost + 1.0) * q->lost
+                             / q->queries : 0.0;
+        q->erase = prof->erase;
+        /* Not known: as long as the reflash would wait for it */
+        if (q->erase <= 0.0) {
+                q->erase = opts->timeout_erase;
+                q->erase_bound = 1;
+        }
+        q->write = q->lines * (line + loss);
+        q->project = q->connect + steps * q->rtt_mean + q->erase + q->write;
+}
+
+/**
+ * reflash_qualify - Measure the link to a device, and project how long
+ *                   reflashing it would take
+ * @host:  Host name or address of the device
+ * @img:   Upgrade image to project for
+ * @t:     Kind of device
+ * @opts:  User options, as the reflash would have them
+ * @count: Queries to time one at a time, and again in flight
+ * @q:     Filled in with the measurements and the projection
+ * @stats: Where to record the round trips, or NULL
+ *
+ * Nothing is sent but queries; the device is left as it was found.
+ *
+ * Return: 0 if the device answered, -1 with errno set otherwise,
+ * EOPNOTSUPP if it has no identity query and does not answer the query
+ * at all
+ */
+int
+reflash_qualify(const char *host, const struct srec_image_t *img,
+                const struct reflash_target_t *t,
+                const struct reflash_opts_t *opts, int count,
+                struct reflash_qual_t *q, struct reflash_stats_t *stats)
+{
+        const struct reflash_dialect_t *d = t->dialect;
+        struct reflash_profile_t prof;
+        char reply[DISCOVER_REPLY_MAX] = "";
+        char fw[PROFILE_NAME_MAX];
+        struct reflash_tcp_t *h;
+        double t0 = stats_now(), *rtt;
+        int i, n, err = ETIMEDOUT;
+
+        memset(q, 0, sizeof(*q));
+        snprintf(q->device, sizeof(q->device), "%s", host);
+        stats_init(stats, host);
+        if ((rtt = malloc(count * sizeof(*rtt))) == NULL)
+                return -1;
+        if ((h = tcp_open_timeout(host, opts->connect_timeout,
+                                  stats)) == NULL) {
+                int err = errno;
+
+                stats_finish(stats, "connect failed");
+                free(rtt);
+                errno = err;
+                return -1;
+        }
+        q->connect = stats_now() - t0;
+
+        stats_phase_begin(stats, "qualify");
+        n = qualify_rtt(h, opts, d->ident, q, count, rtt, reply,
+                        sizeof(reply));
+        if (n < 0)
+                err = errno;
+        if (n > 0) {
+                q->rtt_min = rtt[0];
+                q->rtt_p50 = percentile(rtt, n, 0.50);
+                q->rtt_p90 = percentile(rtt, n, 0.90);
+                q->rtt_p99 = percentile(rtt, n, 0.99);
+                q->rtt_max = rtt[n - 1];
+                for (i = 0; i < n; ++i) {
+                        q->rtt_mean += rtt[i] / n;
+                        if (rtt[i] > QUALIFY_STALL * q->rtt_p50)
+                                ++q->stalls;
+                }
+
+                profile_firmware(d->ident != NULL ? reply : NULL, fw,
+                                 sizeof(fw));
+                profile_init(&prof, t, fw);
+                if (profile_load(opts->profiles, &prof) < 0)
+                        profile_init(&prof, t, fw);
+                q->window = !d->pipeline ? 1
+                            : opts->window > 0 ? opts->window : prof.depth;
+                if (q->window > REFLASH_WINDOW_MAX)
+                        q->window = REFLASH_WINDOW_MAX;
+                if (q->window > 1 && qualify_pace(h, opts, q, count) < 0) {
+                        err = errno;
+                        n = -1;
+                } else
+                        qualify_project(q, img, t, opts, &prof);
+        }
+        tcp_close(h);
+        free(rtt);
+        stats_finish(stats, n > 0 ? "qualified"
+                            : n == 0 ? "no reply"
+                            : err == EOPNOTSUPP
+                            ? "query not supported by this target"
+                            : "connection lost");
+        if (n <= 0) {
+                errno = err;
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * qualify_print - Report one device's link qualification
+ * @fp:     Where to
+ * @q:      Measurements, from reflash_qualify()
+ * @format: REFLASH_STATS_TEXT or REFLASH_STATS_JSON.  JSON is one object
+ *          per line.
+ */
+void
+qualify_print(FILE *fp, const struct reflash_qual_t *q, int format)
+{
+        if (format == REFLASH_STATS_JSON) {
+                fprintf(fp, "{\"device\":");
+                stats_json_string(fp, q->device);
+                fprintf(fp, ",\"queries\":%d,\"lost\":%d,\"stalls\":%d,"
+                        "\"rtt_us\":{\"min\":%.0f,\"mean\":%.1f,"
+                        "\"p50\":%.0f,\"p90\":%.0f,\"p99\":%.0f,"
+                        "\"max\":%.0f},\"window\":%d,\"pace_us\":%.1f,"
+                        "\"lines\":%d,\"connect_s\":%.6f,\"erase_s\":%.3f,"
+                        "\"erase_known\":%s,\"write_s\":%.3f,"
+                        "\"projected_s\":%.3f}\n",
+                        q->queries, q->lost, q->stalls,
+                        q->rtt_min * 1e6, q->rtt_mean * 1e6,
+                        q->rtt_p50 * 1e6, q->rtt_p90 * 1e6,
+                        q->rtt_p99 * 1e6, q->rtt_max * 1e6, q->window,
+                        q->pace * 1e6, q->lines, q->connect, q->erase,
+                        q->erase_bound ? "false" : "true", q->write,
+                        q->project);
+                return;
+        }
+        fprintf(fp, "%s: %d queries, %d lost, %d stalled\n", q->device,
+                q->queries, q->lost, q->stalls);
+        fprintf(fp, "  RTT us: min %.0f  p50 %.0f  p90 %.0f  p99 %.0f  "
+                "max %.0f  mean %.1f\n", q->rtt_min * 1e6, q->rtt_p50 * 1e6,
+                q->rtt_p90 * 1e6, q->rtt_p99 * 1e6, q->rtt_max * 1e6,
+                q->rtt_mean * 1e6);
+        if (q->pace > 0.0) {
+                fprintf(fp, "  %d in flight: a reply every %.1f us\n",
+                        q->window, q->pace * 1e6);
+        }
+        fprintf(fp, "  Projected reflash: %.2f s (erase %s%.2f s, "
+                "%d write lines %.2f s)\n", q->project,
+                q->erase_bound ? "unknown, up to " : "", q->erase, q->lines,
+                q->write);
+}
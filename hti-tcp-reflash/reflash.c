@@ -41,218 +41,1078 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
 
-static jmp_buf reflash_env;
+/*
+ * One device's reflash.  It lives in reflash_run()'s frame, outside the
+ * setjmp() in reflash_attempt(), so what it says about the device
+ * survives a failed attempt and the next one can carry on from it.
+ * Where fail() jumps to is kept here too, so any number of runs can go
+ * on at once in different threads.
+ */
+struct reflash_run_t {
+        struct reflash_tcp_t *h;
+        const struct srec_image_t *img;
+        const struct reflash_opts_t *opts;
+        const struct reflash_target_t *t;
+        const struct reflash_dialect_t *d;
+        struct reflash_journal_t *jn;
+        struct srec_wire_t *wire;       /* img as FLASH WRITE commands */
+        int batch;      /* most records per line, 0 when not batching */
+        jmp_buf env;    /* where fail() returns to */
+        int ioerr;      /* the last fail() was the connection's fault */
+        int erased;     /* flash erased for this image */
+        int acked;      /* records acknowledged since */
+        uint32_t want;  /* image checksum, if opts->cksum */
+        int want_ok;    /* @want worked out yet */
+        int identified; /* @prof is for this device's firmware */
+        int tuned;      /* @prof was loaded or probed */
+        struct reflash_profile_t prof;
+};
 
 static void
-fail(const char *fmt, ...)
+fail(struct reflash_run_t *r, const char *fmt, ...)
 {
-        va_list ap;
+        char msg[256];
+        va_list ap, aq;
         va_start(ap, fmt);
+        va_copy(aq, ap);
         vfprintf(stderr, fmt, ap);
+        vsnprintf(msg, sizeof(msg), fmt, aq);
+        va_end(aq);
         va_end(ap);
-        longjmp(reflash_env, 1);
+        capture_note(tcp_capture(r->h), CAPTURE_FAIL, "%s", msg);
+        longjmp(r->env, 1);
 }
 
 static void
-io_error(void)
+io_error(struct reflash_run_t *r)
 {
-        fail("Expected reply from device but received none: (%s)\n",
+        r->ioerr = 1;
+        if (errno == ETIMEDOUT)
+                fail(r, "\nDevice stopped responding: no reply in time\n");
+        fail(r, "Expected reply from device but received none: (%s)\n",
              strerror(errno));
 }
 
-static void
-check_ok(const char *s)
+/*
+ * Unlock, erase and (for SCPI targets) lock-switch check, in order.
+ * The t680 family prints "31" lines while it erases.
+ */
+static const struct reflash_step_t generic_pre[] = {
+        { "unlock", "Unlocking...", "FLASH UNLOCK", "OK", NULL, NULL, 0 },
+        { "erase", "Erasing...", "FLASH ERASE", "OK", NULL, NULL, 1 },
+        { NULL },
+};
+
+static const struct reflash_step_t t680_pre[] = {
+        { "unlock", "Unlocking...", "FLASH UNLOCK", "OK", NULL, NULL, 0 },
+        { "erase", "Erasing...", "FLASH ERASE", "OK", "31", NULL, 1 },
+        { NULL },
+};
+
+static const struct reflash_step_t p900_pre[] = {
+        { "lockcheck", "Checking hardware lock switch", "STATUS:LOCK?", "0",
+          NULL, "Cannot perform flash operations on locked device", 0 },
+        { "unlock", "Unlocking...", "FLASH:UNLOCK;*OPC?", "1", NULL, NULL, 0 },
+        { "erase", "Erasing...", "FLASH:ERASE;*OPC?", "1", NULL, NULL, 1 },
+        { NULL },
+};
+
+static const struct reflash_step_t t500_pre[] = {
+        { "unlock", "Unlocking...", "FLASH:UNLOCK;*OPC?", "1", NULL, NULL, 0 },
+        { "erase", "Erasing...", "FLASH:ERASE;*OPC?", "1", NULL, NULL, 1 },
+        { NULL },
+};
+
+static const struct reflash_step_t no_post[] = {
+        { NULL },
+};
+
+static const struct reflash_step_t scpi_post[] = {
+        { "lock", "Re-locking...", "FLASH:LOCK;*OPC?", "1", NULL, NULL, 0 },
+        { NULL },
+};
+
+static const struct reflash_dialect_t generic_dialect = {
+        .pre = generic_pre,
+        .write_banner = "Reflashing...",
+        .write_fmt = "FLASH WRITE %s",
+        .write_expect = "OK",
+        .pipeline = 1,
+        .post = no_post,
+        .done = "Reflash complete.  "
+                "Reboot the device for changes to take effect.",
+        .checksum = "FLASH CHECKSUM",
+};
+
+static const struct reflash_dialect_t t680_dialect = {
+        .pre = t680_pre,
+        .write_banner = "Reflashing...",
+        .write_fmt = "FLASH WRITE %s",
+        .write_expect = "OK",
+        .pipeline = 1,
+        .post = no_post,
+        .done = "Reflash complete.  "
+                "Reboot the device for changes to take effect.",
+        .checksum = "FLASH CHECKSUM",
+};
+
+static const struct reflash_dialect_t p900_dialect = {
+        .pre = p900_pre,
+        .write_banner = "Writing...",
+        .write_fmt = "FLASH:WRITE \"%s\";*OPC?",
+        .write_expect = "1",
+        .pipeline = 0,
+        .post = scpi_post,
+        .done = "",
+        .checksum = "FLASH:CHECKSUM?",
+        .ident = "*IDN?",
+        .batch_fmt = "FLASH:WRITE \"%s\";",
+        .batch_head = "*CLS;",
+        .batch_tail = "*OPC?;SYST:ERR?",
+        .batch_expect = "1;0,",
+        .batch_line = BATCH_LINE_MAX,
+};
+
+static const struct reflash_dialect_t t500_dialect = {
+        .pre = t500_pre,
+        .write_banner = "Writing...",
+        .write_fmt = "FLASH:WRITE \"%s\";*OPC?",
+        .write_expect = "1",
+        .pipeline = 0,
+        .post = scpi_post,
+        .done = "",
+        .checksum = "FLASH:CHECKSUM?",
+        .ident = "*IDN?",
+        .batch_fmt = "FLASH:WRITE \"%s\";",
+        .batch_head = "*CLS;",
+        .batch_tail = "*OPC?;SYST:ERR?",
+        .batch_expect = "1;0,",
+        .batch_line = BATCH_LINE_MAX,
+};
+
+/*
+ * @addr_bits is the address width of the target's upgrade files: the
+ * ``.s28" targets only take 24-bit S2 addresses.  There are no memory
+ * maps of the products here, so nothing narrower is checked.
+ * @srec_max is the longest S-record the target's line buffer takes,
+ * which bounds the records --reblock makes.  @probe_max bounds the
+ * lengths --probe tries, so that a unit is never sent a line longer
+ * than its buffer is known to be sized for; none is known to take more
+ * than @srec_max yet, so only the window is probed.  @erased is what the
+ * erase is taken to leave in flash, for --skip-erased to leave out; it
+ * is the usual value for NOR flash, not one the products document.
+ */
+static const struct reflash_target_t targets[] = {
+        { "p620", &generic_dialect, 24, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { "p545", &generic_dialect, 24, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { "p470", &generic_dialect, 24, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { "p330", &generic_dialect, 24, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { "t680", &t680_dialect, 24, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { "v120", &t680_dialect, 24, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { "v124", &t680_dialect, 24, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { "p900", &p900_dialect, 32, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { "t500", &t500_dialect, 32, SREC_TEXT_MAX, SREC_TEXT_MAX, 0xff },
+        { NULL, NULL, 0, 0, 0, 0 },
+};
+
+/**
+ * reflash_target - Look up a kind of device by name, "p620" or the like
+ *
+ * Return: The target, or NULL if there is none by that name
+ */
+const struct reflash_target_t *
+reflash_target(const char *name)
+{
+        int i;
+        for (i = 0; targets[i].name != NULL; ++i) {
+                if (!strcmp(name, targets[i].name))
+                        return &targets[i];
+        }
+        return NULL;
+}
+
+/**
+ * reflash_target_fits - Whether all of @img's data has addresses @t's
+ *                       upgrade files can hold
+ */
+int
+reflash_target_fits(const struct reflash_target_t *t,
+                    const struct srec_image_t *img)
 {
-        if (!s)
-                io_error();
+        return t->addr_bits >= 32 || img->hi < (1ul << t->addr_bits);
+}
 
-        if (strncmp(s, "OK", 2) != 0) {
-                /* T680? */
-                if (strncmp(s, "T680", 4) == 0
-                    && strstr(s, "OK") != NULL) {
-                        return;
+/**
+ * reflash_opts_init - Fill in @opts with the defaults: as many records
+ *                     in flight as the profile says, one record per
+ *                     line, no checksum, no journal and no profiles
+ */
+void
+reflash_opts_init(struct reflash_opts_t *opts)
+{
+        memset(opts, 0, sizeof(*opts));
+        opts->window = 0;
+        opts->batch = 1;
+        opts->jobs = REFLASH_JOBS;
+        opts->cksum = REFLASH_CKSUM_NONE;
+        opts->retries = REFLASH_RETRIES;
+        opts->connect_timeout = REFLASH_CONNECT_TIMEOUT;
+        opts->timeout_cmd = REFLASH_TIMEOUT_CMD;
+        opts->timeout_erase = REFLASH_TIMEOUT_ERASE;
+        opts->timeout_write = REFLASH_TIMEOUT_WRITE;
+}
+
+int
+reflash_reply_ok(const char *reply, const char *expect)
+{
+        if (strncmp(reply, expect, strlen(expect)) == 0)
+                return 1;
+        /* T680? */
+        return !strcmp(expect, "OK") && strncmp(reply, "T680", 4) == 0
+               && strstr(reply, "OK") != NULL;
+}
+
+static int
+is_hex_word(const char *p, size_t n, uint32_t *v)
+{
+        size_t i;
+
+        if (n > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+                p += 2;
+                n -= 2;
+        }
+        if (n == 0 || n > 8)
+                return 0;
+        *v = 0;
+        for (i = 0; i < n; ++i) {
+                if (!isxdigit((unsigned char)p[i]))
+                        return 0;
+                *v = (*v << 4) | (isdigit((unsigned char)p[i])
+                                  ? p[i] - '0'
+                                  : (tolower((unsigned char)p[i]) - 'a' + 10));
+        }
+        return 1;
+}
+
+/**
+ * reflash_parse_cksum - Find the checksum in a reply to a checksum query
+ * @reply: Reply line
+ * @sum:   Set to the checksum
+ *
+ * The checksum is the last word of the line that reads as a hex number,
+ * so "OK", "T680" and the like around it are ignored.
+ *
+ * Return: 0 on success, -1 if the line holds no hex number
+ */
+int
+reflash_parse_cksum(const char *reply, uint32_t *sum)
+{
+        static const char *delim = " \t,:=\"";
+        int found = -1;
+
+        reply += strspn(reply, delim);
+        while (*reply != '\0') {
+                size_t n = strcspn(reply, delim);
+                uint32_t v;
+
+                if (is_hex_word(reply, n, &v)) {
+                        *sum = v;
+                        found = 0;
                 }
+                reply += n;
+                reply += strspn(reply, delim);
+        }
+        return found;
+}
+
+int
+reflash_cksum_digits(int algo)
+{
+        return algo == REFLASH_CKSUM_SUM16 ? 4 : 8;
+}
 
-                fail("Unexpected result of FLASH WRITE: %s\n", s);
+/* Shortest FLASH WRITE timeout, seconds */
+#define RTO_MIN 0.5
+
+/**
+ * reflash_rto_init - Start estimating the FLASH WRITE timeout
+ * @e:   Estimator
+ * @max: Timeout until the first sample, and upper bound after that
+ */
+void
+reflash_rto_init(struct reflash_rto_t *e, double max)
+{
+        e->srtt = 0.0;
+        e->rttvar = 0.0;
+        e->max = max;
+}
+
+/**
+ * reflash_rto_sample - Account for one reply, @rtt seconds after its
+ *                      command was sent
+ *
+ * As RFC 6298 does for TCP: the mean deviation first, against the old
+ * smoothed RTT, then the smoothed RTT itself.
+ */
+void
+reflash_rto_sample(struct reflash_rto_t *e, double rtt)
+{
+        double dev;
+
+        if (e->srtt == 0.0) {
+                e->srtt = rtt;
+                e->rttvar = rtt / 2.0;
+                return;
         }
+        dev = e->srtt > rtt ? e->srtt - rtt : rtt - e->srtt;
+        e->rttvar += (dev - e->rttvar) / 4.0;
+        e->srtt += (rtt - e->srtt) / 8.0;
 }
 
-static void
-generic_flash_write(struct reflash_tcp_t *h, FILE *fp)
+/**
+ * reflash_rto - How long a FLASH WRITE reply may take: SRTT + 4 RTTVAR,
+ *               within RTO_MIN and @e->max
+ */
+double
+reflash_rto(const struct reflash_rto_t *e)
 {
-        char srec[256];
-        int lineno = 0;
+        double rto = e->srtt + 4.0 * e->rttvar;
 
-        fseek(fp, 0, SEEK_SET);
-        printf("writing line         ");
-        do {
-                char *end, *s;
+        if (e->srtt == 0.0 || rto > e->max)
+                return e->max;
+        if (rto < RTO_MIN)
+                return RTO_MIN < e->max ? RTO_MIN : e->max;
+        return rto;
+}
 
-                printf("\033[8D%8d", lineno);
-                ++lineno;
 
-                if ((s = fgets(srec, sizeof(srec), fp)) == NULL) {
-                        if (feof(fp))
-                                break;
-                        fclose(fp);
-                        fail("\nfgets() returned NULL\n");
-                }
-                end = &s[strlen(s) - 1];
-                while ((*end == '\n' || *end == '\r') && end > s) {
-                        *end = '\0';
-                        --end;
+/*
+ * Pipelined FLASH WRITE
+ *
+ * Up to @cwnd records are on the wire at once.  The device answers each
+ * command with exactly one line, in order, so the oldest record in the
+ * ring is always the one the next reply belongs to.
+ *
+ * @cwnd starts at 1, or right at the depth in the device's profile, and
+ * opens by one record per window's worth of good replies, up to
+ * @maxwnd.  It stops opening, and closes again, once the smoothed RTT
+ * shows records queueing up in the device rather than on the wire.
+ * Any non-OK reply to a record that was sent while others were
+ * outstanding is taken to mean the target cannot keep up: the remaining
+ * replies are drained, @maxwnd is halved, and everything still in the
+ * ring is resent starting from the failed record at window 1.
+ * Re-writing a record with the same data is harmless.  Only a non-OK
+ * reply to a record that was alone on the wire is fatal.
+ *
+ * The struct wr_pipe_t is kept apart from the I/O, so that fleet.c
+ * drives the same window one reply at a time.
+ */
+
+/**
+ * wr_pipe_init - Get ready to write with up to @window records in flight
+ * @p:      Window to set up
+ * @d:      Dialect of the target
+ * @window: struct reflash_opts_t @window
+ * @prof:   Profile of the device
+ * @tuned:  Nonzero if @prof was found, not guessed: the window starts at
+ *          its depth, and the timeout from its round trip
+ * @max:    struct reflash_opts_t @timeout_write
+ */
+void
+wr_pipe_init(struct wr_pipe_t *p, const struct reflash_dialect_t *d,
+             int window, const struct reflash_profile_t *prof, int tuned,
+             double max)
+{
+        memset(p, 0, sizeof(*p));
+        reflash_rto_init(&p->rto, max);
+        p->maxwnd = !d->pipeline ? 1 : window > 0 ? window : prof->depth;
+        if (p->maxwnd < 1)
+                p->maxwnd = 1;
+        else if (p->maxwnd > REFLASH_WINDOW_MAX)
+                p->maxwnd = REFLASH_WINDOW_MAX;
+        /* A tuned device starts at full speed, not from one record */
+        p->cwnd = 1;
+        if (tuned) {
+                p->cwnd = prof->depth < p->maxwnd ? prof->depth : p->maxwnd;
+                if (p->cwnd < 1)
+                        p->cwnd = 1;
+                if (prof->rtt > 0.0)
+                        reflash_rto_sample(&p->rto, prof->rtt);
+        }
+}
+
+/* Slot @i of @p, counting from the oldest record not yet acknowledged */
+struct wr_slot_t *
+wr_pipe_slot(struct wr_pipe_t *p, int i)
+{
+        return &p->slot[(p->head + i) % REFLASH_WINDOW_MAX];
+}
+
+/* The oldest record got its good reply, @rtt seconds after it was sent */
+void
+wr_pipe_ack(struct wr_pipe_t *p, double rtt)
+{
+        if (p->min_rtt == 0.0 || rtt < p->min_rtt)
+                p->min_rtt = rtt;
+        reflash_rto_sample(&p->rto, rtt);
+        p->head = (p->head + 1) % REFLASH_WINDOW_MAX;
+        p->count--;
+        p->nsent--;
+
+        if (p->rto.srtt > 4.0 * p->min_rtt) {
+                if (p->cwnd > 1) {
+                        p->cwnd--;
+                        p->nacked = 0;
                 }
+        } else if (++p->nacked >= p->cwnd && p->cwnd < p->maxwnd
+                   && p->rto.srtt < 2.0 * p->min_rtt) {
+                p->cwnd++;
+                p->nacked = 0;
+        }
+}
 
-                check_ok(tcp_io(h, "FLASH WRITE %s", srec));
-        } while (!feof(fp));
-        putchar('\n');
+/*
+ * A record sent with others in flight was rejected, and the replies to
+ * the others are drained: send everything in the ring again, one at a
+ * time to begin with, and never again as many as that.
+ */
+void
+wr_pipe_backoff(struct wr_pipe_t *p, struct reflash_profile_t *prof)
+{
+        p->nsent = 0;
+        p->maxwnd = p->cwnd > 1 ? p->cwnd / 2 : 1;
+        p->cwnd = 1;
+        /* The profile promised too much */
+        if (p->maxwnd < prof->depth)
+                prof->depth = p->maxwnd;
+        p->nacked = 0;
 }
 
-static int
-generic_flash_erase(struct reflash_tcp_t *h)
+static void
+wr_backoff(struct reflash_run_t *r, struct wr_pipe_t *p, const char *reply)
 {
-        check_ok(tcp_io(h, "FLASH ERASE"));
-        return 0;
+        struct reflash_tcp_t *h = r->h;
+        int i;
+
+        fprintf(stderr, "\nFLASH WRITE rejected with %d in flight, "
+                "retrying at window 1: %s\n", p->nsent, reply);
+        for (i = 1; i < p->nsent; ++i) {
+                tcp_deadline(h, stats_now() + reflash_rto(&p->rto));
+                if (tcp_getline(h) == NULL)
+                        io_error(r);
+        }
+        wr_pipe_backoff(p, &r->prof);
 }
 
-static int
-t680_flash_erase(struct reflash_tcp_t *h)
+static void
+flash_write(struct reflash_run_t *r)
 {
-        tcp_io_sendonly(h, "FLASH ERASE");
+        struct reflash_tcp_t *h = r->h;
+        const struct srec_image_t *img = r->img;
+        const struct reflash_dialect_t *d = r->d;
+        struct reflash_stats_t *stats = tcp_stats(h);
+        struct reflash_progress_t pr;
+        struct wr_pipe_t p;
+        int recno = r->acked;
+
+        wr_pipe_init(&p, d, r->opts->window, &r->prof, r->tuned,
+                     r->opts->timeout_write);
+
+        progress_init(&pr, tcp_node(h), img, 1);
+        progress_skip(&pr, img, 0, r->acked);
         for (;;) {
-                const char *line = tcp_getline(h);
-                if (line == NULL)
-                        io_error();
+                struct wr_slot_t *sl;
+                const char *reply, *cmd;
+                size_t len;
+                double rtt;
+
+                while (recno < img->nrec && p.count < p.cwnd) {
+                        sl = wr_pipe_slot(&p, p.count);
+                        sl->recno = recno++;
+                        p.count++;
+                }
 
-                if (strstr(line, "OK")) {
+                if (p.nsent < p.count && p.nsent < p.cwnd) {
+                        tcp_deadline(h, stats_now() + reflash_rto(&p.rto));
+                        while (p.nsent < p.count && p.nsent < p.cwnd) {
+                                sl = wr_pipe_slot(&p, p.nsent);
+                                sl->alone = p.nsent == 0;
+                                sl->sent = stats_now();
+                                cmd = srec_wire_cmd(r->wire, sl->recno, &len);
+                                if (tcp_queue_buf(h, cmd, len) < 0)
+                                        io_error(r);
+                                p.nsent++;
+                        }
+                        if (tcp_flush(h) < 0)
+                                io_error(r);
+                }
+
+                if (p.nsent == 0)
                         break;
-                } else if (strstr(line, "31") == NULL)  {
-                        fail("Unexpected result of FLASH ERASE: '%s'\n", line);
+
+                /* Replies come in order: the oldest record is due first */
+                sl = wr_pipe_slot(&p, 0);
+                tcp_deadline(h, sl->sent + reflash_rto(&p.rto));
+                if ((reply = tcp_getline(h)) == NULL)
+                        io_error(r);
+                if (!reflash_reply_ok(reply, d->write_expect)) {
+                        if (sl->alone) {
+                                fail(r, "\nUnexpected result of "
+                                     "FLASH WRITE: %s\n",
+                                     reply);
+                        }
+                        wr_backoff(r, &p, reply);
+                        continue;
                 }
+
+                progress_ack(&pr, img->rec[sl->recno].len);
+                rtt = stats_now() - sl->sent;
+                stats_rtt(stats, rtt);
+                if (stats != NULL)
+                        stats->records++;
+                r->acked = sl->recno + 1;
+                journal_ack(r->jn, r->acked);
+                wr_pipe_ack(&p, rtt);
         }
-        return 0;
+        progress_end(&pr);
+        if (p.rto.srtt > 0.0)
+                r->prof.rtt = p.rto.srtt;
 }
 
-static int
-generic_flash_unlock(struct reflash_tcp_t *h)
+/*
+ * Batched FLASH:WRITE
+ *
+ * A target that cannot pipeline still takes several writes on one
+ * line, and one reply for all of them: as many as fit its input
+ * buffer, up to @r->batch.  The line clears the error queue first and
+ * reads it last, so the reply tells whether any of the writes failed,
+ * though not which.  When a batch fails, or gets no reply at all, the
+ * run goes on one record per line from the first record of the batch,
+ * so that if the failure is real, the error names its record.
+ */
+static void
+batch_fallback(struct reflash_run_t *r, int n, const char *why)
 {
-        check_ok(tcp_io(h, "FLASH UNLOCK"));
-        return 0;
+        fprintf(stderr, "\nBatch of %d records failed, writing one at a "
+                "time: %s\n", n, why);
+        r->batch = 1;
 }
 
-static int
-generic_reflash_(struct reflash_tcp_t *h, FILE *fp,
-                 int (*ers)(struct reflash_tcp_t *))
+static void
+flash_write_batch(struct reflash_run_t *r)
 {
-        if (setjmp(reflash_env) != 0) {
-                fprintf(stderr, "Reflash failed\n");
-                return -1;
+        struct reflash_tcp_t *h = r->h;
+        const struct srec_image_t *img = r->img;
+        const struct reflash_dialect_t *d = r->d;
+        struct reflash_stats_t *stats = tcp_stats(h);
+        struct reflash_progress_t pr;
+        struct reflash_rto_t rto;
+        char line[BATCH_LINE_MAX + 1];
+        const char *reply;
+        double sent, rtt;
+        size_t len;
+        int i, n;
+
+        /* A profile's round trip is one record's, too short for a batch */
+        reflash_rto_init(&rto, r->opts->timeout_write);
+        progress_init(&pr, tcp_node(h), img, 1);
+        progress_skip(&pr, img, 0, r->acked);
+        while (r->acked < img->nrec) {
+                n = srec_wire_batch(r->wire, r->acked, r->batch,
+                                    d->batch_head, d->batch_tail,
+                                    d->batch_line, line, &len);
+                if (n == 0) {
+                        fail(r, "\nRecord %d does not fit the device's "
+                             "input buffer\n", r->acked);
+                }
+                sent = stats_now();
+                tcp_deadline(h, sent + reflash_rto(&rto));
+                if (tcp_queue_buf(h, line, len) < 0 || tcp_flush(h) < 0)
+                        io_error(r);
+                if ((reply = tcp_getline(h)) == NULL) {
+                        /* Perhaps too long for the device after all */
+                        if (errno == ETIMEDOUT && n > 1)
+                                batch_fallback(r, n, "no reply");
+                        io_error(r);
+                }
+                if (!reflash_reply_ok(reply, d->batch_expect)) {
+                        if (n == 1) {
+                                fail(r, "\nUnexpected result of FLASH WRITE "
+                                     "(record %d): %s\n", r->acked, reply);
+                        }
+                        batch_fallback(r, n, reply);
+                        continue;
+                }
+
+                rtt = stats_now() - sent;
+                reflash_rto_sample(&rto, rtt);
+                stats_rtt(stats, rtt);
+                for (i = 0; i < n; ++i)
+                        progress_ack(&pr, img->rec[r->acked + i].len);
+                if (stats != NULL)
+                        stats->records += n;
+                r->acked += n;
+                journal_ack(r->jn, r->acked);
         }
+        progress_end(&pr);
+}
 
-        printf("Unlocking...\n");
-        generic_flash_unlock(h);
-        printf("Erasing...\n");
-        ers(h);
-        printf("Reflashing...\n");
-        generic_flash_write(h, fp);
-        printf("Reflash complete.  Reboot the device for changes to take effect.\n");
-        return 0;
+/*
+ * Preparation
+ *
+ * What a run works out from the image, its checksum and its write
+ * commands, is worked out while the device is busy instead of before:
+ * the checksum once the device is asked for its own, and the commands
+ * once it is told to erase, so the first write goes out as soon as the
+ * erase is acknowledged.  A device that already holds the image never
+ * needs the commands at all.
+ */
+static void
+prepare_cksum(struct reflash_run_t *r)
+{
+        if (r->want_ok)
+                return;
+        r->want = srec_checksum(r->img, r->opts->cksum);
+        r->want_ok = 1;
 }
 
-int
-generic_reflash(struct reflash_tcp_t *h, FILE *fp)
+static void
+prepare_writes(struct reflash_run_t *r)
 {
-        return generic_reflash_(h, fp, generic_flash_erase);
+        if (r->wire != NULL)
+                return;
+        r->wire = srec_wire(r->img, r->batch ? r->d->batch_fmt
+                                             : r->d->write_fmt);
+        if (r->wire == NULL)
+                fail(r, "Cannot encode the records: %s\n", strerror(errno));
 }
 
-int
-t680_reflash(struct reflash_tcp_t *h, FILE *fp)
+/* Progress lines do not extend the step's time budget */
+static void
+run_step(struct reflash_run_t *r, const struct reflash_step_t *st)
 {
-        return generic_reflash_(h, fp, t680_flash_erase);
+        struct reflash_tcp_t *h = r->h;
+        const struct reflash_opts_t *opts = r->opts;
+        double budget = opts->timeout_cmd;
+        const char *line;
+
+        if (st->erase) {
+                budget = profile_erase_timeout(&r->prof, opts->timeout_cmd,
+                                               opts->timeout_erase);
+        }
+        printf("%s\n", st->banner);
+        stats_phase_begin(tcp_stats(h), st->phase);
+        tcp_deadline(h, stats_now() + budget);
+        if (tcp_io_sendonly(h, "%s", st->cmd) < 0)
+                io_error(r);
+        if (st->erase)
+                prepare_writes(r);
+        for (;;) {
+                if ((line = tcp_getline(h)) == NULL)
+                        io_error(r);
+                if (reflash_reply_ok(line, st->expect)) {
+                        stats_phase_end(tcp_stats(h));
+                        return;
+                }
+                if (st->progress == NULL || strstr(line, st->progress) == NULL)
+                        break;
+        }
+        if (st->errmsg != NULL)
+                fail(r, "%s\n", st->errmsg);
+        fail(r, "Unexpected result of %s: '%s'\n", st->cmd, line);
 }
 
+/* Return the device's flash checksum, or -1 if the reply has none */
 static int
-check_str(const char *s, const char *expect, const char *altmsg)
+device_cksum(struct reflash_run_t *r, uint32_t *sum, const char **reply)
 {
-        if (!s)
-                io_error();
-        if (strncmp(s, expect, strlen(expect)) != 0) {
-                if (altmsg)
-                        fail("%s\n", altmsg);
-                else
-                        fail("Unexpected result: %s\n", s);
+        double t0 = stats_now();
+
+        tcp_deadline(r->h, t0 + r->opts->timeout_cmd);
+        if (tcp_io_sendonly(r->h, "%s", r->d->checksum) < 0)
+                io_error(r);
+        prepare_cksum(r);
+        if ((*reply = tcp_getline(r->h)) == NULL)
+                io_error(r);
+        stats_rtt(tcp_stats(r->h), stats_now() - t0);
+        return reflash_parse_cksum(*reply, sum);
+}
+
+static void
+print_profile(const char *what, const struct reflash_profile_t *p)
+{
+        printf("%s %s/%s: records up to %d characters, %d in flight, "
+               "%.1f ms round trip\n", what, p->model, p->firmware,
+               p->srec_max, p->depth, p->rtt * 1e3);
+}
+
+/* Find out the firmware, and look up its profile unless probing */
+static void
+identify(struct reflash_run_t *r)
+{
+        const char *reply = NULL;
+        char fw[PROFILE_NAME_MAX];
+
+        if (r->d->ident != NULL) {
+                tcp_deadline(r->h, stats_now() + r->opts->timeout_cmd);
+                if ((reply = tcp_io(r->h, "%s", r->d->ident)) == NULL)
+                        io_error(r);
+        }
+        profile_firmware(reply, fw, sizeof(fw));
+        profile_init(&r->prof, r->t, fw);
+        r->identified = 1;
+        if (!r->opts->probe && profile_load(r->opts->profiles, &r->prof) == 0) {
+                r->tuned = 1;
+                print_profile("Profile", &r->prof);
         }
 }
 
+/*
+ * Probing
+ *
+ * Only with --probe.  The probes are S0 header records, which targets
+ * take and ignore, sent with the dialect's write command once the flash
+ * is unlocked, before it is erased, so that a device that takes them
+ * badly still holds its firmware.  First one at a time, at lengths
+ * bisecting the range from what the target is known to take up to its
+ * @probe_max, then, if the dialect pipelines, in bursts of twice as
+ * many each time.  A reply other than the write's acknowledgement is a
+ * rejection, and so is none at all: SCPI targets drop a line too long
+ * for their input buffer without a word.  A reply could still come
+ * late, and be taken for the next probe's, so the connection is made
+ * again after a probe goes unanswered, and the flash unlocked again.
+ * The round trips of the lone probes go into the profile as well.
+ */
+
+/* Start over on a new connection, with the steps before the erase */
 static void
-scpi_flash_write(struct reflash_tcp_t *h, FILE *fp)
-{
-        char srec[256];
-        int lineno = 0;
-
-        fseek(fp, 0, SEEK_SET);
-        printf("writing line         ");
-        fflush(stdout);
-        do {
-                char *end, *s;
-                printf("\033[8D%8d", lineno);
-                ++lineno;
-
-                if ((s = fgets(srec, sizeof(srec), fp)) == NULL) {
-                        if (feof(fp))
-                                break;
-                        fclose(fp);
-                        fail("\nfgets() returned NULL\n");
-                }
-                end = &s[strlen(s) - 1];
-                while ((*end == '\n' || *end == '\r') && end > s) {
-                        *end = '\0';
-                        --end;
+probe_resync(struct reflash_run_t *r)
+{
+        const struct reflash_step_t *st;
+
+        printf("No reply to the probe, connecting again\n");
+        if (tcp_reconnect(r->h) < 0)
+                io_error(r);
+        for (st = r->d->pre; st->cmd != NULL; ++st) {
+                if (!st->erase)
+                        run_step(r, st);
+        }
+}
+
+static int
+probe_send(struct reflash_run_t *r, struct reflash_rto_t *rto, int len,
+           int count)
+{
+        unsigned char data[SREC_TEXT_LIMIT / 2];
+        char text[SREC_TEXT_LIMIT + 1], cmd[SREC_TEXT_LIMIT + 64];
+        static const char tag[] = "hti-tcp-reflash probe ";
+        struct srec_image_t img;
+        struct srec_rec_t rec;
+        const char *reply;
+        double sent;
+        int i, n, ok = 0;
+
+        /* "S0" + count + 2 address bytes + data + checksum, in hex */
+        memset(&rec, 0, sizeof(rec));
+        rec.type = '0';
+        rec.len = (len - 10) / 2;
+        for (i = 0; i < rec.len; ++i)
+                data[i] = tag[i % (sizeof(tag) - 1)];
+        memset(&img, 0, sizeof(img));
+        img.data = data;
+        srec_format(&img, &rec, text);
+        n = snprintf(cmd, sizeof(cmd) - 1, r->d->write_fmt, text);
+        cmd[n++] = '\r';
+
+        for (i = 0; i < count; ++i) {
+                if (tcp_queue_buf(r->h, cmd, n) < 0)
+                        io_error(r);
+        }
+        sent = stats_now();
+        if (tcp_flush(r->h) < 0)
+                io_error(r);
+        for (i = 0; i < count; ++i) {
+                tcp_deadline(r->h, stats_now() + reflash_rto(rto));
+                if ((reply = tcp_getline(r->h)) == NULL) {
+                        if (errno != ETIMEDOUT)
+                                io_error(r);
+                        probe_resync(r);
+                        return 0;
                 }
-                if (end == s)
-                        continue;
+                if (reflash_reply_ok(reply, r->d->write_expect))
+                        ++ok;
+        }
+        if (count == 1 && ok)
+                reflash_rto_sample(rto, stats_now() - sent);
+        return ok;
+}
+
+static void
+probe(struct reflash_run_t *r)
+{
+        struct reflash_profile_t *p = &r->prof;
+        struct reflash_rto_t rto;
+        int lo = r->t->srec_max, hi = r->t->probe_max;
+        int k;
+
+        printf("Probing...\n");
+        stats_phase_begin(tcp_stats(r->h), "probe");
+        reflash_rto_init(&rto, r->opts->timeout_cmd);
+        if (probe_send(r, &rto, lo, 1) != 1) {
+                printf("Probe rejected, keeping the defaults\n");
+                stats_phase_end(tcp_stats(r->h));
+                return;
+        }
+        /* @lo is taken and nothing longer than @hi can be */
+        while (lo < hi) {
+                int mid = (lo / 2 + hi / 2 + 1) / 2 * 2;
+
+                if (probe_send(r, &rto, mid, 1) == 1)
+                        lo = mid;
+                else
+                        hi = mid - 2;
+        }
+        p->srec_max = lo;
+        p->depth = 1;
+        for (k = 2; r->d->pipeline && k <= REFLASH_WINDOW_MAX; k *= 2) {
+                if (probe_send(r, &rto, p->srec_max, k) != k)
+                        break;
+                p->depth = k;
+        }
+        p->rtt = rto.srtt;
+        stats_phase_end(tcp_stats(r->h));
+        print_profile("Probed", p);
+}
 
-                check_str(tcp_io(h, "FLASH:WRITE \"%s\";*OPC?", srec),
-                          "1", NULL);
-        } while (!feof(fp));
-        putchar('\n');
+/* Probe, if asked to and not done yet, and keep what was found */
+static void
+tune(struct reflash_run_t *r)
+{
+        if (r->opts->profiles == NULL || !r->opts->probe || r->tuned)
+                return;
+        probe(r);
+        r->tuned = 1;
+        profile_save(r->opts->profiles, r->t, &r->prof);
 }
 
 static int
-scpi_reflash(struct reflash_tcp_t *h, FILE *fp, int check_lock)
+reflash_attempt(struct reflash_run_t *r)
 {
-        if (setjmp(reflash_env) != 0) {
-                fprintf(stderr, "Reflash failed\n");
+        struct reflash_tcp_t *h = r->h;
+        const struct reflash_dialect_t *d = r->d;
+        struct reflash_stats_t *stats = tcp_stats(h);
+        const struct reflash_step_t *st;
+        const char *reply;
+        uint32_t have;
+        int digits = reflash_cksum_digits(r->opts->cksum);
+
+        r->ioerr = 0;
+        if (setjmp(r->env) != 0)
                 return -1;
+
+        if (r->opts->profiles != NULL && !r->identified)
+                identify(r);
+
+        /* Once erased, the device cannot match until written again */
+        if (r->opts->cksum != REFLASH_CKSUM_NONE && !r->erased) {
+                printf("Checking device checksum...\n");
+                stats_phase_begin(stats, "check");
+                if (device_cksum(r, &have, &reply) < 0) {
+                        printf("No checksum in reply '%s', reflashing\n",
+                               reply);
+                } else if (have == r->want) {
+                        printf("Device already holds this image "
+                               "(checksum %0*lX).  Nothing to do.\n",
+                               digits, (unsigned long)r->want);
+                        stats_finish(stats, "current");
+                        return 0;
+                } else {
+                        printf("Device checksum %0*lX, image %0*lX\n",
+                               digits, (unsigned long)have,
+                               digits, (unsigned long)r->want);
+                }
+                stats_phase_end(stats);
         }
-        const char *s;
 
-        if (check_lock) {
-                printf("Checking hardware lock switch\n");
-                check_str(tcp_io(h, "STATUS:LOCK?"), "0",
-                          "Cannot perform flash operations on locked device");
+        for (st = d->pre; st->cmd != NULL; ++st) {
+                double t0;
+
+                if (st->erase && r->erased)
+                        continue;
+                if (st->erase)
+                        tune(r);
+                t0 = stats_now();
+                run_step(r, st);
+                if (st->erase) {
+                        r->prof.erase = stats_now() - t0;
+                        r->erased = 1;
+                        r->acked = 0;
+                        journal_erased(r->jn);
+                }
+        }
+        /* The erase was skipped: before writing, then */
+        tune(r);
+        if (r->acked > 0) {
+                printf("Resuming at record %d of %d\n",
+                       r->acked, r->img->nrec);
         }
-        printf("Unlocking...\n");
-        check_str(tcp_io(h, "FLASH:UNLOCK;*OPC?"), "1", NULL);
-        printf("Erasing...\n");
-        check_str(tcp_io(h, "FLASH:ERASE;*OPC?"), "1", NULL);
-        printf("Writing...\n");
-        scpi_flash_write(h, fp);
-        printf("Re-locking...\n");
-        check_str(tcp_io(h, "FLASH:LOCK;*OPC?"), "1", NULL);
-        putchar('\n');
+        /* Only if the erase was skipped */
+        prepare_writes(r);
+        printf("%s\n", d->write_banner);
+        stats_phase_begin(stats, "write");
+        if (r->batch)
+                flash_write_batch(r);
+        else
+                flash_write(r);
+        stats_phase_end(stats);
+        if (r->opts->cksum != REFLASH_CKSUM_NONE) {
+                printf("Verifying...\n");
+                stats_phase_begin(stats, "verify");
+                if (device_cksum(r, &have, &reply) < 0)
+                        fail(r, "No checksum in reply '%s'\n", reply);
+                if (have != r->want) {
+                        fail(r, "Checksum mismatch after write: "
+                             "device %0*lX, image %0*lX\n",
+                             digits, (unsigned long)have,
+                             digits, (unsigned long)r->want);
+                }
+                stats_phase_end(stats);
+        }
+        for (st = d->post; st->cmd != NULL; ++st)
+                run_step(r, st);
+        /* Keep the latest round trip and erase time for next time */
+        if (r->opts->profiles != NULL)
+                profile_save(r->opts->profiles, r->t, &r->prof);
+        printf("%s\n", d->done);
+        stats_finish(stats, "ok");
         return 0;
 }
 
-int
-p900_reflash(struct reflash_tcp_t *h, FILE *fp)
+/* Wait, then reconnect, up to the retries left; return 0 if connected */
+static int
+reflash_reconnect(struct reflash_run_t *r, int *tries)
+{
+        while (*tries < r->opts->retries) {
+                int delay = *tries < 3 ? 1 << *tries : 8;
+
+                ++*tries;
+                fprintf(stderr, "Connection lost, reconnecting in %d s "
+                        "(attempt %d of %d)\n",
+                        delay, *tries, r->opts->retries);
+                sleep(delay);
+                if (tcp_reconnect(r->h) == 0)
+                        return 0;
+        }
+        return -1;
+}
+
+/*
+ * Run attempts until one succeeds, fails for a reason other than the
+ * connection, or the retries run out without a record getting through.
+ * Each attempt after the erase skips it and writes on from the first
+ * unacknowledged record.
+ */
+static int
+reflash_run(struct reflash_tcp_t *h, const struct srec_image_t *img,
+            const struct reflash_opts_t *opts,
+            const struct reflash_target_t *t)
 {
-        return scpi_reflash(h, fp, 1);
+        const struct reflash_dialect_t *d = t->dialect;
+        struct reflash_run_t r;
+        int res, tries = 0;
+
+        memset(&r, 0, sizeof(r));
+        r.h = h;
+        r.img = img;
+        r.opts = opts;
+        r.t = t;
+        r.d = d;
+        profile_init(&r.prof, t, "unknown");
+        if (d->batch_fmt != NULL && opts->batch != 1)
+                r.batch = opts->batch > 0 ? opts->batch : INT_MAX;
+        r.jn = journal_open(opts->journal, tcp_node(h), srec_hash(img),
+                            img->nrec, opts->cksum != REFLASH_CKSUM_NONE);
+        if ((r.acked = journal_resume(r.jn)) >= 0) {
+                r.erased = 1;
+                printf("Journal: %d of %d records already written "
+                       "after erasing, not erasing again\n",
+                       r.acked, img->nrec);
+        } else {
+                r.acked = 0;
+        }
+
+        for (;;) {
+                int acked = r.acked;
+
+                res = reflash_attempt(&r);
+                if (res == 0 || !r.ioerr)
+                        break;
+                /* The retries are per outage, not for the whole run */
+                if (r.acked > acked)
+                        tries = 0;
+                if (reflash_reconnect(&r, &tries) < 0)
+                        break;
+        }
+        if (res < 0) {
+                fprintf(stderr, "Reflash failed\n");
+                if (r.erased && r.jn != NULL) {
+                        fprintf(stderr, "%d of %d records written; run "
+                                "again to resume\n", r.acked, img->nrec);
+                }
+                stats_finish(tcp_stats(h), "failed");
+        }
+        journal_close(r.jn, res == 0);
+        srec_wire_free(r.wire);
+        return res;
 }
 
+/**
+ * reflash_device - Reflash one device, start to finish
+ * @host:  Host name or address of the device
+ * @img:   Upgrade image
+ * @t:     Kind of device
+ * @opts:  User options
+ * @stats: Where to record how the time went, or NULL
+ *
+ * Progress goes to stdout and errors to stderr, as hti-tcp-reflash
+ * shows them.
+ *
+ * Return: 0 if the device holds @img, now or already, -1 otherwise
+ */
 int
-t500_reflash(struct reflash_tcp_t *h, FILE *fp)
+reflash_device(const char *host, const struct srec_image_t *img,
+               const struct reflash_target_t *t,
+               const struct reflash_opts_t *opts,
+               struct reflash_stats_t *stats)
 {
-        return scpi_reflash(h, fp, 0);
+        struct reflash_capture_t *cap = NULL;
+        struct reflash_tcp_t *h;
+        char path[PATH_MAX];
+        int res;
+
+        stats_init(stats, host);
+        h = tcp_open_timeout(host, opts->connect_timeout, stats);
+        if (h == NULL) {
+                perror("TCP open failed");
+                stats_finish(stats, "connect failed");
+                return -1;
+        }
+        if (opts->capture != NULL && (cap = capture_new(host)) == NULL)
+                perror("capture");
+        tcp_set_capture(h, cap);
+        printf("Wait\n");
+        res = reflash_run(h, img, opts, t);
+        tcp_close(h);
+        if (cap != NULL) {
+                if (capture_save(cap, opts->capture, path, sizeof(path)) < 0)
+                        perror(path);
+                else
+                        fprintf(stderr, "Transcript saved to %s\n", path);
+                capture_free(cap);
+        }
+        return res;
 }
@@ -35,22 +35,500 @@
 #ifndef P620_REFLASH_H
 #define  P620_REFLASH_H
 
+#include "htireflash.h"
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 struct reflash_tcp_t;
+struct addrinfo;
+
+#define HTI_SERVICE "2000"
+
+enum {
+        HTI_PORT = 2000,
+        /* Longest S-record the targets' line buffers accept */
+        SREC_TEXT_MAX = 254,
+        /* Longest S-record there can be, with a count byte of 255 */
+        SREC_TEXT_LIMIT = 514,
+        /* Flash word srec_skip_erased() trims in, in bytes */
+        SREC_ERASED_ALIGN = 4,
+        /* Most addresses of one host connect_race_start() tries */
+        CONNECT_MAX = 8,
+        /* Longest batched write line any dialect takes, '\r' excluded */
+        BATCH_LINE_MAX = 1024,
+        /* Bytes of wire transcript kept per device, the latest ones */
+        CAPTURE_RING = 1 << 20,
+        /* Longest line a transcript entry holds */
+        CAPTURE_TEXT_MAX = 8192,
+        /* Longest model or firmware name in a profile, nul included */
+        PROFILE_NAME_MAX = 64,
+        /* Addresses discover_sweep() probes at once, by default */
+        DISCOVER_JOBS = 4096,
+        /* Seconds each address has, by default */
+        DISCOVER_TIMEOUT = 2,
+        DISCOVER_REPLY_MAX = 128,
+        DISCOVER_NAME_MAX = 256,
+        /* Queries reflash_qualify() times one at a time, by default */
+        QUALIFY_COUNT = 50,
+        /* Times the median round trip a stalled reply takes */
+        QUALIFY_STALL = 4,
+};
+
+/**
+ * struct srec_rec_t - One decoded S-record
+ * @type:   Record type, '0' to '9'
+ * @len:    Number of data bytes
+ * @addr:   Address field
+ * @off:    Offset of the data bytes in the image's @data
+ * @lineno: Line of the file the record came from
+ */
+struct srec_rec_t {
+        char type;
+        unsigned char len;
+        uint32_t addr;
+        size_t off;
+        int lineno;
+};
+
+/**
+ * struct srec_image_t - A whole upgrade file, decoded and checked
+ * @rec:      Records in file order
+ * @nrec:     Number of entries in @rec
+ * @data:     Data bytes of every record
+ * @ndata:    Number of bytes in @data
+ * @ndatarec: How many of the records are S1, S2 or S3 data records
+ * @byaddr:   Indexes into @rec of the data records, by ascending address
+ * @lo:       Lowest address written by a data record
+ * @hi:       Highest address written by a data record
+ */
+struct srec_image_t {
+        struct srec_rec_t *rec;
+        int nrec;
+        unsigned char *data;
+        size_t ndata;
+        int ndatarec;
+        int *byaddr;
+        uint32_t lo;
+        uint32_t hi;
+};
+
+/**
+ * struct srec_wire_t - An image's records as ready-to-send write commands
+ * @buf:  Every command, '\r' included, back to back
+ * @off:  @nrec + 1 offsets into @buf: command i runs from @off[i] up to
+ *        @off[i + 1]
+ * @nrec: Number of records
+ */
+struct srec_wire_t {
+        char *buf;
+        size_t *off;
+        int nrec;
+};
+
+/**
+ * struct reflash_progress_t - Progress of writing records, shown at
+ *                             PROGRESS_HZ
+ * @device:      Device name for the JSON ticks, or NULL
+ * @json:        Nonzero for a JSON object per tick, zero for a status
+ *               line redrawn in place
+ * @shown:       Whether the status line is on the screen
+ * @total:       Records to write, in all
+ * @total_bytes: Data bytes in those records
+ * @done:        Records written or skipped so far
+ * @bytes:       Data bytes in @done
+ * @start:       stats_now() at progress_init()
+ * @next:        stats_now() when the next tick is due
+ * @last:        stats_now() at the last tick
+ * @last_done:   @done at the last tick
+ * @last_bytes:  @bytes at the last tick
+ * @rate:        Smoothed records per second
+ * @byte_rate:   Smoothed data bytes per second
+ */
+struct reflash_progress_t {
+        const char *device;
+        int json;
+        int shown;
+        int total;
+        uint64_t total_bytes;
+        int done;
+        uint64_t bytes;
+        double start;
+        double next;
+        double last;
+        int last_done;
+        uint64_t last_bytes;
+        double rate;
+        double byte_rate;
+};
+
+/* Progress ticks per second */
+enum { PROGRESS_HZ = 10 };
+
+/**
+ * struct reflash_rto_t - How long to wait for a FLASH WRITE reply
+ * @srtt:   Smoothed round trip time, 0 until the first sample
+ * @rttvar: Its mean deviation
+ * @max:    Most the timeout may grow to
+ */
+struct reflash_rto_t {
+        double srtt;
+        double rttvar;
+        double max;
+};
+
+/**
+ * struct wr_pipe_t - FLASH WRITE commands in flight, see reflash.c
+ * @slot:   Ring of the records sent or about to be, oldest first
+ * @head:   Index in @slot of the oldest record not yet acknowledged
+ * @count:  Records held in the ring
+ * @nsent:  Of those, records on the wire
+ * @cwnd:   Most records on the wire at once for now
+ * @maxwnd: Most @cwnd may grow to
+ * @nacked: Good replies since @cwnd last changed
+ * @min_rtt: Shortest round trip seen
+ * @rto:    Timeout of the oldest record's reply
+ */
+struct wr_slot_t {
+        int recno;
+        int alone;
+        double sent;
+};
+
+struct wr_pipe_t {
+        struct wr_slot_t slot[REFLASH_WINDOW_MAX];
+        int head;
+        int count;
+        int nsent;
+        int cwnd;
+        int maxwnd;
+        int nacked;
+        double min_rtt;
+        struct reflash_rto_t rto;
+};
+
+/**
+ * struct connect_race_t - Connecting to all of a host's addresses at once
+ * @ai:       Addresses, in the order they are tried
+ * @nai:      Number of entries in @ai
+ * @next:     Index in @ai of the next attempt to start
+ * @fd:       Socket of each attempt started, -1 once failed or handed over
+ * @next_at:  stats_now() when the next attempt is due
+ * @deadline: stats_now() when the race is lost
+ * @err:      errno of the latest failed attempt
+ * @winner:   Address connected to, once won
+ */
+struct connect_race_t {
+        const struct addrinfo *ai[CONNECT_MAX];
+        int nai;
+        int next;
+        int fd[CONNECT_MAX];
+        double next_at;
+        double deadline;
+        int err;
+        const struct addrinfo *winner;
+};
+
+/**
+ * struct reflash_step_t - One command/reply exchange outside the write loop
+ * @phase:    Name the step is timed under in struct reflash_stats_t
+ * @banner:   Printed when the step starts
+ * @cmd:      Command to send, NULL terminates a list of steps
+ * @expect:   Prefix of the reply that completes the step
+ * @progress: Substring of lines the device may send before the reply, or
+ *            NULL if it sends none
+ * @errmsg:   Error message for an unexpected reply, or NULL for a generic
+ *            one
+ * @erase:    Nonzero if the step erases the flash.  Such steps are
+ *            skipped when resuming an interrupted write.
+ */
+struct reflash_step_t {
+        const char *phase;
+        const char *banner;
+        const char *cmd;
+        const char *expect;
+        const char *progress;
+        const char *errmsg;
+        int erase;
+};
+
+/**
+ * struct reflash_dialect_t - Command set of one family of targets
+ * @pre:          Steps before the first record (unlock, erase...)
+ * @write_banner: Printed before the first record
+ * @write_fmt:    printf format of the command sending one S-record
+ * @write_expect: Prefix of the reply acknowledging one record
+ * @pipeline:     Nonzero if the target may have several records in flight
+ * @post:         Steps after the last record
+ * @done:         Printed when everything succeeded
+ * @checksum:     Query answering with the checksum of the flash
+ * @ident:        Query answering with the model and firmware revision,
+ *                or NULL if the family has none
+ * @batch_fmt:    printf format of one S-record's write inside a batch,
+ *                separator included, or NULL if the family cannot put
+ *                several writes on one line
+ * @batch_head:   Starts a batch: clears the error queue
+ * @batch_tail:   Ends a batch: waits for its writes, then reads the
+ *                error queue
+ * @batch_expect: Prefix of the reply to a batch that wrote without error
+ * @batch_line:   Longest batch the input buffer takes, '\r' excluded, at
+ *                most BATCH_LINE_MAX
+ */
+struct reflash_dialect_t {
+        const struct reflash_step_t *pre;
+        const char *write_banner;
+        const char *write_fmt;
+        const char *write_expect;
+        int pipeline;
+        const struct reflash_step_t *post;
+        const char *done;
+        const char *checksum;
+        const char *ident;
+        const char *batch_fmt;
+        const char *batch_head;
+        const char *batch_tail;
+        const char *batch_expect;
+        int batch_line;
+};
+
+/**
+ * struct reflash_target_t - One kind of device
+ * @name:     Name on the command line, and in serial-number host names
+ * @dialect:  Command set it speaks
+ * @addr_bits: Width of the addresses its upgrade files use, 24 or 32
+ * @srec_max: Longest S-record text it accepts
+ * @probe_max: Longest S-record text a probe may try on it, from
+ *             @srec_max up to SREC_TEXT_LIMIT
+ * @erased:   Value of a byte of erased flash, or -1 to write every
+ *            byte of an upgrade file regardless
+ */
+struct reflash_target_t {
+        const char *name;
+        const struct reflash_dialect_t *dialect;
+        int addr_bits;
+        int srec_max;
+        int probe_max;
+        int erased;
+};
+
+/* What a transcript entry records */
+enum {
+        /* Connected; the text is the host */
+        CAPTURE_CONNECT = 'C',
+        /* Line sent */
+        CAPTURE_SENT = 'S',
+        /* Line received */
+        CAPTURE_RECEIVED = 'R',
+        /* Gave up waiting for the device */
+        CAPTURE_TIMEOUT = 'T',
+        /* Connection broke; the text says how */
+        CAPTURE_LOST = 'L',
+        /* An attempt failed; the text says why */
+        CAPTURE_FAIL = 'F',
+};
+
+/**
+ * struct capture_entry_t - One entry of a wire transcript
+ * @ns:   Nanoseconds since the capture started
+ * @kind: CAPTURE_xxx
+ * @len:  Length of @text
+ * @text: The line, or what happened, nul-terminated
+ */
+struct capture_entry_t {
+        uint64_t ns;
+        int kind;
+        size_t len;
+        char text[CAPTURE_TEXT_MAX + 1];
+};
+
+/**
+ * struct reflash_profile_t - How to drive one model and firmware
+ *                            revision, as probed
+ * @model:    Target name
+ * @firmware: Firmware revision, see profile_firmware()
+ * @srec_max: Longest S-record text a write command may carry
+ * @depth:    Most write commands that may await their reply at once
+ * @rtt:      Typical write round trip, seconds, or 0 if not known
+ * @erase:    Time the last erase took, seconds, or 0 if not known
+ */
+struct reflash_profile_t {
+        char model[PROFILE_NAME_MAX];
+        char firmware[PROFILE_NAME_MAX];
+        int srec_max;
+        int depth;
+        double rtt;
+        double erase;
+};
+
+/**
+ * struct discover_range_t - Consecutive IPv4 addresses to probe
+ * @first: First address, host byte order
+ * @count: Number of addresses
+ */
+struct discover_range_t {
+        uint32_t first;
+        uint32_t count;
+};
+
+/**
+ * struct discover_dev_t - Something that answered on the HTI port
+ * @addr:     IPv4 address, host byte order
+ * @reply:    First line of its reply to "*IDN?", or "" if none
+ * @model:    Model from @reply or from @name, or "unknown"
+ * @firmware: Firmware revision from @reply, or "unknown"
+ * @name:     Host name, or "-" if it has none or none was looked up
+ */
+struct discover_dev_t {
+        uint32_t addr;
+        char reply[DISCOVER_REPLY_MAX];
+        char model[PROFILE_NAME_MAX];
+        char firmware[PROFILE_NAME_MAX];
+        char name[DISCOVER_NAME_MAX];
+};
 
 /* reflash.c */
-extern int generic_reflash(struct reflash_tcp_t *h, FILE *fp);
-extern int t680_reflash(struct reflash_tcp_t *h, FILE *fp);
-extern int p900_reflash(struct reflash_tcp_t *h, FILE *fp);
-extern int t500_reflash(struct reflash_tcp_t *h, FILE *fp);
+extern int reflash_reply_ok(const char *reply, const char *expect);
+extern int reflash_parse_cksum(const char *reply, uint32_t *sum);
+extern int reflash_cksum_digits(int algo);
+extern void reflash_rto_init(struct reflash_rto_t *e, double max);
+extern void reflash_rto_sample(struct reflash_rto_t *e, double rtt);
+extern double reflash_rto(const struct reflash_rto_t *e);
+extern void wr_pipe_init(struct wr_pipe_t *p,
+                         const struct reflash_dialect_t *d, int window,
+                         const struct reflash_profile_t *prof, int tuned,
+                         double max);
+extern struct wr_slot_t *wr_pipe_slot(struct wr_pipe_t *p, int i);
+extern void wr_pipe_ack(struct wr_pipe_t *p, double rtt);
+extern void wr_pipe_backoff(struct wr_pipe_t *p,
+                            struct reflash_profile_t *prof);
+
+/* srec.c */
+extern int srec_format(const struct srec_image_t *img,
+                       const struct srec_rec_t *r, char *buf);
+extern const char *srec_decode(const char *line, size_t len,
+                               struct srec_rec_t *r, unsigned char *data);
+extern uint32_t srec_checksum(const struct srec_image_t *img, int algo);
+extern uint32_t srec_cksum_start(int algo);
+extern uint32_t srec_cksum_update(int algo, uint32_t sum,
+                                  const unsigned char *p, size_t n);
+extern uint32_t srec_cksum_fill(int algo, uint32_t sum, uint64_t n);
+extern uint32_t srec_cksum_end(int algo, uint32_t sum);
+/* Where a srec_fnv1a() hash starts */
+#define SREC_FNV_BASIS 0xcbf29ce484222325ull
+
+extern uint64_t srec_fnv1a(uint64_t h, const unsigned char *p, size_t n);
+extern uint64_t srec_hash(const struct srec_image_t *img);
+extern int srec_hex_decode(const char *s, size_t n, unsigned char *out);
+extern int srec_validate(struct srec_image_t *img, const char *name,
+                         FILE *err);
+extern struct srec_wire_t *srec_wire(const struct srec_image_t *img,
+                                     const char *fmt);
+extern const char *srec_wire_cmd(const struct srec_wire_t *w, int i,
+                                 size_t *len);
+extern int srec_wire_batch(const struct srec_wire_t *w, int i, int max,
+                           const char *head, const char *tail, int maxlen,
+                           char *buf, size_t *len);
+extern void srec_wire_free(struct srec_wire_t *w);
+
+/* journal.c */
+struct reflash_journal_t;
+extern struct reflash_journal_t *journal_open(const char *dir,
+                                              const char *device,
+                                              uint64_t hash, int nrec,
+                                              int verify);
+extern int journal_resume(const struct reflash_journal_t *j);
+extern void journal_erased(struct reflash_journal_t *j);
+extern void journal_ack(struct reflash_journal_t *j, int nacked);
+extern void journal_close(struct reflash_journal_t *j, int done);
+extern const char *journal_default_dir(char *buf, size_t size);
+extern int mkdir_p(const char *dir);
+
+/* profile.c */
+extern void profile_init(struct reflash_profile_t *p,
+                         const struct reflash_target_t *t,
+                         const char *firmware);
+extern void profile_firmware(const char *reply, char *buf, size_t size);
+extern int profile_load(const char *dir, struct reflash_profile_t *p);
+extern void profile_save(const char *dir, const struct reflash_target_t *t,
+                         const struct reflash_profile_t *p);
+extern int profile_srec_max(const char *dir,
+                            const struct reflash_target_t *t);
+extern double profile_erase_timeout(const struct reflash_profile_t *p,
+                                    double timeout_cmd, double timeout_erase);
+extern const char *profile_default_dir(char *buf, size_t size);
+
+/* capture.c */
+struct reflash_capture_t;
+extern struct reflash_capture_t *capture_new(const char *device);
+extern void capture_add(struct reflash_capture_t *c, int kind,
+                        const char *text, size_t len);
+extern void capture_note(struct reflash_capture_t *c, int kind,
+                         const char *fmt, ...);
+extern int capture_save(const struct reflash_capture_t *c, const char *dir,
+                        char *path, size_t size);
+extern void capture_free(struct reflash_capture_t *c);
+extern FILE *capture_open(const char *path, char *device, size_t size,
+                          unsigned long *dropped);
+extern int capture_read(FILE *fp, struct capture_entry_t *e);
+
+/* stats.c */
+extern double stats_now(void);
+extern void stats_init(struct reflash_stats_t *st, const char *device);
+extern void stats_phase_begin(struct reflash_stats_t *st, const char *name);
+extern void stats_phase_end(struct reflash_stats_t *st);
+extern void stats_rtt(struct reflash_stats_t *st, double secs);
+extern void stats_finish(struct reflash_stats_t *st, const char *result);
+extern void stats_json_string(FILE *fp, const char *s);
+
+/* progress.c */
+extern void progress_init(struct reflash_progress_t *p, const char *device,
+                          const struct srec_image_t *img, int copies);
+extern void progress_skip(struct reflash_progress_t *p,
+                          const struct srec_image_t *img, int from, int to);
+extern void progress_ack(struct reflash_progress_t *p, unsigned int len);
+extern void progress_poll(struct reflash_progress_t *p);
+extern int progress_timeout(const struct reflash_progress_t *p);
+extern void progress_hide(struct reflash_progress_t *p);
+extern void progress_end(struct reflash_progress_t *p);
+
+/* connect.c */
+struct connect_cache_t;
+extern int connect_resolve(struct connect_cache_t **cache, const char *node,
+                           const struct addrinfo **list);
+extern void connect_forget(struct connect_cache_t **cache);
+extern int connect_race_start(struct connect_race_t *r,
+                              const struct addrinfo *list, double timeout);
+extern int connect_race_step(struct connect_race_t *r);
+extern int connect_race_timeout(const struct connect_race_t *r);
+extern int connect_race_fds(const struct connect_race_t *r, int *fds);
+extern void connect_race_cancel(struct connect_race_t *r);
+
+/* discover.c */
+extern int discover_range(const char *cidr, struct discover_range_t *r);
+extern int discover_sweep(const struct discover_range_t *r, int nr, int jobs,
+                          double timeout, int numeric,
+                          struct discover_dev_t **devs);
 
 /* io.c */
 extern struct reflash_tcp_t *tcp_open(const char *node);
+extern struct reflash_tcp_t *tcp_open_timeout(const char *node,
+                                              double timeout,
+                                              struct reflash_stats_t *st);
+extern struct reflash_stats_t *tcp_stats(struct reflash_tcp_t *tcp);
+extern void tcp_set_capture(struct reflash_tcp_t *tcp,
+                            struct reflash_capture_t *cap);
+extern struct reflash_capture_t *tcp_capture(struct reflash_tcp_t *tcp);
+extern const char *tcp_node(struct reflash_tcp_t *tcp);
+extern int tcp_reconnect(struct reflash_tcp_t *tcp);
+extern void tcp_deadline(struct reflash_tcp_t *tcp, double when);
 extern const char *tcp_io(struct reflash_tcp_t *tcp, const char *fmt, ...);
 extern void tcp_close(struct reflash_tcp_t *tcp);
 extern const char *tcp_getline(struct reflash_tcp_t *tcp);
 extern int tcp_io_sendonly(struct reflash_tcp_t *tcp, const char *fmt, ...);
+extern int tcp_queue_buf(struct reflash_tcp_t *tcp, const char *buf,
+                         size_t len);
+extern int tcp_queue(struct reflash_tcp_t *tcp, const char *fmt, ...);
+extern int tcp_flush(struct reflash_tcp_t *tcp);
 
 /* sock_getline.c */
 extern ssize_t sock_getline(char **line, size_t *len, FILE *fp);
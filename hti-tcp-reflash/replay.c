@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * hti-replay - Print a wire transcript, or play the device's side of it
+ *
+ * hti-tcp-reflash --capture=DIR saves what went over each device's
+ * connection, see capture.c.  "hti-replay -l file" prints it, one entry
+ * per line.  Otherwise hti-replay listens where a device would and
+ * stands in for the device of the transcript: it takes the connections
+ * it made, waits for each line it sent, and sends back each line it
+ * received, as long after the last line it was sent as it came then.
+ * Where the connection broke, it closes it; where the device stopped
+ * answering, it says nothing.  So hti-tcp-reflash, pointed at it, runs
+ * into the same stalls, timeouts and odd replies it met in the field.
+ *
+ * A line hti-tcp-reflash sends that differs from the transcript is
+ * reported, but replay goes on regardless.
+ */
+#include "reflash.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+        /* Seconds to wait for a line or a connection before giving up */
+        REPLAY_WAIT = 60,
+        REPLAY_RXBUF = 16384,
+};
+
+static struct {
+        struct capture_entry_t *e;
+        int n;
+        double speed;
+        int verbose;
+        int lfd;
+        int fd;
+        char rx[REPLAY_RXBUF];
+        size_t rxlen;
+} replay = {
+        .speed = 1.0,
+        .lfd = -1,
+        .fd = -1,
+};
+
+static const char *
+kind_name(int kind)
+{
+        switch (kind) {
+        case CAPTURE_CONNECT:
+                return "connect";
+        case CAPTURE_SENT:
+                return "sent";
+        case CAPTURE_RECEIVED:
+                return "received";
+        case CAPTURE_TIMEOUT:
+                return "timeout";
+        case CAPTURE_LOST:
+                return "lost";
+        case CAPTURE_FAIL:
+                return "error";
+        }
+        return "?";
+}
+
+static void
+print_entry(FILE *fp, const struct capture_entry_t *e)
+{
+        fprintf(fp, "%14.6f %-8s %s\n", e->ns * 1e-9, kind_name(e->kind),
+                e->text);
+}
+
+/* Read every entry of @path into replay.e */
+static void
+load(const char *path, int list)
+{
+        char device[DISCOVER_NAME_MAX];
+        struct capture_entry_t *e = NULL;
+        unsigned long dropped;
+        int res, size = 0;
+        FILE *fp;
+
+        if ((fp = capture_open(path, device, sizeof(device),
+                               &dropped)) == NULL) {
+                perror(path);
+                exit(1);
+        }
+        for (;;) {
+                if (replay.n == size) {
+                        size = size ? 2 * size : 256;
+                        e = realloc(replay.e, size * sizeof(*e));
+                        if (e == NULL) {
+                                perror("realloc");
+                                exit(1);
+                        }
+                        replay.e = e;
+                }
+                if ((res = capture_read(fp, &replay.e[replay.n])) <= 0)
+                        break;
+                replay.n++;
+        }
+        fclose(fp);
+        if (res < 0)
+                fprintf(stderr, "%s: cut short after %d entries\n", path,
+                        replay.n);
+        printf("# %s: device %s, %d entries", path, device, replay.n);
+        if (dropped > 0)
+                printf(", %lu earlier ones not kept", dropped);
+        printf("\n");
+        if (list) {
+                int i;
+
+                for (i = 0; i < replay.n; ++i)
+                        print_entry(stdout, &replay.e[i]);
+        }
+}
+
+static int
+listen_socket(const char *addr, int port)
+{
+        struct sockaddr_in sin;
+        int fd, one = 1;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+                fprintf(stderr, "Invalid address '%s'\n", addr);
+                exit(1);
+        }
+        if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+                perror("socket");
+                exit(1);
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0
+            || listen(fd, 1) < 0) {
+                perror("bind");
+                exit(1);
+        }
+        return fd;
+}
+
+/* Wait until @fd is readable; 0 if so, -1 after REPLAY_WAIT seconds */
+static int
+wait_readable(int fd)
+{
+        struct pollfd pfd;
+        int res;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        do {
+                res = poll(&pfd, 1, REPLAY_WAIT * 1000);
+        } while (res < 0 && errno == EINTR);
+        return res > 0 ? 0 : -1;
+}
+
+static void
+drop_client(void)
+{
+        if (replay.fd >= 0)
+                close(replay.fd);
+        replay.fd = -1;
+        replay.rxlen = 0;
+}
+
+static int
+accept_client(void)
+{
+        drop_client();
+        if (wait_readable(replay.lfd) < 0)
+                return -1;
+        replay.fd = accept(replay.lfd, NULL, NULL);
+        return replay.fd < 0 ? -1 : 0;
+}
+
+/*
+ * Read the next line from the client into @line; return 0, or -1 if it
+ * went away or said nothing for REPLAY_WAIT seconds
+ */
+static int
+read_line(char *line, size_t size)
+{
+        for (;;) {
+                char *nl = memchr(replay.rx, '\n', replay.rxlen);
+                char *cr = memchr(replay.rx, '\r', replay.rxlen);
+                size_t len, used;
+                ssize_t res;
+
+                if (nl == NULL || (cr != NULL && cr < nl))
+                        nl = cr;
+                if (nl != NULL) {
+                        len = nl - replay.rx;
+                        used = len + 1;
+                        if (used < replay.rxlen && *nl == '\r'
+                            && nl[1] == '\n')
+                                ++used;
+                        snprintf(line, size, "%.*s", (int)len, replay.rx);
+                        memmove(replay.rx, &replay.rx[used],
+                                replay.rxlen - used);
+                        replay.rxlen -= used;
+                        return 0;
+                }
+                if (replay.rxlen == sizeof(replay.rx))
+                        replay.rxlen = 0;
+                if (wait_readable(replay.fd) < 0)
+                        return -1;
+                res = recv(replay.fd, &replay.rx[replay.rxlen],
+                           sizeof(replay.rx) - replay.rxlen, 0);
+                if (res <= 0)
+                        return -1;
+                replay.rxlen += res;
+        }
+}
+
+/* Sleep until stats_now() reaches @when */
+static void
+sleep_until(double when)
+{
+        double left = when - stats_now();
+        struct timespec ts;
+
+        if (left <= 0.0)
+                return;
+        ts.tv_sec = (time_t)left;
+        ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                ;
+}
+
+/*
+ * Timing is kept relative to the last entry that waited on the client,
+ * a connect or a line from it: @base_ns in the transcript, @base_now
+ * here.
+ */
+static int
+serve(void)
+{
+        /* Room for a line ending after the longest text */
+        static char line[CAPTURE_TEXT_MAX + 3];
+        double base_now = stats_now();
+        uint64_t base_ns = 0;
+        int i, mismatches = 0;
+
+        for (i = 0; i < replay.n; ++i) {
+                const struct capture_entry_t *e = &replay.e[i];
+
+                if (replay.verbose)
+                        print_entry(stderr, e);
+                if (e->kind != CAPTURE_CONNECT && replay.fd < 0) {
+                        /*
+                         * Its connection is gone; skip to the next.  The
+                         * ring may have dropped the first connect.
+                         */
+                        if (i > 0 || accept_client() < 0)
+                                continue;
+                        base_ns = e->ns;
+                        base_now = stats_now();
+                }
+                switch (e->kind) {
+                case CAPTURE_CONNECT:
+                        if (accept_client() < 0) {
+                                fprintf(stderr, "No connection within "
+                                        "%d s\n", REPLAY_WAIT);
+                                return -1;
+                        }
+                        base_ns = e->ns;
+                        base_now = stats_now();
+                        break;
+                case CAPTURE_SENT:
+                        if (read_line(line, sizeof(line)) < 0) {
+                                fprintf(stderr, "Client went away at entry "
+                                        "%d, awaiting '%s'\n", i, e->text);
+                                drop_client();
+                                break;
+                        }
+                        if (strcmp(line, e->text) != 0) {
+                                fprintf(stderr, "Entry %d: expected '%s', "
+                                        "got '%s'\n", i, e->text, line);
+                                mismatches++;
+                        }
+                        base_ns = e->ns;
+                        base_now = stats_now();
+                        break;
+                case CAPTURE_RECEIVED:
+                        sleep_until(base_now + (e->ns - base_ns) * 1e-9
+                                               / replay.speed);
+                        snprintf(line, sizeof(line), "%s\r\n", e->text);
+                        if (send(replay.fd, line, strlen(line),
+                                 MSG_NOSIGNAL) < 0) {
+                                fprintf(stderr, "Client went away at entry "
+                                        "%d\n", i);
+                                drop_client();
+                        }
+                        break;
+                case CAPTURE_LOST:
+                        sleep_until(base_now + (e->ns - base_ns) * 1e-9
+                                               / replay.speed);
+                        drop_client();
+                        break;
+                }
+        }
+        /* Let the client finish with what it got */
+        while (replay.fd >= 0 && read_line(line, sizeof(line)) == 0)
+                ;
+        drop_client();
+        fprintf(stderr, "Replayed %d entries, %d lines not as captured\n",
+                replay.n, mismatches);
+        return mismatches == 0 ? 0 : -1;
+}
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr,
+"Usage: %s [options] file.cap\n"
+"  -l           list the transcript and exit\n"
+"  -a ADDR      listen on ADDR (default 127.0.0.1)\n"
+"  -p PORT      listen on PORT (default %d)\n"
+"  -s FACTOR    play FACTOR times as fast (default 1)\n"
+"  -v           log the entries as they are played\n",
+                argv0, HTI_PORT);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        const char *addr = "127.0.0.1";
+        int port = HTI_PORT;
+        int opt, list = 0;
+
+        while ((opt = getopt(argc, argv, "la:p:s:v")) != -1) {
+                switch (opt) {
+                case 'l':
+                        list = 1;
+                        break;
+                case 'a':
+                        addr = optarg;
+                        break;
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 's':
+                        replay.speed = atof(optarg);
+                        if (!(replay.speed > 0.0))
+                                usage(argv[0]);
+                        break;
+                case 'v':
+                        replay.verbose = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (optind != argc - 1)
+                usage(argv[0]);
+        load(argv[optind], list);
+        if (list)
+                return 0;
+        replay.lfd = listen_socket(addr, port);
+        fflush(stdout);
+        fprintf(stderr, "Replaying on %s:%d\n", addr, port);
+        return serve() == 0 ? 0 : 1;
+}
@@ -0,0 +1,1004 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "reflash.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Whole-file S-record loader.  The upgrade file is parsed and checked
+ * before anything is sent to the device, so a bad file is rejected while
+ * the device still runs its old firmware.
+ *
+ * A regular file is mapped rather than read, and split into lines with
+ * memchr(), so no line is copied and none is too long to hold; pipes
+ * are read with getline().  Hex digits are checked and decoded eight at
+ * a time in a 64-bit word.
+ */
+
+/* Both digits of every byte: byte b is hexpairs[2 * b] and the next */
+#define HEXROW(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+                  h "8" h "9" h "A" h "B" h "C" h "D" h "E" h "F"
+static const char hexpairs[] =
+        HEXROW("0") HEXROW("1") HEXROW("2") HEXROW("3")
+        HEXROW("4") HEXROW("5") HEXROW("6") HEXROW("7")
+        HEXROW("8") HEXROW("9") HEXROW("A") HEXROW("B")
+        HEXROW("C") HEXROW("D") HEXROW("E") HEXROW("F");
+
+/* Address width in bytes of each record type, 0 if the type is invalid */
+static const unsigned char srec_addrlen[10] = {
+        2, 2, 3, 4, 0, 2, 3, 4, 3, 2,
+};
+
+static int
+hexval(int c)
+{
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        c |= 0x20;
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        return -1;
+}
+
+#define ONES  0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+
+/*
+ * Bytes of @x above @n, as their top bit.  Exact as long as every byte
+ * of @x is below 0x80, since then no sum carries into the next byte.
+ */
+static uint64_t
+swar_above(uint64_t x, unsigned int n)
+{
+        return (x + (0x7fu - n) * ONES) & HIGHS;
+}
+
+/* 8 characters at @s, the first in the low byte whatever the host */
+static uint64_t
+load_le64(const char *s)
+{
+        const unsigned char *p = (const unsigned char *)s;
+
+        return (uint64_t)p[0] | (uint64_t)p[1] << 8
+               | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+               | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40
+               | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/**
+ * srec_hex_decode - Decode @n hex digits at @s, @n even, into @n / 2
+ *                   bytes at @out
+ *
+ * Return: 0, or -1 if anything is not a hex digit
+ */
+int
+srec_hex_decode(const char *s, size_t n, unsigned char *out)
+{
+        for (; n >= 8; n -= 8, s += 8, out += 4) {
+                uint64_t x = load_le64(s), l = x | 0x20 * ONES, v;
+                uint64_t digit, alpha;
+
+                if ((x & HIGHS) != 0)
+                        return -1;
+                digit = swar_above(x, '0' - 1) & ~swar_above(x, '9');
+                alpha = swar_above(l, 'a' - 1) & ~swar_above(l, 'f');
+                if ((digit | alpha) != HIGHS)
+                        return -1;
+                /* '0'-'9' are 0x3N, 'A'-'F' and 'a'-'f' 0x4N and 0x6N */
+                v = (x & 0x0f * ONES) + ((x >> 6) & ONES) * 9;
+                /* The first digit of each pair is the high nibble */
+                v = ((v << 4) | (v >> 8)) & 0x00ff00ff00ff00ffull;
+                out[0] = v;
+                out[1] = v >> 16;
+                out[2] = v >> 32;
+                out[3] = v >> 48;
+        }
+        for (; n >= 2; n -= 2, s += 2) {
+                int hi = hexval(s[0]), lo = hexval(s[1]);
+
+                if (hi < 0 || lo < 0)
+                        return -1;
+                *out++ = (hi << 4) | lo;
+        }
+        return 0;
+}
+
+static int
+is_data(char type)
+{
+        return type >= '1' && type <= '3';
+}
+
+static int
+is_term(char type)
+{
+        return type >= '7' && type <= '9';
+}
+
+static int
+srec_grow(struct srec_image_t *img, int *recsize, size_t *datasize,
+          size_t dlen)
+{
+        if (img->nrec == *recsize) {
+                struct srec_rec_t *tmp;
+                int size = *recsize ? *recsize * 2 : 1024;
+                tmp = realloc(img->rec, size * sizeof(*tmp));
+                if (tmp == NULL)
+                        return -1;
+                img->rec = tmp;
+                *recsize = size;
+        }
+        if (img->ndata + dlen > *datasize) {
+                unsigned char *tmp;
+                size_t size = *datasize ? *datasize * 2 : 65536;
+                while (size < img->ndata + dlen)
+                        size *= 2;
+                tmp = realloc(img->data, size);
+                if (tmp == NULL)
+                        return -1;
+                img->data = tmp;
+                *datasize = size;
+        }
+        return 0;
+}
+
+/**
+ * srec_decode - Decode one line of S-record text
+ * @line: Text, without line ending
+ * @len:  Length of @line
+ * @r:    Set to the record, except for @r->off and @r->lineno
+ * @data: Set to the data bytes; room for SREC_TEXT_LIMIT / 2 bytes
+ *
+ * Return: NULL on success, or why @line is not a valid S-record
+ */
+const char *
+srec_decode(const char *line, size_t len, struct srec_rec_t *r,
+            unsigned char *data)
+{
+        unsigned char buf[SREC_TEXT_LIMIT / 2];
+        unsigned int i, nbytes, alen, sum;
+
+        if (len > SREC_TEXT_LIMIT)
+                return "record too long";
+        if (len < 4 || line[0] != 'S' || line[1] < '0' || line[1] > '9'
+            || srec_addrlen[line[1] - '0'] == 0) {
+                return "not an S-record";
+        }
+        if ((len & 1) != 0)
+                return "odd number of hex digits";
+
+        nbytes = (len - 2) / 2;
+        if (srec_hex_decode(&line[2], len - 2, buf) < 0)
+                return "invalid hex digit";
+        if (buf[0] != nbytes - 1)
+                return "byte count does not match record length";
+
+        sum = 0;
+        for (i = 0; i < nbytes; ++i)
+                sum += buf[i];
+        if ((sum & 0xffu) != 0xffu)
+                return "bad checksum";
+
+        alen = srec_addrlen[line[1] - '0'];
+        if (buf[0] < alen + 1)
+                return "record too short for its address";
+
+        r->type = line[1];
+        r->addr = 0;
+        for (i = 0; i < alen; ++i)
+                r->addr = (r->addr << 8) | buf[1 + i];
+        r->len = buf[0] - alen - 1;
+        memcpy(data, &buf[1 + alen], r->len);
+        return NULL;
+}
+
+/* Decode one line onto the end of @img */
+static const char *
+srec_parse(struct srec_image_t *img, const char *line, size_t len,
+           int lineno, int *recsize, size_t *datasize)
+{
+        unsigned char data[SREC_TEXT_LIMIT / 2];
+        struct srec_rec_t r;
+        const char *msg;
+
+        /* Longer than any target is known to take without probing */
+        if (len > SREC_TEXT_MAX)
+                return "record too long";
+        if ((msg = srec_decode(line, len, &r, data)) != NULL)
+                return msg;
+        if (srec_grow(img, recsize, datasize, r.len) < 0)
+                return "out of memory";
+        r.lineno = lineno;
+        r.off = img->ndata;
+        memcpy(&img->data[img->ndata], data, r.len);
+        img->ndata += r.len;
+        img->rec[img->nrec++] = r;
+        return NULL;
+}
+
+struct addr_idx_t {
+        uint32_t addr;
+        int idx;
+};
+
+static int
+cmp_addr(const void *a, const void *b)
+{
+        const struct addr_idx_t *ra = a;
+        const struct addr_idx_t *rb = b;
+        if (ra->addr != rb->addr)
+                return ra->addr < rb->addr ? -1 : 1;
+        return ra->idx - rb->idx;
+}
+
+/**
+ * srec_validate - Check @img as a whole, once every record is in
+ * @img:  Image, whose @lo, @hi, @ndatarec and @byaddr are filled in
+ * @name: File name for error messages
+ * @err:  Where to print them
+ *
+ * Return: 0, or -1 after printing why @img is no good
+ */
+int
+srec_validate(struct srec_image_t *img, const char *name, FILE *err)
+{
+        struct addr_idx_t *sorted;
+        int i, ndata = 0;
+
+        if (img->nrec == 0) {
+                fprintf(err, "%s: empty file\n", name);
+                return -1;
+        }
+        for (i = 0; i < img->nrec; ++i) {
+                const struct srec_rec_t *r = &img->rec[i];
+
+                if (is_data(r->type)) {
+                        uint64_t end = (uint64_t)r->addr + r->len;
+                        if (ndata == 0 || r->addr < img->lo)
+                                img->lo = r->addr;
+                        if (r->len > 0 && (ndata == 0 || end - 1 > img->hi))
+                                img->hi = end - 1;
+                        ++ndata;
+                } else if ((r->type == '5' || r->type == '6')
+                           && r->addr != (uint32_t)ndata) {
+                        fprintf(err, "%s:%d: record count %lu, "
+                                "but %d data records precede it\n",
+                                name, r->lineno, (unsigned long)r->addr,
+                                ndata);
+                        return -1;
+                } else if (is_term(r->type) && i != img->nrec - 1) {
+                        fprintf(err, "%s:%d: records after the "
+                                "termination record\n", name, r->lineno);
+                        return -1;
+                }
+        }
+        img->ndatarec = ndata;
+
+        if (!is_term(img->rec[img->nrec - 1].type)) {
+                fprintf(err, "%s: no termination record, "
+                        "file truncated?\n", name);
+                return -1;
+        }
+        if (ndata == 0) {
+                fprintf(err, "%s: no data records\n", name);
+                return -1;
+        }
+
+        img->byaddr = malloc(ndata * sizeof(*img->byaddr));
+        sorted = malloc(ndata * sizeof(*sorted));
+        if (img->byaddr == NULL || sorted == NULL) {
+                free(sorted);
+                fprintf(err, "malloc: %s\n", strerror(errno));
+                return -1;
+        }
+        ndata = 0;
+        for (i = 0; i < img->nrec; ++i) {
+                if (is_data(img->rec[i].type)) {
+                        sorted[ndata].addr = img->rec[i].addr;
+                        sorted[ndata].idx = i;
+                        ndata++;
+                }
+        }
+        qsort(sorted, ndata, sizeof(*sorted), cmp_addr);
+        for (i = 0; i < ndata; ++i)
+                img->byaddr[i] = sorted[i].idx;
+        free(sorted);
+
+        for (i = 1; i < ndata; ++i) {
+                const struct srec_rec_t *a = &img->rec[img->byaddr[i - 1]];
+                const struct srec_rec_t *b = &img->rec[img->byaddr[i]];
+                if ((uint64_t)a->addr + a->len > b->addr) {
+                        fprintf(err, "%s:%d: data overlaps line %d\n",
+                                name, b->lineno, a->lineno);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/* One line, without its line ending; blank lines are skipped */
+static int
+srec_line(struct srec_image_t *img, const char *name, FILE *err,
+          const char *line, size_t len, int lineno, int *recsize,
+          size_t *datasize)
+{
+        const char *msg;
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                --len;
+        if (len == 0)
+                return 0;
+        msg = srec_parse(img, line, len, lineno, recsize, datasize);
+        if (msg != NULL) {
+                fprintf(err, "%s:%d: %s\n", name, lineno, msg);
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Parse @fp from where it is, mapped if it is a regular file.  Return 0,
+ * -1 after printing why not, or 1 if it cannot be mapped.
+ */
+static int
+srec_map(struct srec_image_t *img, FILE *fp, const char *name, FILE *err,
+         int *recsize, size_t *datasize)
+{
+        const char *map, *p, *end, *nl;
+        off_t start = ftello(fp);
+        struct stat st;
+        size_t size;
+        int lineno = 0, res = 0;
+
+        if (start < 0 || fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode)
+            || st.st_size <= start) {
+                return 1;
+        }
+        size = st.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map == MAP_FAILED)
+                return 1;
+        madvise((void *)map, size, MADV_SEQUENTIAL);
+        end = map + size;
+        for (p = map + start; p < end && res == 0; p = nl + 1) {
+                if ((nl = memchr(p, '\n', end - p)) == NULL)
+                        nl = end;
+                res = srec_line(img, name, err, p, nl - p, ++lineno,
+                                recsize, datasize);
+        }
+        munmap((void *)map, size);
+        return res;
+}
+
+/**
+ * srec_load - Read and check a whole S-record file
+ * @fp:   File to read
+ * @name: File name for error messages
+ * @err:  Where to print them
+ *
+ * Every record is decoded and its checksum verified.  The file as a whole
+ * must end with a termination record, must not contain overlapping data,
+ * and any S5/S6 count record must match.  Blank lines are skipped.
+ *
+ * Return: The image, to be freed with srec_free(), or NULL after printing
+ * the reason to @err
+ */
+struct srec_image_t *
+srec_load(FILE *fp, const char *name, FILE *err)
+{
+        struct srec_image_t *img;
+        char *line = NULL;
+        size_t n = 0;
+        ssize_t len;
+        int lineno = 0, recsize = 0, res;
+        size_t datasize = 0;
+
+        img = calloc(1, sizeof(*img));
+        if (img == NULL) {
+                fprintf(err, "calloc: %s\n", strerror(errno));
+                return NULL;
+        }
+
+        res = srec_map(img, fp, name, err, &recsize, &datasize);
+        while (res > 0 && (len = getline(&line, &n, fp)) >= 0) {
+                if (srec_line(img, name, err, line, len, ++lineno, &recsize,
+                              &datasize) < 0)
+                        goto fail;
+        }
+        if (res < 0)
+                goto fail;
+        if (res > 0 && ferror(fp)) {
+                fprintf(err, "%s: %s\n", name, strerror(errno));
+                goto fail;
+        }
+        if (srec_validate(img, name, err) < 0)
+                goto fail;
+
+        free(line);
+        return img;
+
+fail:
+        free(line);
+        srec_free(img);
+        return NULL;
+}
+
+void
+srec_free(struct srec_image_t *img)
+{
+        free(img->rec);
+        free(img->data);
+        free(img->byaddr);
+        free(img);
+}
+
+/**
+ * srec_format - Encode one record of @img as S-record text
+ * @img:  Image holding @r
+ * @r:    Record to encode
+ * @buf:  Buffer of at least SREC_TEXT_LIMIT + 1 bytes
+ *
+ * Return: Length of the text written to @buf, not counting the
+ * terminating nul
+ */
+int
+srec_format(const struct srec_image_t *img, const struct srec_rec_t *r,
+            char *buf)
+{
+        const unsigned char *data = &img->data[r->off];
+        unsigned int alen = srec_addrlen[r->type - '0'];
+        unsigned int count = alen + r->len + 1;
+        unsigned int sum = count;
+        unsigned int i;
+        char *p = buf;
+
+        *p++ = 'S';
+        *p++ = r->type;
+        memcpy(p, &hexpairs[2 * count], 2);
+        p += 2;
+        for (i = alen; i-- > 0; ) {
+                unsigned int b = (r->addr >> (8 * i)) & 0xffu;
+                sum += b;
+                memcpy(p, &hexpairs[2 * b], 2);
+                p += 2;
+        }
+        for (i = 0; i < r->len; ++i) {
+                sum += data[i];
+                memcpy(p, &hexpairs[2 * data[i]], 2);
+                p += 2;
+        }
+        sum = ~sum & 0xffu;
+        memcpy(p, &hexpairs[2 * sum], 2);
+        p += 2;
+        *p = '\0';
+        return p - buf;
+}
+
+/**
+ * srec_wire - Encode every record of @img as a complete write command
+ * @img: Image to encode
+ * @fmt: printf format of the command, with one %s for the S-record text
+ *
+ * The commands, each ending in '\r', lie back to back in one buffer, so
+ * sending record i is sending srec_wire_cmd() as it stands.  Nothing in
+ * the result changes afterwards, and any number of connections can send
+ * from it at once.
+ *
+ * Return: The commands, to be freed with srec_wire_free(), or NULL if out
+ * of memory
+ */
+struct srec_wire_t *
+srec_wire(const struct srec_image_t *img, const char *fmt)
+{
+        struct srec_wire_t *w;
+        char text[SREC_TEXT_LIMIT + 1];
+        size_t size = 0, extra = snprintf(NULL, 0, fmt, "") + 1;
+        int i;
+
+        if ((w = malloc(sizeof(*w))) == NULL)
+                return NULL;
+        w->nrec = img->nrec;
+        w->off = malloc((img->nrec + 1) * sizeof(*w->off));
+        for (i = 0; i < img->nrec; ++i) {
+                const struct srec_rec_t *r = &img->rec[i];
+
+                /* "Stnn" + address, data and checksum bytes in hex */
+                size += extra + 4
+                        + 2 * (srec_addrlen[r->type - '0'] + r->len + 1);
+        }
+        /* One more byte for the nul snprintf() ends the last with */
+        w->buf = malloc(size + 1);
+        if (w->off == NULL || w->buf == NULL) {
+                srec_wire_free(w);
+                return NULL;
+        }
+        w->off[0] = 0;
+        for (i = 0; i < img->nrec; ++i) {
+                size_t at = w->off[i];
+                int len;
+
+                srec_format(img, &img->rec[i], text);
+                len = snprintf(&w->buf[at], size + 1 - at, fmt, text);
+                w->buf[at + len] = '\r';
+                w->off[i + 1] = at + len + 1;
+        }
+        return w;
+}
+
+/* Command @i of @w, and its length in @len */
+const char *
+srec_wire_cmd(const struct srec_wire_t *w, int i, size_t *len)
+{
+        *len = w->off[i + 1] - w->off[i];
+        return &w->buf[w->off[i]];
+}
+
+/**
+ * srec_wire_batch - Join commands of @w into one line
+ * @w:      Commands from srec_wire(), made with a format that ends in
+ *          the separator between two of them
+ * @i:      First command to join
+ * @max:    Most commands to join
+ * @head:   What the line starts with
+ * @tail:   What it ends with, before its '\r'
+ * @maxlen: Longest the line may be, '\r' excluded
+ * @buf:    Where the line goes, @maxlen + 1 bytes, '\r' included and not
+ *          nul-terminated
+ * @len:    Set to the length of the line, '\r' included
+ *
+ * Return: Number of commands joined, 0 if not even one fits
+ */
+int
+srec_wire_batch(const struct srec_wire_t *w, int i, int max,
+                const char *head, const char *tail, int maxlen,
+                char *buf, size_t *len)
+{
+        size_t hlen = strlen(head), tlen = strlen(tail), at = hlen;
+        int n;
+
+        if (hlen + tlen > (size_t)maxlen)
+                return 0;
+        memcpy(buf, head, hlen);
+        for (n = 0; n < max && i + n < w->nrec; ++n) {
+                /* Without its '\r' */
+                size_t clen = w->off[i + n + 1] - w->off[i + n] - 1;
+
+                if (at + clen + tlen > (size_t)maxlen)
+                        break;
+                memcpy(&buf[at], &w->buf[w->off[i + n]], clen);
+                at += clen;
+        }
+        memcpy(&buf[at], tail, tlen);
+        at += tlen;
+        buf[at++] = '\r';
+        *len = at;
+        return n;
+}
+
+void
+srec_wire_free(struct srec_wire_t *w)
+{
+        if (w == NULL)
+                return;
+        free(w->buf);
+        free(w->off);
+        free(w);
+}
+
+/* Can @b go on the end of @a without the result exceeding @maxtext? */
+static int
+srec_can_merge(const struct srec_rec_t *a, const struct srec_rec_t *b,
+               int maxtext, int maxdata)
+{
+        unsigned int alen = srec_addrlen[a->type - '0'];
+        unsigned int len = a->len + b->len;
+
+        return b->type == a->type
+               && (uint64_t)a->addr + a->len == b->addr
+               && a->off + a->len == b->off
+               && 4 + 2 * (alen + len + 1) <= (unsigned int)maxtext
+               && (maxdata == 0 || len <= (unsigned int)maxdata);
+}
+
+/**
+ * srec_reblock - Merge adjacent data records into fewer, longer ones
+ * @img:     Image from srec_load(), changed in place
+ * @maxtext: Longest S-record text to make, at most SREC_TEXT_LIMIT
+ * @maxdata: Most data bytes to put in one record, or 0 for no limit
+ *           besides @maxtext
+ *
+ * A data record is appended to the one before it in the file when both
+ * are of the same type, it starts right where that one ends, and the
+ * result stays within the limits.  So a merged record never spans a
+ * gap, and records still go to the device in file order.  srec_format()
+ * computes the new checksums, and S5/S6 counts are updated here.
+ *
+ * Return: Number of records merged away, or -1 if out of memory, in
+ * which case @img is left alone
+ */
+int
+srec_reblock(struct srec_image_t *img, int maxtext, int maxdata)
+{
+        struct srec_rec_t *prev = NULL;
+        int *map;
+        int i, n = 0, ndata = 0, removed;
+
+        if (maxtext > SREC_TEXT_LIMIT)
+                maxtext = SREC_TEXT_LIMIT;
+        map = malloc(img->nrec * sizeof(*map));
+        if (map == NULL)
+                return -1;
+
+        /* Compact in place; the old index of each survivor maps to its new */
+        for (i = 0; i < img->nrec; ++i) {
+                struct srec_rec_t r = img->rec[i];
+
+                if (prev != NULL && srec_can_merge(prev, &r, maxtext,
+                                                   maxdata)) {
+                        prev->len += r.len;
+                        map[i] = -1;
+                        continue;
+                }
+                if (is_data(r.type))
+                        ndata++;
+                else if (r.type == '5' || r.type == '6')
+                        r.addr = ndata;
+                map[i] = n;
+                img->rec[n] = r;
+                prev = is_data(r.type) ? &img->rec[n] : NULL;
+                n++;
+        }
+
+        /*
+         * A merged record starts where its first part did, and nothing
+         * lies between the parts, so the address order stays the same.
+         */
+        ndata = 0;
+        for (i = 0; i < img->ndatarec; ++i) {
+                int m = map[img->byaddr[i]];
+                if (m >= 0)
+                        img->byaddr[ndata++] = m;
+        }
+        free(map);
+
+        removed = img->nrec - n;
+        img->nrec = n;
+        img->ndatarec = ndata;
+        return removed;
+}
+
+/*
+ * Start of the first and end of the last byte of @p not equal to @c;
+ * @n and 0 if there is none.
+ */
+static void
+srec_span(const unsigned char *p, size_t n, int c, size_t *lo, size_t *hi)
+{
+        *lo = 0;
+        while (*lo < n && p[*lo] == c)
+                ++*lo;
+        *hi = n;
+        while (*hi > 0 && p[*hi - 1] == c)
+                --*hi;
+}
+
+/**
+ * srec_skip_erased - Leave out data erased flash already holds
+ * @img:    Image, changed in place
+ * @erased: Value of an erased byte
+ * @nbytes: Set to the number of data bytes left out
+ *
+ * Data records holding nothing but @erased are dropped, and runs of
+ * @erased at either end of the others are trimmed off, in steps of
+ * SREC_ERASED_ALIGN address bytes so that what is left still starts and
+ * ends on a flash word.  This is only for writing right after an
+ * erase.
+ *
+ * The bytes at @img->lo and @img->hi are written regardless, for the
+ * device's checksum runs from the lowest address written to the
+ * highest.  In between, srec_checksum() takes unwritten bytes as
+ * erased, so its result does not change either.
+ *
+ * Return: Number of records dropped, or -1 if out of memory, in which
+ * case @img is left alone
+ */
+int
+srec_skip_erased(struct srec_image_t *img, int erased, size_t *nbytes)
+{
+        int *map;
+        int i, n = 0, ndata = 0, removed;
+
+        *nbytes = 0;
+        map = malloc(img->nrec * sizeof(*map));
+        if (map == NULL)
+                return -1;
+
+        for (i = 0; i < img->nrec; ++i) {
+                struct srec_rec_t r = img->rec[i];
+
+                if (is_data(r.type)) {
+                        const uint32_t a = SREC_ERASED_ALIGN - 1;
+                        size_t lo, hi;
+
+                        srec_span(&img->data[r.off], r.len, erased, &lo, &hi);
+                        if (r.len > 0 && r.addr == img->lo) {
+                                lo = 0;
+                                hi = hi > 0 ? hi : 1;
+                        }
+                        if (r.len > 0 && r.addr + r.len - 1 == img->hi) {
+                                lo = lo < r.len ? lo : r.len - 1u;
+                                hi = r.len;
+                        }
+                        if (lo >= hi) {
+                                *nbytes += r.len;
+                                map[i] = -1;
+                                continue;
+                        }
+                        /* Round out to whole words, within the record */
+                        lo = lo > ((r.addr + lo) & a)
+                             ? lo - ((r.addr + lo) & a) : 0;
+                        if (((r.addr + hi) & a) != 0)
+                                hi += SREC_ERASED_ALIGN - ((r.addr + hi) & a);
+                        if (hi > r.len)
+                                hi = r.len;
+                        *nbytes += r.len - (hi - lo);
+                        r.addr += lo;
+                        r.off += lo;
+                        r.len = hi - lo;
+                        ndata++;
+                } else if (r.type == '5' || r.type == '6') {
+                        r.addr = ndata;
+                }
+                map[i] = n;
+                img->rec[n++] = r;
+        }
+
+        /* Trimming moves no record past another, so the order holds */
+        ndata = 0;
+        for (i = 0; i < img->ndatarec; ++i) {
+                int m = map[img->byaddr[i]];
+                if (m >= 0)
+                        img->byaddr[ndata++] = m;
+        }
+        free(map);
+
+        removed = img->nrec - n;
+        img->nrec = n;
+        img->ndatarec = ndata;
+        return removed;
+}
+
+/* CRC-32 (IEEE 802.3, reflected polynomial 0xedb88320), one byte at a time */
+static const uint32_t crc32_table[256] = {
+        0x00000000u, 0x77073096u, 0xee0e612cu, 0x990951bau,
+        0x076dc419u, 0x706af48fu, 0xe963a535u, 0x9e6495a3u,
+        0x0edb8832u, 0x79dcb8a4u, 0xe0d5e91eu, 0x97d2d988u,
+        0x09b64c2bu, 0x7eb17cbdu, 0xe7b82d07u, 0x90bf1d91u,
+        0x1db71064u, 0x6ab020f2u, 0xf3b97148u, 0x84be41deu,
+        0x1adad47du, 0x6ddde4ebu, 0xf4d4b551u, 0x83d385c7u,
+        0x136c9856u, 0x646ba8c0u, 0xfd62f97au, 0x8a65c9ecu,
+        0x14015c4fu, 0x63066cd9u, 0xfa0f3d63u, 0x8d080df5u,
+        0x3b6e20c8u, 0x4c69105eu, 0xd56041e4u, 0xa2677172u,
+        0x3c03e4d1u, 0x4b04d447u, 0xd20d85fdu, 0xa50ab56bu,
+        0x35b5a8fau, 0x42b2986cu, 0xdbbbc9d6u, 0xacbcf940u,
+        0x32d86ce3u, 0x45df5c75u, 0xdcd60dcfu, 0xabd13d59u,
+        0x26d930acu, 0x51de003au, 0xc8d75180u, 0xbfd06116u,
+        0x21b4f4b5u, 0x56b3c423u, 0xcfba9599u, 0xb8bda50fu,
+        0x2802b89eu, 0x5f058808u, 0xc60cd9b2u, 0xb10be924u,
+        0x2f6f7c87u, 0x58684c11u, 0xc1611dabu, 0xb6662d3du,
+        0x76dc4190u, 0x01db7106u, 0x98d220bcu, 0xefd5102au,
+        0x71b18589u, 0x06b6b51fu, 0x9fbfe4a5u, 0xe8b8d433u,
+        0x7807c9a2u, 0x0f00f934u, 0x9609a88eu, 0xe10e9818u,
+        0x7f6a0dbbu, 0x086d3d2du, 0x91646c97u, 0xe6635c01u,
+        0x6b6b51f4u, 0x1c6c6162u, 0x856530d8u, 0xf262004eu,
+        0x6c0695edu, 0x1b01a57bu, 0x8208f4c1u, 0xf50fc457u,
+        0x65b0d9c6u, 0x12b7e950u, 0x8bbeb8eau, 0xfcb9887cu,
+        0x62dd1ddfu, 0x15da2d49u, 0x8cd37cf3u, 0xfbd44c65u,
+        0x4db26158u, 0x3ab551ceu, 0xa3bc0074u, 0xd4bb30e2u,
+        0x4adfa541u, 0x3dd895d7u, 0xa4d1c46du, 0xd3d6f4fbu,
+        0x4369e96au, 0x346ed9fcu, 0xad678846u, 0xda60b8d0u,
+        0x44042d73u, 0x33031de5u, 0xaa0a4c5fu, 0xdd0d7cc9u,
+        0x5005713cu, 0x270241aau, 0xbe0b1010u, 0xc90c2086u,
+        0x5768b525u, 0x206f85b3u, 0xb966d409u, 0xce61e49fu,
+        0x5edef90eu, 0x29d9c998u, 0xb0d09822u, 0xc7d7a8b4u,
+        0x59b33d17u, 0x2eb40d81u, 0xb7bd5c3bu, 0xc0ba6cadu,
+        0xedb88320u, 0x9abfb3b6u, 0x03b6e20cu, 0x74b1d29au,
+        0xead54739u, 0x9dd277afu, 0x04db2615u, 0x73dc1683u,
+        0xe3630b12u, 0x94643b84u, 0x0d6d6a3eu, 0x7a6a5aa8u,
+        0xe40ecf0bu, 0x9309ff9du, 0x0a00ae27u, 0x7d079eb1u,
+        0xf00f9344u, 0x8708a3d2u, 0x1e01f268u, 0x6906c2feu,
+        0xf762575du, 0x806567cbu, 0x196c3671u, 0x6e6b06e7u,
+        0xfed41b76u, 0x89d32be0u, 0x10da7a5au, 0x67dd4accu,
+        0xf9b9df6fu, 0x8ebeeff9u, 0x17b7be43u, 0x60b08ed5u,
+        0xd6d6a3e8u, 0xa1d1937eu, 0x38d8c2c4u, 0x4fdff252u,
+        0xd1bb67f1u, 0xa6bc5767u, 0x3fb506ddu, 0x48b2364bu,
+        0xd80d2bdau, 0xaf0a1b4cu, 0x36034af6u, 0x41047a60u,
+        0xdf60efc3u, 0xa867df55u, 0x316e8eefu, 0x4669be79u,
+        0xcb61b38cu, 0xbc66831au, 0x256fd2a0u, 0x5268e236u,
+        0xcc0c7795u, 0xbb0b4703u, 0x220216b9u, 0x5505262fu,
+        0xc5ba3bbeu, 0xb2bd0b28u, 0x2bb45a92u, 0x5cb36a04u,
+        0xc2d7ffa7u, 0xb5d0cf31u, 0x2cd99e8bu, 0x5bdeae1du,
+        0x9b64c2b0u, 0xec63f226u, 0x756aa39cu, 0x026d930au,
+        0x9c0906a9u, 0xeb0e363fu, 0x72076785u, 0x05005713u,
+        0x95bf4a82u, 0xe2b87a14u, 0x7bb12baeu, 0x0cb61b38u,
+        0x92d28e9bu, 0xe5d5be0du, 0x7cdcefb7u, 0x0bdbdf21u,
+        0x86d3d2d4u, 0xf1d4e242u, 0x68ddb3f8u, 0x1fda836eu,
+        0x81be16cdu, 0xf6b9265bu, 0x6fb077e1u, 0x18b74777u,
+        0x88085ae6u, 0xff0f6a70u, 0x66063bcau, 0x11010b5cu,
+        0x8f659effu, 0xf862ae69u, 0x616bffd3u, 0x166ccf45u,
+        0xa00ae278u, 0xd70dd2eeu, 0x4e048354u, 0x3903b3c2u,
+        0xa7672661u, 0xd06016f7u, 0x4969474du, 0x3e6e77dbu,
+        0xaed16a4au, 0xd9d65adcu, 0x40df0b66u, 0x37d83bf0u,
+        0xa9bcae53u, 0xdebb9ec5u, 0x47b2cf7fu, 0x30b5ffe9u,
+        0xbdbdf21cu, 0xcabac28au, 0x53b39330u, 0x24b4a3a6u,
+        0xbad03605u, 0xcdd70693u, 0x54de5729u, 0x23d967bfu,
+        0xb3667a2eu, 0xc4614ab8u, 0x5d681b02u, 0x2a6f2b94u,
+        0xb40bbe37u, 0xc30c8ea1u, 0x5a05df1bu, 0x2d02ef8du,
+};
+
+/*
+ * Running checksum: srec_cksum_start(), then srec_cksum_update() or
+ * srec_cksum_fill() over the bytes in address order, then
+ * srec_cksum_end().
+ */
+uint32_t
+srec_cksum_start(int algo)
+{
+        if (algo != REFLASH_CKSUM_CRC32)
+                return 0;
+        return 0xffffffffu;
+}
+
+uint32_t
+srec_cksum_update(int algo, uint32_t sum, const unsigned char *p, size_t n)
+{
+        size_t i;
+
+        if (algo == REFLASH_CKSUM_CRC32) {
+                for (i = 0; i < n; ++i)
+                        sum = crc32_table[(sum ^ p[i]) & 0xffu] ^ (sum >> 8);
+        } else {
+                for (i = 0; i < n; ++i)
+                        sum += p[i];
+        }
+        return sum;
+}
+
+/* Add @n erased (0xFF) bytes */
+uint32_t
+srec_cksum_fill(int algo, uint32_t sum, uint64_t n)
+{
+        static const unsigned char ff[256] = {
+                [0 ... 255] = 0xff,
+        };
+
+        if (algo != REFLASH_CKSUM_CRC32)
+                return sum + (uint32_t)(0xffu * n);
+        while (n > 0) {
+                size_t chunk = n > sizeof(ff) ? sizeof(ff) : n;
+                sum = srec_cksum_update(algo, sum, ff, chunk);
+                n -= chunk;
+        }
+        return sum;
+}
+
+uint32_t
+srec_cksum_end(int algo, uint32_t sum)
+{
+        switch (algo) {
+        case REFLASH_CKSUM_SUM16:
+                return sum & 0xffffu;
+        case REFLASH_CKSUM_CRC32:
+                return ~sum;
+        default:
+                return sum;
+        }
+}
+
+/**
+ * srec_checksum - Checksum of the flash contents @img leaves behind
+ * @img:  Image
+ * @algo: One of the REFLASH_CKSUM_xxx values
+ *
+ * The checksum covers every byte from @img->lo to @img->hi, with bytes
+ * that no record writes taken as erased (0xFF).
+ *
+ * Return: The checksum, truncated to 16 bits for REFLASH_CKSUM_SUM16
+ */
+uint32_t
+srec_checksum(const struct srec_image_t *img, int algo)
+{
+        uint32_t sum = srec_cksum_start(algo);
+        uint64_t addr = img->lo;
+        int i;
+
+        for (i = 0; i < img->ndatarec; ++i) {
+                const struct srec_rec_t *r = &img->rec[img->byaddr[i]];
+                sum = srec_cksum_fill(algo, sum, r->addr - addr);
+                sum = srec_cksum_update(algo, sum,
+                                        &img->data[r->off], r->len);
+                addr = (uint64_t)r->addr + r->len;
+        }
+        return srec_cksum_end(algo, sum);
+}
+
+/* FNV-1a of @n bytes at @p, carrying on from @h */
+uint64_t
+srec_fnv1a(uint64_t h, const unsigned char *p, size_t n)
+{
+        size_t i;
+        for (i = 0; i < n; ++i) {
+                h ^= p[i];
+                h *= 0x100000001b3ull;
+        }
+        return h;
+}
+
+/**
+ * srec_hash - Identify an image by what it sends to the device
+ * @img: Image
+ *
+ * FNV-1a over every record's type, address and data, in file order, so
+ * two files hash alike exactly when they write the same records in the
+ * same order.
+ *
+ * Return: 64-bit hash
+ */
+uint64_t
+srec_hash(const struct srec_image_t *img)
+{
+        uint64_t h = SREC_FNV_BASIS;
+        int i;
+
+        for (i = 0; i < img->nrec; ++i) {
+                const struct srec_rec_t *r = &img->rec[i];
+                unsigned char hdr[6];
+
+                hdr[0] = r->type;
+                hdr[1] = r->len;
+                hdr[2] = r->addr >> 24;
+                hdr[3] = r->addr >> 16;
+                hdr[4] = r->addr >> 8;
+                hdr[5] = r->addr;
+                h = srec_fnv1a(h, hdr, sizeof(hdr));
+                h = srec_fnv1a(h, &img->data[r->off], r->len);
+        }
+        return h;
+}
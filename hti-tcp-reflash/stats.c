@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "reflash.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Timing of one device's reflash.  Everything lives in a fixed-size
+ * struct reflash_stats_t, so recording costs a clock read and a few
+ * adds, and nothing is allocated or logged along the way.  A NULL
+ * struct reflash_stats_t * turns every call into a no-op.
+ *
+ * Round trips go into a log-linear histogram of microseconds: exact
+ * below 8 us, then 8 buckets per power of two (within 1/16th).
+ */
+
+double
+stats_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int
+hist_bucket(uint64_t us)
+{
+        int e, idx;
+
+        if (us < 8)
+                return (int)us;
+        e = 63 - __builtin_clzll(us);
+        idx = (e - 2) * 8 + (int)((us >> (e - 3)) & 7);
+        return idx < REFLASH_STATS_NBUCKETS ? idx : REFLASH_STATS_NBUCKETS - 1;
+}
+
+/* Lowest value, in us, that lands in bucket @idx */
+static double
+hist_floor(int idx)
+{
+        int e = idx / 8 + 2;
+
+        if (idx < 8)
+                return idx;
+        return (double)((uint64_t)(8 + idx % 8) << (e - 3));
+}
+
+void
+stats_init(struct reflash_stats_t *st, const char *device)
+{
+        if (st == NULL)
+                return;
+        memset(st, 0, sizeof(*st));
+        snprintf(st->device, sizeof(st->device), "%s", device);
+        st->start = stats_now();
+}
+
+void
+stats_phase_begin(struct reflash_stats_t *st, const char *name)
+{
+        if (st == NULL)
+                return;
+        st->cur = name;
+        st->cur_start = stats_now();
+}
+
+void
+stats_phase_end(struct reflash_stats_t *st)
+{
+        int i;
+
+        if (st == NULL || st->cur == NULL)
+                return;
+        for (i = 0; i < st->nphase; ++i) {
+                if (!strcmp(st->phase[i].name, st->cur))
+                        break;
+        }
+        if (i == st->nphase) {
+                if (i == REFLASH_STATS_NPHASES) {
+                        st->cur = NULL;
+                        return;
+                }
+                st->phase[i].name = st->cur;
+                st->phase[i].secs = 0.0;
+                st->nphase++;
+        }
+        st->phase[i].secs += stats_now() - st->cur_start;
+        st->cur = NULL;
+}
+
+void
+stats_rtt(struct reflash_stats_t *st, double secs)
+{
+        struct stats_hist_t *h;
+        uint64_t us;
+
+        if (st == NULL)
+                return;
+        h = &st->rtt;
+        us = secs > 0.0 ? (uint64_t)(secs * 1e6) : 0;
+        h->bucket[hist_bucket(us)]++;
+        if (h->n == 0 || us < h->min)
+                h->min = us;
+        if (us > h->max)
+                h->max = us;
+        h->sum += us;
+        h->n++;
+}
+
+/* Value below which fraction @p of the round trips fall, in us */
+static double
+hist_percentile(const struct stats_hist_t *h, double p)
+{
+        uint64_t want, seen = 0;
+        int i;
+
+        if (h->n == 0)
+                return 0.0;
+        want = (uint64_t)(p * (double)h->n + 0.5);
+        if (want < 1)
+                want = 1;
+        for (i = 0; i < REFLASH_STATS_NBUCKETS; ++i) {
+                seen += h->bucket[i];
+                if (seen >= want) {
+                        double lo = hist_floor(i);
+                        double hi = i + 1 < REFLASH_STATS_NBUCKETS
+                                    ? hist_floor(i + 1) : lo;
+                        double mid = (lo + hi) / 2.0;
+                        /* Never report beyond what was seen */
+                        if (mid > (double)h->max)
+                                mid = (double)h->max;
+                        if (mid < (double)h->min)
+                                mid = (double)h->min;
+                        return mid;
+                }
+        }
+        return (double)h->max;
+}
+
+static double
+write_secs(const struct reflash_stats_t *st)
+{
+        int i;
+        for (i = 0; i < st->nphase; ++i) {
+                if (!strcmp(st->phase[i].name, "write"))
+                        return st->phase[i].secs;
+        }
+        return 0.0;
+}
+
+/* Print @s as a JSON string */
+void
+stats_json_string(FILE *fp, const char *s)
+{
+        putc('"', fp);
+        for (; *s != '\0'; ++s) {
+                if (*s == '"' || *s == '\\')
+                        fprintf(fp, "\\%c", *s);
+                else if ((unsigned char)*s < 0x20)
+                        fprintf(fp, "\\u%04x", (unsigned char)*s);
+                else
+                        putc(*s, fp);
+        }
+        putc('"', fp);
+}
+
+static void
+print_json(FILE *fp, const struct reflash_stats_t *st)
+{
+        const struct stats_hist_t *h = &st->rtt;
+        double ws = write_secs(st);
+        int i;
+
+        fprintf(fp, "{\"device\":");
+        stats_json_string(fp, st->device);
+        fprintf(fp, ",\"result\":");
+        stats_json_string(fp, st->result);
+        fprintf(fp, ",\"total_s\":%.6f,\"resolve_s\":%.6f,"
+                "\"connect_s\":%.6f,\"phases\":{",
+                st->total, st->resolve, st->connect);
+        for (i = 0; i < st->nphase; ++i) {
+                fprintf(fp, "%s", i ? "," : "");
+                stats_json_string(fp, st->phase[i].name);
+                fprintf(fp, ":%.6f", st->phase[i].secs);
+        }
+        fprintf(fp, "},\"records\":%lu,\"bytes_tx\":%llu,\"bytes_rx\":%llu,"
+                "\"records_per_s\":%.1f,\"reconnects\":%u,",
+                st->records, (unsigned long long)st->bytes_tx,
+                (unsigned long long)st->bytes_rx,
+                ws > 0.0 ? st->records / ws : 0.0, st->reconnects);
+        fprintf(fp, "\"rtt_us\":{\"count\":%llu,\"min\":%llu,\"mean\":%.1f,"
+                "\"p50\":%.0f,\"p90\":%.0f,\"p99\":%.0f,\"max\":%llu}}\n",
+                (unsigned long long)h->n, (unsigned long long)h->min,
+                h->n ? (double)h->sum / h->n : 0.0,
+                hist_percentile(h, 0.50), hist_percentile(h, 0.90),
+                hist_percentile(h, 0.99), (unsigned long long)h->max);
+}
+
+static void
+print_text(FILE *fp, const struct reflash_stats_t *st)
+{
+        const struct stats_hist_t *h = &st->rtt;
+        double ws = write_secs(st);
+        int i;
+
+        fprintf(fp, "%s: %s in %.3f s (resolve %.3f s, connect %.3f s)\n",
+                st->device, st->result, st->total, st->resolve, st->connect);
+        for (i = 0; i < st->nphase; ++i) {
+                fprintf(fp, "  %-10s %10.3f s\n",
+                        st->phase[i].name, st->phase[i].secs);
+        }
+        fprintf(fp, "  %lu records, %.1f records/s, %llu bytes sent, "
+                "%llu received\n", st->records,
+                ws > 0.0 ? st->records / ws : 0.0,
+                (unsigned long long)st->bytes_tx,
+                (unsigned long long)st->bytes_rx);
+        if (st->reconnects > 0)
+                fprintf(fp, "  %u reconnects\n", st->reconnects);
+        if (h->n > 0) {
+                fprintf(fp, "  RTT us: min %llu  p50 %.0f  p90 %.0f  "
+                        "p99 %.0f  max %llu  (%llu round trips)\n",
+                        (unsigned long long)h->min,
+                        hist_percentile(h, 0.50), hist_percentile(h, 0.90),
+                        hist_percentile(h, 0.99),
+                        (unsigned long long)h->max,
+                        (unsigned long long)h->n);
+        }
+}
+
+/**
+ * stats_finish - Close the books on one device
+ * @st:     Statistics, or NULL
+ * @result: Outcome to report, eg. "ok" or "failed"
+ */
+void
+stats_finish(struct reflash_stats_t *st, const char *result)
+{
+        if (st == NULL)
+                return;
+        stats_phase_end(st);
+        snprintf(st->result, sizeof(st->result), "%s", result);
+        st->total = stats_now() - st->start;
+}
+
+/**
+ * stats_print - Report one device's statistics
+ * @fp:     Where to
+ * @st:     Statistics
+ * @format: REFLASH_STATS_TEXT or REFLASH_STATS_JSON.  JSON is one object
+ *          per line.
+ */
+void
+stats_print(FILE *fp, const struct reflash_stats_t *st, int format)
+{
+        if (format == REFLASH_STATS_JSON)
+                print_json(fp, st);
+        else
+                print_text(fp, st);
+}
@@ -0,0 +1,123 @@
+#!/bin/sh
+#
+# Reflash a simulated device with hti-tcp-reflash, for "make check":
+#
+#   mock.sh SETTINGS
+#
+# SETTINGS is a tests/*.mock file naming the @target, the loopback
+# @addr to run hti-mock-device on (the HTI port is fixed, so every test
+# has an address of its own) and the options of the dialect's @fast
+# write path.  The device is checked to take a reflash and verify it,
+# to be found up to date the second time, to take another image by the
+# fast path, and to take a reflash through dropped connections.
+#
+# Exit status: 0 on success, 1 on failure, 77 (skipped) if the mock
+# cannot listen on @addr.
+
+target=
+addr=
+fast=
+. "$1" || exit 99
+
+tmp=$(mktemp -d) || exit 99
+pid=
+cleanup()
+{
+        [ -n "$pid" ] && kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+        rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 1' HUP INT TERM
+
+# S2 records of 32 bytes from address 0, then S8; $1 varies the data
+image()
+{
+        awk -v seed="$1" -v nrec=256 '
+        function put(type, addr, alen, n,    sum, line, i, b) {
+                sum = alen + n + 1
+                line = sprintf("S%d%02X", type, alen + n + 1)
+                for (i = alen - 1; i >= 0; i--) {
+                        b = int(addr / 256 ^ i) % 256
+                        sum += b
+                        line = line sprintf("%02X", b)
+                }
+                for (i = 0; i < n; i++) {
+                        b = (seed * 131 + addr * 7 + i * 13) % 256
+                        sum += b
+                        line = line sprintf("%02X", b)
+                }
+                print line sprintf("%02X", 255 - sum % 256)
+        }
+        BEGIN {
+                for (r = 0; r < nrec; r++)
+                        put(2, r * 32, 3, 32)
+                put(8, 0, 3, 0)
+        }'
+}
+
+# Start the device, with options "$@", and wait for it to answer
+mock()
+{
+        ./hti-mock-device -a "$addr" -E 200 -c crc32 -S 1 "$@" "$target" \
+                >"$tmp/mock.log" 2>&1 &
+        pid=$!
+        for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+                if ./hti-tcp-reflash --discover="$addr" --numeric \
+                        2>/dev/null | grep -q "^$addr "; then
+                        return 0
+                fi
+                if ! kill -0 "$pid" 2>/dev/null; then
+                        cat "$tmp/mock.log"
+                        pid=
+                        exit 77
+                fi
+                sleep 1
+        done
+        echo "hti-mock-device does not answer on $addr"
+        exit 1
+}
+
+unmock()
+{
+        kill "$pid"
+        wait "$pid" 2>/dev/null
+        pid=
+}
+
+# Reflash $1 with options "$@" after it, expecting success
+reflash()
+{
+        file=$1
+        shift
+        echo "hti-tcp-reflash $* $target $file"
+        if ! ./hti-tcp-reflash --no-journal --no-profiles -c crc32 \
+                -i "$addr" "$@" "$target" "$tmp/$file" >"$tmp/out" 2>&1; then
+                cat "$tmp/out"
+                echo "FAIL: reflash of $target failed"
+                exit 1
+        fi
+}
+
+image 1 >"$tmp/one.s28"
+image 2 >"$tmp/two.s28"
+
+mock
+reflash one.s28
+reflash one.s28
+if ! grep -q "already holds this image" "$tmp/out"; then
+        cat "$tmp/out"
+        echo "FAIL: $target not found up to date"
+        exit 1
+fi
+# Verified against the checksum of the image, so the data is right
+reflash two.s28 $fast
+unmock
+
+mock -x 0.01
+reflash one.s28 --retries=20
+if ! grep -q "Connection lost" "$tmp/out"; then
+        echo "FAIL: no connection was dropped"
+        exit 1
+fi
+unmock
+exit 0
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2018, Highland Technology
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * Alternatively, this software may be distributed under the terms of the
+ * GNU General Public License ("GPL") version 2 as published by the Free
+ * Software Foundation.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Unit tests of the upgrade file parsers, for "make check".
+ *
+ * Every case is a file, S-records, Intel HEX, ELF or raw binary, put
+ * through image_load() from a temporary file, as a file on disk would
+ * be.  A file that must load is checked for its record count, the
+ * address range it writes, the entry point in its termination record
+ * and the CRC-32 of the flash contents it leaves behind.  One that must
+ * not is checked for the error message that says why.  The data are
+ * cut into records of at most PARSE_MAXDATA bytes, so that the formats
+ * other than S-records make more than one.
+ *
+ * The ELF files are built here, 32-bit little-endian and 64-bit
+ * big-endian, rather than kept as binaries.
+ */
+#include "reflash.h"
+#include <elf.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+        PARSE_MAXDATA = 8,
+        /* Where the ELF files built here have their data */
+        PARSE_ELF_DATA = 0x100,
+        PARSE_ELF_SIZE = PARSE_ELF_DATA + 8,
+};
+
+/**
+ * struct parse_expect_t - What a file must make
+ * @error: Part of the error it must be refused with, or NULL if it must
+ *         load
+ * @nrec:  Records in the image, header and termination included
+ * @lo:    Lowest address written
+ * @hi:    Highest address written
+ * @entry: Address of the termination record
+ * @crc:   REFLASH_CKSUM_CRC32 of the flash contents, from @lo to @hi
+ */
+struct parse_expect_t {
+        const char *error;
+        int nrec;
+        uint32_t lo;
+        uint32_t hi;
+        uint32_t entry;
+        uint32_t crc;
+};
+
+/* A file that must be refused with @msg */
+#define PARSE_REFUSED(msg) { msg, 0, 0, 0, 0, 0 }
+
+static const struct parse_case_t {
+        const char *name;
+        int format;
+        const char *text;
+        struct parse_expect_t expect;
+} text_cases[] = {
+        { "srec", REFLASH_IMAGE_AUTO,
+          "S00600004844521B\n"
+          "S1131000000102030405060708090A0B0C0D0E0F64\n"
+          "S10B1010101112131415161738\n"
+          "S9030000FC\n",
+          { NULL, 4, 0x1000, 0x1017, 0, 0x8295a696 } },
+        { "srec-s3-crlf", REFLASH_IMAGE_SREC,
+          "S30920000000DEADBEEF9E\r\n"
+          "\r\n"
+          "S5030001FB\r\n"
+          "S70520000000DA\r\n",
+          { NULL, 3, 0x20000000, 0x20000003, 0x20000000, 0x7c9ca35a } },
+        { "srec-gap", REFLASH_IMAGE_AUTO,
+          "S2060001000102F5\n"
+          "S20500010405F0\n"
+          "S804000000FB\n",
+          { NULL, 3, 0x100, 0x104, 0, 0x0c9d2b36 } },
+        { "srec-checksum", REFLASH_IMAGE_AUTO,
+          "S00600004844521B\n"
+          "S1131000000102030405060708090A0B0C0D0E0F65\n"
+          "S9030000FC\n",
+          PARSE_REFUSED(":2: bad checksum") },
+        { "srec-hex", REFLASH_IMAGE_AUTO,
+          "S1131000000102030405060708090A0B0C0D0E0G64\n"
+          "S9030000FC\n",
+          PARSE_REFUSED(":1: invalid hex digit") },
+        { "srec-count", REFLASH_IMAGE_AUTO,
+          "S1141000000102030405060708090A0B0C0D0E0F64\n"
+          "S9030000FC\n",
+          PARSE_REFUSED(":1: byte count does not match record length") },
+        { "srec-truncated", REFLASH_IMAGE_AUTO,
+          "S00600004844521B\n"
+          "S1131000000102030405060708090A0B0C0D0E0F64\n",
+          PARSE_REFUSED("no termination record") },
+        { "srec-overlap", REFLASH_IMAGE_AUTO,
+          "S107001001020304DE\n"
+          "S104001209E0\n"
+          "S9030000FC\n",
+          PARSE_REFUSED(":2: data overlaps line 1") },
+        { "srec-s5", REFLASH_IMAGE_AUTO,
+          "S104001001EA\n"
+          "S5030002FA\n"
+          "S9030000FC\n",
+          PARSE_REFUSED(":2: record count 2, but 1 data records precede it") },
+        { "srec-after-end", REFLASH_IMAGE_AUTO,
+          "S104001001EA\n"
+          "S9030000FC\n"
+          "S104002001DA\n",
+          PARSE_REFUSED(":2: records after the termination record") },
+        { "ihex", REFLASH_IMAGE_AUTO,
+          ":020000040800F2\n"
+          ":10000000202122232425262728292A2B2C2D2E2F78\n"
+          ":04001000A0A1A2A366\n"
+          ":0400000508000010DF\n"
+          ":00000001FF\n",
+          { NULL, 5, 0x08000000, 0x08000013, 0x08000010, 0xc18f2ca5 } },
+        { "ihex-segment", REFLASH_IMAGE_IHEX,
+          ":020000021000EC\r\n"
+          ":0300000011223397\r\n"
+          ":00000001FF\r\n",
+          { NULL, 3, 0x10000, 0x10002, 0, 0xfac73763 } },
+        { "ihex-checksum", REFLASH_IMAGE_AUTO,
+          ":0100000001FF\n"
+          ":00000001FF\n",
+          PARSE_REFUSED(":1: bad checksum") },
+        { "ihex-record", REFLASH_IMAGE_AUTO,
+          ":0100000001FE\n"
+          "0100000001FE\n"
+          ":00000001FF\n",
+          PARSE_REFUSED(":2: not an Intel HEX record") },
+        { "ihex-type", REFLASH_IMAGE_AUTO,
+          ":0100000601F8\n"
+          ":00000001FF\n",
+          PARSE_REFUSED(":1: unknown record type") },
+        { "ihex-truncated", REFLASH_IMAGE_AUTO,
+          ":0100000001FE\n",
+          PARSE_REFUSED("no end-of-file record") },
+        { "ihex-overlap", REFLASH_IMAGE_AUTO,
+          ":03001000010203E7\n"
+          ":0100110004EA\n"
+          ":00000001FF\n",
+          PARSE_REFUSED("data of line 2 overlaps line 1") },
+        { "unknown", REFLASH_IMAGE_AUTO,
+          "hello\n",
+          PARSE_REFUSED("not S-records, Intel HEX or ELF") },
+        { "elf-not", REFLASH_IMAGE_ELF,
+          "\177ELG\n",
+          PARSE_REFUSED("not an ELF file") },
+        { NULL },
+};
+
+/* Field of @size bytes at @off of @buf, in the byte order @big */
+static void
+elf_put(unsigned char *buf, size_t off, int size, uint64_t v, int big)
+{
+        int i;
+
+        for (i = 0; i < size; ++i)
+                buf[off + i] = v >> 8 * (big ? size - 1 - i : i);
+}
+
+#define ELF_PUT(buf, type, field, v, big) \
+        elf_put(buf, offsetof(type, field), sizeof(((type *)0)->field), v, \
+                big)
+
+/*
+ * An ELF file with @filesz bytes at @paddr, counting up from @first, and
+ * a .bss-like segment 4 KiB higher that takes no room in the file
+ */
+static void
+elf_build(unsigned char *buf, int is64, int big, uint64_t entry,
+          uint64_t paddr, uint64_t filesz, unsigned char first)
+{
+        size_t ehsize = is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+        size_t phsize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+        int i;
+
+        memset(buf, 0, PARSE_ELF_SIZE);
+        memcpy(buf, ELFMAG, SELFMAG);
+        buf[EI_CLASS] = is64 ? ELFCLASS64 : ELFCLASS32;
+        buf[EI_DATA] = big ? ELFDATA2MSB : ELFDATA2LSB;
+        buf[EI_VERSION] = EV_CURRENT;
+        for (i = 0; i < 8; ++i)
+                buf[PARSE_ELF_DATA + i] = first + i;
+        for (i = 0; i < 2; ++i) {
+                unsigned char *ph = buf + ehsize + i * phsize;
+                uint64_t off = PARSE_ELF_DATA + 8 * i;
+                uint64_t addr = paddr + 0x1000 * i;
+                uint64_t len = i == 0 ? filesz : 0;
+
+                if (is64) {
+                        ELF_PUT(ph, Elf64_Phdr, p_type, PT_LOAD, big);
+                        ELF_PUT(ph, Elf64_Phdr, p_offset, off, big);
+                        ELF_PUT(ph, Elf64_Phdr, p_vaddr, addr, big);
+                        ELF_PUT(ph, Elf64_Phdr, p_paddr, addr, big);
+                        ELF_PUT(ph, Elf64_Phdr, p_filesz, len, big);
+                        ELF_PUT(ph, Elf64_Phdr, p_memsz, 0x100, big);
+                } else {
+                        ELF_PUT(ph, Elf32_Phdr, p_type, PT_LOAD, big);
+                        ELF_PUT(ph, Elf32_Phdr, p_offset, off, big);
+                        ELF_PUT(ph, Elf32_Phdr, p_vaddr, addr, big);
+                        ELF_PUT(ph, Elf32_Phdr, p_paddr, addr, big);
+                        ELF_PUT(ph, Elf32_Phdr, p_filesz, len, big);
+                        ELF_PUT(ph, Elf32_Phdr, p_memsz, 0x100, big);
+                }
+        }
+        if (is64) {
+                ELF_PUT(buf, Elf64_Ehdr, e_type, ET_EXEC, big);
+                ELF_PUT(buf, Elf64_Ehdr, e_version, EV_CURRENT, big);
+                ELF_PUT(buf, Elf64_Ehdr, e_entry, entry, big);
+                ELF_PUT(buf, Elf64_Ehdr, e_phoff, ehsize, big);
+                ELF_PUT(buf, Elf64_Ehdr, e_ehsize, ehsize, big);
+                ELF_PUT(buf, Elf64_Ehdr, e_phentsize, phsize, big);
+                ELF_PUT(buf, Elf64_Ehdr, e_phnum, 2, big);
+        } else {
+                ELF_PUT(buf, Elf32_Ehdr, e_type, ET_EXEC, big);
+                ELF_PUT(buf, Elf32_Ehdr, e_version, EV_CURRENT, big);
+                ELF_PUT(buf, Elf32_Ehdr, e_entry, entry, big);
+                ELF_PUT(buf, Elf32_Ehdr, e_phoff, ehsize, big);
+                ELF_PUT(buf, Elf32_Ehdr, e_ehsize, ehsize, big);
+                ELF_PUT(buf, Elf32_Ehdr, e_phentsize, phsize, big);
+                ELF_PUT(buf, Elf32_Ehdr, e_phnum, 2, big);
+        }
+}
+
+/* Load the @len bytes at @buf as @name; return 0 if as @e says, else -1 */
+static int
+parse_check(const char *name, int format, uint32_t base, const void *buf,
+            size_t len, const struct parse_expect_t *e)
+{
+        struct srec_image_t *img;
+        char *msg = NULL;
+        size_t msglen;
+        FILE *fp, *err;
+        uint32_t crc;
+        int res = -1;
+
+        if ((fp = tmpfile()) == NULL
+            || fwrite(buf, 1, len, fp) != len || fseek(fp, 0, SEEK_SET) < 0
+            || (err = open_memstream(&msg, &msglen)) == NULL) {
+                perror(name);
+                exit(99);
+        }
+        img = image_load(fp, name, err, format, base, SREC_TEXT_MAX,
+                         PARSE_MAXDATA);
+        fclose(err);
+        fclose(fp);
+
+        if (img == NULL && e->error == NULL) {
+                printf("FAIL: %s: refused: %s", name, msg);
+        } else if (img == NULL && strstr(msg, e->error) == NULL) {
+                printf("FAIL: %s: refused with \"%s\", not \"%s\"\n", name,
+                       strtok(msg, "\n"), e->error);
+        } else if (img == NULL) {
+                printf("PASS: %s: %s", name, msg);
+                res = 0;
+        } else if (e->error != NULL) {
+                printf("FAIL: %s: loaded, not refused with \"%s\"\n", name,
+                       e->error);
+        } else if (img->nrec != e->nrec || img->lo != e->lo
+                   || img->hi != e->hi
+                   || img->rec[img->nrec - 1].addr != e->entry) {
+                printf("FAIL: %s: %d records, 0x%lX to 0x%lX, entry 0x%lX; "
+                       "not %d, 0x%lX to 0x%lX, entry 0x%lX\n", name,
+                       img->nrec, (unsigned long)img->lo,
+                       (unsigned long)img->hi,
+                       (unsigned long)img->rec[img->nrec - 1].addr,
+                       e->nrec, (unsigned long)e->lo, (unsigned long)e->hi,
+                       (unsigned long)e->entry);
+        } else if ((crc = srec_checksum(img, REFLASH_CKSUM_CRC32))
+                   != e->crc) {
+                printf("FAIL: %s: CRC-32 %08lX, not %08lX\n", name,
+                       (unsigned long)crc, (unsigned long)e->crc);
+        } else {
+                printf("PASS: %s\n", name);
+                res = 0;
+        }
+        if (img != NULL)
+                srec_free(img);
+        free(msg);
+        return res;
+}
+
+int
+main(void)
+{
+        static const struct parse_expect_t bin = {
+                NULL, 3, 0x4000, 0x4003, 0x4000, 0xb77e839a
+        };
+        static const struct parse_expect_t elf32 = {
+                NULL, 3, 0x2000, 0x2007, 0x2001, 0xdfbc5646
+        };
+        static const struct parse_expect_t elf64 = {
+                NULL, 3, 0x10000000, 0x10000005, 0x10000004, 0xfa938181
+        };
+        static const struct parse_expect_t elf_past =
+                PARSE_REFUSED("segment 0 runs past the end of the file");
+        const struct parse_case_t *c;
+        unsigned char elf[PARSE_ELF_SIZE];
+        int nfail = 0;
+
+        for (c = text_cases; c->name != NULL; ++c) {
+                if (parse_check(c->name, c->format, 0, c->text,
+                                strlen(c->text), &c->expect) < 0)
+                        nfail++;
+        }
+        if (parse_check("bin", REFLASH_IMAGE_BIN, 0x4000, "\1\2\0\377", 4,
+                        &bin) < 0)
+                nfail++;
+        elf_build(elf, 0, 0, 0x2001, 0x2000, 8, 0x40);
+        if (parse_check("elf32-lsb", REFLASH_IMAGE_AUTO, 0, elf,
+                        sizeof(elf), &elf32) < 0)
+                nfail++;
+        elf_build(elf, 1, 1, 0x10000004, 0x10000000, 6, 0x60);
+        if (parse_check("elf64-msb", REFLASH_IMAGE_AUTO, 0, elf,
+                        sizeof(elf), &elf64) < 0)
+                nfail++;
+        elf_build(elf, 0, 0, 0x2001, 0x2000, 0x1000, 0x40);
+        if (parse_check("elf-past-end", REFLASH_IMAGE_AUTO, 0, elf,
+                        sizeof(elf), &elf_past) < 0)
+                nfail++;
+        return nfail > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}